@@ -0,0 +1,1017 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "realtime.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The configuration of external-recorder.
+ *
+ * All the options are described in the options[] table below, with their
+ * default value and the allowed range. The values come, in that order, from
+ * the defaults, the configuration file (GKeyFile format) and the --set command
+ * line options. Each value is validated when it is set, so an invalid
+ * configuration is reported at startup and not when the value is used.
+ */
+
+typedef enum
+{
+	OPTION_TYPE_BOOLEAN,
+	OPTION_TYPE_INT,
+	OPTION_TYPE_DOUBLE,
+	OPTION_TYPE_STRING,
+	OPTION_TYPE_PATH,
+	OPTION_TYPE_ENDPOINT,
+	OPTION_TYPE_OPTIONAL_ENDPOINT,
+	OPTION_TYPE_OUTPUT_FORMAT,
+	OPTION_TYPE_CPU_LIST,
+	OPTION_TYPE_NAME
+} OptionType;
+
+typedef struct _OptionInfo OptionInfo;
+struct _OptionInfo
+{
+	const char *group;
+	const char *key;
+	OptionType type;
+	gsize offset;
+
+	/* For OPTION_TYPE_INT and OPTION_TYPE_DOUBLE. The strictly positive
+	 * doubles are checked by config_validate().
+	 */
+	int min;
+	int max;
+
+	/* %NULL if the option must be set. */
+	const char *default_value;
+};
+
+static const OptionInfo options[] =
+{
+	{ "general", "debug", OPTION_TYPE_BOOLEAN,
+	  G_STRUCT_OFFSET (Config, debug), 0, 0, "false" },
+
+	/* To designate this Pupil Capture instance in the requests, when
+	 * there are [source:NAME] groups.
+	 */
+	{ "pupil", "name", OPTION_TYPE_NAME,
+	  G_STRUCT_OFFSET (Config, pupil_name), 0, 0, "main" },
+	{ "pupil", "remote-address", OPTION_TYPE_ENDPOINT,
+	  G_STRUCT_OFFSET (Config, pupil_remote_address), 0, 0, "tcp://localhost:50020" },
+	{ "pupil", "subscriber-host", OPTION_TYPE_STRING,
+	  G_STRUCT_OFFSET (Config, subscriber_host), 0, 0, "localhost" },
+	{ "pupil", "subscription", OPTION_TYPE_STRING,
+	  G_STRUCT_OFFSET (Config, subscription), 0, 0, "gaze" },
+	{ "pupil", "remote-timeout-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, pupil_remote_timeout_ms), 1, 60000, "1000" },
+	{ "pupil", "subscriber-hwm", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, subscriber_hwm), 0, 10000000, "1000" },
+	{ "pupil", "reconnect-silence-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, pupil_reconnect_silence_ms), 100, 3600000, "2000" },
+	{ "pupil", "reconnect-max-backoff-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, pupil_reconnect_max_backoff_ms), 100, 600000, "5000" },
+
+	{ "replier", "endpoint", OPTION_TYPE_ENDPOINT,
+	  G_STRUCT_OFFSET (Config, replier_endpoint), 0, 0, "tcp://*:6000" },
+	{ "replier", "timeout-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, replier_timeout_ms), 1, 100, "10" },
+	{ "replier", "send-hwm", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, replier_send_hwm), 0, 10000000, "1000" },
+	{ "replier", "curve-secret-key-file", OPTION_TYPE_PATH,
+	  G_STRUCT_OFFSET (Config, replier_curve_secret_key_file), 0, 0, "" },
+	{ "replier", "curve-authorized-keys-file", OPTION_TYPE_PATH,
+	  G_STRUCT_OFFSET (Config, replier_curve_authorized_keys_file), 0, 0, "" },
+
+	/* 10 minutes at 200 Hz. */
+	{ "store", "capacity", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, store_capacity), 1, 100000000, "120000" },
+	{ "store", "prefault", OPTION_TYPE_BOOLEAN,
+	  G_STRUCT_OFFSET (Config, prefault_store), 0, 0, "false" },
+	/* False: the samples returned by receive_data are discarded. */
+	{ "store", "keep-received", OPTION_TYPE_BOOLEAN,
+	  G_STRUCT_OFFSET (Config, store_keep_received), 0, 0, "false" },
+
+	{ "output", "receive-data-format", OPTION_TYPE_OUTPUT_FORMAT,
+	  G_STRUCT_OFFSET (Config, receive_data_format), 0, 0, "text" },
+	{ "output", "zstd-level", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, zstd_level), 1, 19, "1" },
+
+	/* Empty: no change. */
+	{ "realtime", "cpu-affinity", OPTION_TYPE_CPU_LIST,
+	  G_STRUCT_OFFSET (Config, cpu_affinity), 0, 0, "" },
+	/* 0: keep the default scheduling policy. */
+	{ "realtime", "sched-fifo-priority", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, sched_fifo_priority), 0, 99, "0" },
+	{ "realtime", "lock-memory", OPTION_TYPE_BOOLEAN,
+	  G_STRUCT_OFFSET (Config, lock_memory), 0, 0, "false" },
+
+	{ "filter", "enabled", OPTION_TYPE_BOOLEAN,
+	  G_STRUCT_OFFSET (Config, filter_enabled), 0, 0, "false" },
+	{ "filter", "min-cutoff-hz", OPTION_TYPE_DOUBLE,
+	  G_STRUCT_OFFSET (Config, filter_min_cutoff_hz), 0, 1000, "1" },
+	{ "filter", "beta", OPTION_TYPE_DOUBLE,
+	  G_STRUCT_OFFSET (Config, filter_beta), 0, 1000, "2" },
+	{ "filter", "derivative-cutoff-hz", OPTION_TYPE_DOUBLE,
+	  G_STRUCT_OFFSET (Config, filter_derivative_cutoff_hz), 0, 1000, "1" },
+	{ "filter", "min-confidence", OPTION_TYPE_DOUBLE,
+	  G_STRUCT_OFFSET (Config, filter_min_confidence), 0, 1, "0.6" },
+	/* In normalized units per second. */
+	{ "filter", "saccade-velocity", OPTION_TYPE_DOUBLE,
+	  G_STRUCT_OFFSET (Config, filter_saccade_velocity), 0, 1000, "1" },
+	{ "filter", "cost-budget-ns", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, filter_cost_budget_ns), 1, 1000000, "1000" },
+
+	/* The export request writes only there. Empty: the export request is
+	 * disabled.
+	 */
+	{ "export", "directory", OPTION_TYPE_PATH,
+	  G_STRUCT_OFFSET (Config, export_directory), 0, 0, "" },
+
+	/* Empty: the session is not saved. */
+	{ "shutdown", "export-path", OPTION_TYPE_PATH,
+	  G_STRUCT_OFFSET (Config, shutdown_export_path), 0, 0, "" },
+
+	/* Empty: no shared memory. */
+	{ "shm", "name", OPTION_TYPE_PATH,
+	  G_STRUCT_OFFSET (Config, shm_name), 0, 0, "" },
+	/* 8 MB, 5 minutes at 200 Hz. Must be a power of two. */
+	{ "shm", "n-slots", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, shm_n_slots), 16, 16777216, "65536" },
+
+	{ "load", "adaptive", OPTION_TYPE_BOOLEAN,
+	  G_STRUCT_OFFSET (Config, load_adaptive), 0, 0, "true" },
+	{ "load", "quiet-lag-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, load_quiet_lag_ms), 1, 60000, "20" },
+	{ "load", "defer-lag-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, load_defer_lag_ms), 1, 60000, "50" },
+	{ "load", "decimate-lag-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, load_decimate_lag_ms), 1, 60000, "100" },
+	/* Decode N times fewer frames in the decimate mode, when not
+	 * recording: multiplies idle.decode-interval, which is 1 with the
+	 * shared memory.
+	 */
+	{ "load", "decimation", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, load_decimation), 1, 1000, "4" },
+	/* Pupil messages read before checking the requests again. */
+	{ "load", "max-messages-per-iteration", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, load_max_messages_per_iteration), 1, 1000000, "100" },
+
+	/* Decode 1 frame out of N while not recording, only the timestamp of
+	 * the others is read. 1 to decode all the frames.
+	 */
+	{ "idle", "decode-interval", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, idle_decode_interval), 1, 100000, "50" },
+
+	/* The heartbeats and alarms are published there. */
+	{ "watchdog", "endpoint", OPTION_TYPE_OPTIONAL_ENDPOINT,
+	  G_STRUCT_OFFSET (Config, watchdog_endpoint), 0, 0, "auto" },
+	{ "watchdog", "heartbeat-interval-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, watchdog_heartbeat_interval_ms), 10, 60000, "1000" },
+	/* The budgets, 0 to disable the alarm. */
+	{ "watchdog", "frame-age-budget-ms", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, watchdog_frame_age_budget_ms), 0, 3600000, "500" },
+	{ "watchdog", "loop-jitter-budget-us", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, watchdog_loop_jitter_budget_us), 0, 10000000, "2000" },
+	{ "watchdog", "reply-latency-budget-us", OPTION_TYPE_INT,
+	  G_STRUCT_OFFSET (Config, watchdog_reply_latency_budget_us), 0, 10000000, "10000" }
+};
+
+/* The keys of the [source:NAME] groups, the other Pupil Capture instances.
+ * The other [pupil] options apply to all the sources.
+ */
+static const OptionInfo source_options[] =
+{
+	{ "source", "remote-address", OPTION_TYPE_ENDPOINT,
+	  G_STRUCT_OFFSET (SourceConfig, remote_address), 0, 0, NULL },
+	{ "source", "subscriber-host", OPTION_TYPE_STRING,
+	  G_STRUCT_OFFSET (SourceConfig, subscriber_host), 0, 0, "localhost" },
+	{ "source", "subscription", OPTION_TYPE_STRING,
+	  G_STRUCT_OFFSET (SourceConfig, subscription), 0, 0, "gaze" }
+};
+
+#define SOURCE_GROUP_PREFIX "source:"
+
+static const char *output_formats[] =
+{
+	"text",
+	"binary",
+	"zstd"
+};
+
+G_DEFINE_QUARK (config-error-quark, config_error)
+
+static const OptionInfo *
+find_option (const OptionInfo *table,
+	     guint             n_options,
+	     const char       *group,
+	     const char       *key)
+{
+	guint i;
+
+	for (i = 0; i < n_options; i++)
+	{
+		if (g_str_equal (table[i].group, group) &&
+		    g_str_equal (table[i].key, key))
+		{
+			return &table[i];
+		}
+	}
+
+	return NULL;
+}
+
+static gboolean
+parse_boolean (const char *str,
+	       gboolean   *value)
+{
+	if (g_str_equal (str, "true") || g_str_equal (str, "1"))
+	{
+		*value = TRUE;
+		return TRUE;
+	}
+
+	if (g_str_equal (str, "false") || g_str_equal (str, "0"))
+	{
+		*value = FALSE;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+parse_int (const char *str,
+	   int         min,
+	   int         max,
+	   int        *value)
+{
+	gint64 parsed;
+	char *end = NULL;
+
+	if (str[0] == '\0')
+	{
+		return FALSE;
+	}
+
+	errno = 0;
+	parsed = g_ascii_strtoll (str, &end, 10);
+	if (errno != 0 || *end != '\0' || parsed < min || parsed > max)
+	{
+		return FALSE;
+	}
+
+	*value = parsed;
+	return TRUE;
+}
+
+static gboolean
+parse_double (const char *str,
+	      int         min,
+	      int         max,
+	      double     *value)
+{
+	double parsed;
+	char *end = NULL;
+
+	if (str[0] == '\0')
+	{
+		return FALSE;
+	}
+
+	errno = 0;
+	parsed = g_ascii_strtod (str, &end);
+	if (errno != 0 || *end != '\0' || !(parsed >= min && parsed <= max))
+	{
+		return FALSE;
+	}
+
+	*value = parsed;
+	return TRUE;
+}
+
+static gboolean
+is_valid_endpoint (const char *str)
+{
+	return ((g_str_has_prefix (str, "tcp://") ||
+		 g_str_has_prefix (str, "ipc://") ||
+		 g_str_has_prefix (str, "inproc://")) &&
+		strstr (str, "://")[3] != '\0');
+}
+
+/* The names can be used in the requests, which are split on spaces. */
+static gboolean
+is_valid_name (const char *str)
+{
+	const char *p;
+
+	if (str[0] == '\0')
+	{
+		return FALSE;
+	}
+
+	for (p = str; *p != '\0'; p++)
+	{
+		if (!g_ascii_isalnum (*p) && *p != '-' && *p != '_')
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+parse_output_format (const char *str,
+		     int        *value)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (output_formats); i++)
+	{
+		if (g_str_equal (str, output_formats[i]))
+		{
+			*value = i;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+is_valid_cpu_list (const char *str)
+{
+	GArray *cpus;
+	gboolean valid;
+
+	if (str[0] == '\0')
+	{
+		return TRUE;
+	}
+
+	if (!realtime_parse_cpu_list (str, &cpus, NULL))
+	{
+		return FALSE;
+	}
+
+	valid = cpus->len > 0;
+	g_array_free (cpus, TRUE);
+
+	return valid;
+}
+
+static void
+set_string (gpointer    field,
+	    const char *value)
+{
+	g_free (*(char **) field);
+	*(char **) field = g_strdup (value);
+}
+
+static gboolean
+is_string_option (const OptionInfo *option)
+{
+	return (option->type == OPTION_TYPE_STRING ||
+		option->type == OPTION_TYPE_PATH ||
+		option->type == OPTION_TYPE_ENDPOINT ||
+		option->type == OPTION_TYPE_OPTIONAL_ENDPOINT ||
+		option->type == OPTION_TYPE_CPU_LIST ||
+		option->type == OPTION_TYPE_NAME);
+}
+
+/* Sets the field of @option in @base, a Config or a SourceConfig. @group is
+ * for the error message.
+ */
+static gboolean
+set_option (gpointer           base,
+	    const char        *group,
+	    const OptionInfo  *option,
+	    const char        *value,
+	    GError           **error)
+{
+	gpointer field = G_STRUCT_MEMBER_P (base, option->offset);
+	gboolean valid = FALSE;
+
+	switch (option->type)
+	{
+		case OPTION_TYPE_BOOLEAN:
+			valid = parse_boolean (value, field);
+			break;
+
+		case OPTION_TYPE_INT:
+			valid = parse_int (value, option->min, option->max, field);
+			break;
+
+		case OPTION_TYPE_DOUBLE:
+			valid = parse_double (value, option->min, option->max, field);
+			break;
+
+		case OPTION_TYPE_ENDPOINT:
+			if (!is_valid_endpoint (value))
+			{
+				break;
+			}
+			/* Fall through */
+
+		case OPTION_TYPE_STRING:
+			if (value[0] == '\0')
+			{
+				break;
+			}
+
+			set_string (field, value);
+			valid = TRUE;
+			break;
+
+		case OPTION_TYPE_PATH:
+			set_string (field, value);
+			valid = TRUE;
+			break;
+
+		case OPTION_TYPE_OPTIONAL_ENDPOINT:
+			valid = (value[0] == '\0' ||
+				 g_str_equal (value, "auto") ||
+				 is_valid_endpoint (value));
+			if (valid)
+			{
+				set_string (field, value);
+			}
+			break;
+
+		case OPTION_TYPE_OUTPUT_FORMAT:
+			valid = parse_output_format (value, field);
+			break;
+
+		case OPTION_TYPE_CPU_LIST:
+			valid = is_valid_cpu_list (value);
+			if (valid)
+			{
+				set_string (field, value);
+			}
+			break;
+
+		case OPTION_TYPE_NAME:
+			valid = is_valid_name (value);
+			if (valid)
+			{
+				set_string (field, value);
+			}
+			break;
+
+		default:
+			g_assert_not_reached ();
+	}
+
+	if (!valid)
+	{
+		char *expected;
+
+		switch (option->type)
+		{
+			case OPTION_TYPE_BOOLEAN:
+				expected = g_strdup ("true or false");
+				break;
+
+			case OPTION_TYPE_INT:
+				expected = g_strdup_printf ("an integer between %d and %d",
+							    option->min,
+							    option->max);
+				break;
+
+			case OPTION_TYPE_DOUBLE:
+				expected = g_strdup_printf ("a number between %d and %d",
+							    option->min,
+							    option->max);
+				break;
+
+			case OPTION_TYPE_ENDPOINT:
+				expected = g_strdup ("a ZeroMQ endpoint (tcp://, ipc:// or inproc://)");
+				break;
+
+			case OPTION_TYPE_OPTIONAL_ENDPOINT:
+				expected = g_strdup ("a ZeroMQ endpoint (tcp://, ipc:// or inproc://), "
+						     "auto, or nothing");
+				break;
+
+			case OPTION_TYPE_OUTPUT_FORMAT:
+				expected = g_strdup ("text, binary or zstd");
+				break;
+
+			case OPTION_TYPE_CPU_LIST:
+				expected = g_strdup ("a list of CPUs like \"2,3\" or \"0-1\", or nothing");
+				break;
+
+			case OPTION_TYPE_NAME:
+				expected = g_strdup ("a name made of letters, digits, '-' and '_'");
+				break;
+
+			case OPTION_TYPE_STRING:
+			default:
+				expected = g_strdup ("a non-empty string");
+				break;
+		}
+
+		g_set_error (error,
+			     CONFIG_ERROR,
+			     CONFIG_ERROR_INVALID_VALUE,
+			     "Invalid value \"%s\" for %s.%s, expected %s.",
+			     value,
+			     group,
+			     option->key,
+			     expected);
+
+		g_free (expected);
+	}
+
+	return valid;
+}
+
+static void
+set_default_values (gpointer          base,
+		    const OptionInfo *table,
+		    guint             n_options)
+{
+	guint i;
+
+	for (i = 0; i < n_options; i++)
+	{
+		gboolean ok;
+
+		if (table[i].default_value == NULL)
+		{
+			continue;
+		}
+
+		ok = set_option (base, table[i].group, &table[i], table[i].default_value, NULL);
+		g_assert (ok);
+	}
+}
+
+static void
+free_string_values (gpointer          base,
+		    const OptionInfo *table,
+		    guint             n_options)
+{
+	guint i;
+
+	for (i = 0; i < n_options; i++)
+	{
+		if (is_string_option (&table[i]))
+		{
+			g_free (G_STRUCT_MEMBER (char *, base, table[i].offset));
+		}
+	}
+}
+
+static void
+source_config_free (gpointer data)
+{
+	SourceConfig *source = data;
+
+	free_string_values (source, source_options, G_N_ELEMENTS (source_options));
+	g_free (source->name);
+	g_free (source);
+}
+
+/* Returns: the source @name, created with the default values if needed. */
+static SourceConfig *
+get_source (Config     *config,
+	    const char *name)
+{
+	SourceConfig *source;
+	guint i;
+
+	for (i = 0; i < config->sources->len; i++)
+	{
+		source = g_ptr_array_index (config->sources, i);
+
+		if (g_str_equal (source->name, name))
+		{
+			return source;
+		}
+	}
+
+	source = g_new0 (SourceConfig, 1);
+	source->name = g_strdup (name);
+	set_default_values (source, source_options, G_N_ELEMENTS (source_options));
+	g_ptr_array_add (config->sources, source);
+
+	return source;
+}
+
+/* Returns: a new Config with the default values. */
+Config *
+config_new (void)
+{
+	Config *config;
+
+	config = g_new0 (Config, 1);
+	set_default_values (config, options, G_N_ELEMENTS (options));
+	config->sources = g_ptr_array_new_with_free_func (source_config_free);
+
+	return config;
+}
+
+void
+config_free (Config *config)
+{
+	if (config == NULL)
+	{
+		return;
+	}
+
+	free_string_values (config, options, G_N_ELEMENTS (options));
+	g_ptr_array_free (config->sources, TRUE);
+	g_free (config);
+}
+
+gboolean
+config_set_value (Config      *config,
+		  const char  *group,
+		  const char  *key,
+		  const char  *value,
+		  GError     **error)
+{
+	const OptionInfo *option;
+
+	if (g_str_has_prefix (group, SOURCE_GROUP_PREFIX))
+	{
+		const char *name = group + strlen (SOURCE_GROUP_PREFIX);
+
+		option = find_option (source_options, G_N_ELEMENTS (source_options),
+				      "source", key);
+
+		if (option != NULL && !is_valid_name (name))
+		{
+			g_set_error (error,
+				     CONFIG_ERROR,
+				     CONFIG_ERROR_INVALID_VALUE,
+				     "Invalid source name \"%s\", expected a name made of "
+				     "letters, digits, '-' and '_'.",
+				     name);
+			return FALSE;
+		}
+
+		if (option != NULL)
+		{
+			return set_option (get_source (config, name), group, option, value, error);
+		}
+	}
+	else
+	{
+		option = find_option (options, G_N_ELEMENTS (options), group, key);
+	}
+
+	if (option == NULL)
+	{
+		g_set_error (error,
+			     CONFIG_ERROR,
+			     CONFIG_ERROR_UNKNOWN_KEY,
+			     "Unknown configuration key %s.%s.",
+			     group,
+			     key);
+		return FALSE;
+	}
+
+	return set_option (config, group, option, value, error);
+}
+
+/* Loads the values present in @filename, in the GKeyFile format. Unknown keys
+ * are an error, to catch typos.
+ */
+gboolean
+config_load_file (Config      *config,
+		  const char  *filename,
+		  GError     **error)
+{
+	GKeyFile *key_file;
+	char **groups;
+	gboolean ok = FALSE;
+	guint group_num;
+
+	key_file = g_key_file_new ();
+
+	if (!g_key_file_load_from_file (key_file, filename, G_KEY_FILE_NONE, error))
+	{
+		g_prefix_error (error, "Error when loading %s: ", filename);
+		g_key_file_free (key_file);
+		return FALSE;
+	}
+
+	groups = g_key_file_get_groups (key_file, NULL);
+
+	for (group_num = 0; groups[group_num] != NULL; group_num++)
+	{
+		const char *group = groups[group_num];
+		char **keys;
+		guint key_num;
+
+		keys = g_key_file_get_keys (key_file, group, NULL, NULL);
+
+		for (key_num = 0; keys[key_num] != NULL; key_num++)
+		{
+			const char *key = keys[key_num];
+			char *value;
+
+			value = g_key_file_get_string (key_file, group, key, error);
+			if (value == NULL ||
+			    !config_set_value (config, group, key, value, error))
+			{
+				g_prefix_error (error, "%s: ", filename);
+				g_free (value);
+				g_strfreev (keys);
+				goto out;
+			}
+
+			g_free (value);
+		}
+
+		g_strfreev (keys);
+	}
+
+	ok = TRUE;
+
+out:
+	g_strfreev (groups);
+	g_key_file_free (key_file);
+	return ok;
+}
+
+/* Sets a value from a "group.key=value" assignment, for the --set command line
+ * option.
+ */
+gboolean
+config_parse_assignment (Config      *config,
+			 const char  *assignment,
+			 GError     **error)
+{
+	const char *equal;
+	const char *dot;
+	char *group;
+	char *key;
+	gboolean ok;
+
+	equal = strchr (assignment, '=');
+	dot = strchr (assignment, '.');
+
+	if (equal == NULL || dot == NULL || dot > equal)
+	{
+		g_set_error (error,
+			     CONFIG_ERROR,
+			     CONFIG_ERROR_INVALID_VALUE,
+			     "Invalid assignment \"%s\", expected group.key=value.",
+			     assignment);
+		return FALSE;
+	}
+
+	group = g_strndup (assignment, dot - assignment);
+	key = g_strndup (dot + 1, equal - dot - 1);
+
+	ok = config_set_value (config, group, key, equal + 1, error);
+
+	g_free (group);
+	g_free (key);
+	return ok;
+}
+
+/* Several external-recorders can run on the same computer, and libzmq
+ * removes an existing ipc file when binding, so the ipc path must be unique:
+ * it contains the port of the replier, or else the PID.
+ */
+static char *
+get_auto_watchdog_endpoint (const Config *config)
+{
+	const char *port = NULL;
+
+	if (g_str_has_prefix (config->replier_endpoint, "tcp://"))
+	{
+		port = strrchr (config->replier_endpoint, ':') + 1;
+
+		if (port[0] == '\0' ||
+		    strspn (port, "0123456789") != strlen (port))
+		{
+			port = NULL;
+		}
+	}
+
+	if (port != NULL)
+	{
+		return g_strdup_printf ("ipc:///tmp/external-recorder-watchdog-%s", port);
+	}
+
+	return g_strdup_printf ("ipc:///tmp/external-recorder-watchdog-pid%d", (int) getpid ());
+}
+
+static gboolean
+check_positive (double       value,
+		const char  *name,
+		GError     **error)
+{
+	if (value <= 0.0)
+	{
+		g_set_error (error,
+			     CONFIG_ERROR,
+			     CONFIG_ERROR_INVALID_VALUE,
+			     "Invalid value \"%g\" for %s, expected a number greater than 0.",
+			     value,
+			     name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Checks the constraints that the option table can't express, once all the
+ * values are set: the sources need a remote-address, their names must be
+ * unique, the load thresholds must be increasing, the filter cutoffs must be
+ * greater than 0, and shm.n-slots must be a power of two. Also replaces
+ * watchdog.endpoint=auto by the actual endpoint.
+ */
+gboolean
+config_validate (Config  *config,
+		 GError **error)
+{
+	guint i;
+
+	for (i = 0; i < config->sources->len; i++)
+	{
+		const SourceConfig *source = g_ptr_array_index (config->sources, i);
+
+		if (source->remote_address == NULL)
+		{
+			g_set_error (error,
+				     CONFIG_ERROR,
+				     CONFIG_ERROR_INVALID_VALUE,
+				     "Missing value for %s%s.remote-address.",
+				     SOURCE_GROUP_PREFIX,
+				     source->name);
+			return FALSE;
+		}
+
+		if (g_str_equal (source->name, config->pupil_name))
+		{
+			g_set_error (error,
+				     CONFIG_ERROR,
+				     CONFIG_ERROR_INVALID_VALUE,
+				     "The source name \"%s\" is already pupil.name.",
+				     source->name);
+			return FALSE;
+		}
+	}
+
+	if (config->load_quiet_lag_ms >= config->load_defer_lag_ms ||
+	    config->load_defer_lag_ms >= config->load_decimate_lag_ms)
+	{
+		g_set_error (error,
+			     CONFIG_ERROR,
+			     CONFIG_ERROR_INVALID_VALUE,
+			     "Invalid values for load.quiet-lag-ms (%d), load.defer-lag-ms (%d) "
+			     "and load.decimate-lag-ms (%d), expected increasing values.",
+			     config->load_quiet_lag_ms,
+			     config->load_defer_lag_ms,
+			     config->load_decimate_lag_ms);
+		return FALSE;
+	}
+
+	/* The time constant of the gaze filter is 1 / (2 pi cutoff): a zero
+	 * cutoff would freeze the filtered gaze on its first value.
+	 */
+	if (!check_positive (config->filter_min_cutoff_hz, "filter.min-cutoff-hz", error) ||
+	    !check_positive (config->filter_derivative_cutoff_hz, "filter.derivative-cutoff-hz", error))
+	{
+		return FALSE;
+	}
+
+	/* The ring index is masked with n-slots - 1. */
+	if ((config->shm_n_slots & (config->shm_n_slots - 1)) != 0)
+	{
+		g_set_error (error,
+			     CONFIG_ERROR,
+			     CONFIG_ERROR_INVALID_VALUE,
+			     "Invalid value \"%d\" for shm.n-slots, expected a power of two.",
+			     config->shm_n_slots);
+		return FALSE;
+	}
+
+	if (g_str_equal (config->watchdog_endpoint, "auto"))
+	{
+		g_free (config->watchdog_endpoint);
+		config->watchdog_endpoint = get_auto_watchdog_endpoint (config);
+	}
+
+	return TRUE;
+}
+
+static void
+add_option_to_key_file (GKeyFile         *key_file,
+			const char       *group,
+			const OptionInfo *option,
+			gpointer          base)
+{
+	gpointer field = G_STRUCT_MEMBER_P (base, option->offset);
+
+	switch (option->type)
+	{
+		case OPTION_TYPE_BOOLEAN:
+			g_key_file_set_boolean (key_file, group, option->key,
+						*(gboolean *) field);
+			break;
+
+		case OPTION_TYPE_INT:
+			g_key_file_set_integer (key_file, group, option->key,
+						*(int *) field);
+			break;
+
+		case OPTION_TYPE_DOUBLE:
+		{
+			char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+			/* Not g_key_file_set_double(), which writes 0.59999999999999998
+			 * for 0.6.
+			 */
+			g_ascii_formatd (buf, sizeof (buf), "%.15g", *(double *) field);
+			g_key_file_set_value (key_file, group, option->key, buf);
+			break;
+		}
+
+		case OPTION_TYPE_STRING:
+		case OPTION_TYPE_PATH:
+		case OPTION_TYPE_ENDPOINT:
+		case OPTION_TYPE_OPTIONAL_ENDPOINT:
+		case OPTION_TYPE_CPU_LIST:
+		case OPTION_TYPE_NAME:
+			/* %NULL for a missing value. */
+			if (*(char **) field != NULL)
+			{
+				g_key_file_set_string (key_file, group, option->key,
+						       *(char **) field);
+			}
+			break;
+
+		case OPTION_TYPE_OUTPUT_FORMAT:
+			g_key_file_set_string (key_file, group, option->key,
+					       output_formats[*(int *) field]);
+			break;
+
+		default:
+			g_assert_not_reached ();
+	}
+}
+
+/* Returns: the effective configuration, in the GKeyFile format. Free with
+ * g_free() when no longer needed.
+ */
+char *
+config_to_data (Config *config)
+{
+	GKeyFile *key_file;
+	char *data;
+	guint i;
+
+	key_file = g_key_file_new ();
+
+	for (i = 0; i < G_N_ELEMENTS (options); i++)
+	{
+		add_option_to_key_file (key_file, options[i].group, &options[i], config);
+	}
+
+	for (i = 0; i < config->sources->len; i++)
+	{
+		SourceConfig *source = g_ptr_array_index (config->sources, i);
+		char *group;
+		guint j;
+
+		group = g_strconcat (SOURCE_GROUP_PREFIX, source->name, NULL);
+
+		for (j = 0; j < G_N_ELEMENTS (source_options); j++)
+		{
+			add_option_to_key_file (key_file, group, &source_options[j], source);
+		}
+
+		g_free (group);
+	}
+
+	data = g_key_file_to_data (key_file, NULL, NULL);
+	g_key_file_free (key_file);
+
+	return data;
+}
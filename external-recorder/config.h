@@ -0,0 +1,155 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_CONFIG_H
+#define COSY_CONFIG_H
+
+#include <glib.h>
+
+#define CONFIG_ERROR (config_error_quark ())
+
+typedef enum
+{
+	CONFIG_ERROR_UNKNOWN_KEY,
+	CONFIG_ERROR_INVALID_VALUE
+} ConfigError;
+
+typedef enum
+{
+	OUTPUT_FORMAT_TEXT,
+	OUTPUT_FORMAT_BINARY,
+	OUTPUT_FORMAT_ZSTD
+} OutputFormat;
+
+/* Another Pupil Capture instance, in a [source:NAME] group. */
+typedef struct _SourceConfig SourceConfig;
+struct _SourceConfig
+{
+	char *name;
+	char *remote_address;
+	char *subscriber_host;
+	char *subscription;
+};
+
+typedef struct _Config Config;
+struct _Config
+{
+	/* [general] */
+	gboolean debug;
+
+	/* [pupil] */
+	char *pupil_name;
+	char *pupil_remote_address;
+	char *subscriber_host;
+	char *subscription;
+	int pupil_remote_timeout_ms;
+	int subscriber_hwm;
+	int pupil_reconnect_silence_ms;
+	int pupil_reconnect_max_backoff_ms;
+
+	/* [replier] */
+	char *replier_endpoint;
+	int replier_timeout_ms;
+	int replier_send_hwm;
+	char *replier_curve_secret_key_file;
+	char *replier_curve_authorized_keys_file;
+
+	/* [store] */
+	int store_capacity;
+	gboolean prefault_store;
+	gboolean store_keep_received;
+
+	/* [output] */
+	OutputFormat receive_data_format;
+	int zstd_level;
+
+	/* [realtime] */
+	char *cpu_affinity;
+	int sched_fifo_priority;
+	gboolean lock_memory;
+
+	/* [filter] */
+	gboolean filter_enabled;
+	double filter_min_cutoff_hz;
+	double filter_beta;
+	double filter_derivative_cutoff_hz;
+	double filter_min_confidence;
+	double filter_saccade_velocity;
+	int filter_cost_budget_ns;
+
+	/* [export] */
+	char *export_directory;
+
+	/* [shutdown] */
+	char *shutdown_export_path;
+
+	/* [shm] */
+	char *shm_name;
+	int shm_n_slots;
+
+	/* [load] */
+	gboolean load_adaptive;
+	int load_quiet_lag_ms;
+	int load_defer_lag_ms;
+	int load_decimate_lag_ms;
+	int load_decimation;
+	int load_max_messages_per_iteration;
+
+	/* [idle] */
+	int idle_decode_interval;
+
+	/* [watchdog] */
+	char *watchdog_endpoint;
+	int watchdog_heartbeat_interval_ms;
+	int watchdog_frame_age_budget_ms;
+	int watchdog_loop_jitter_budget_us;
+	int watchdog_reply_latency_budget_us;
+
+	/* The [source:NAME] groups, as SourceConfig, in the order of their
+	 * first key.
+	 */
+	GPtrArray *sources;
+};
+
+GQuark		config_error_quark	(void);
+
+Config *	config_new		(void);
+
+void		config_free		(Config      *config);
+
+gboolean	config_load_file	(Config      *config,
+					 const char  *filename,
+					 GError     **error);
+
+gboolean	config_set_value	(Config      *config,
+					 const char  *group,
+					 const char  *key,
+					 const char  *value,
+					 GError     **error);
+
+gboolean	config_parse_assignment	(Config      *config,
+					 const char  *assignment,
+					 GError     **error);
+
+gboolean	config_validate		(Config      *config,
+					 GError     **error);
+
+char *		config_to_data		(Config      *config);
+
+#endif /* COSY_CONFIG_H */
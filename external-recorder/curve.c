@@ -0,0 +1,601 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "curve.h"
+#include "realtime.h"
+#include <zmq.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/* ZeroMQ CURVE security for the sockets of external-recorder's clients.
+ *
+ * The keys are stored in text files, in the Z85 encoding used by ZeroMQ (40
+ * characters), one key per line. Empty lines and lines beginning with '#' are
+ * ignored. The server and each client have a keypair: the secret key stays
+ * on its computer, the public key is given to the other side.
+ *
+ * CURVE alone encrypts the traffic and authenticates the server, but it
+ * accepts any client. The clients are authenticated by the ZAP handler (ZAP
+ * is the ZeroMQ Authentication Protocol, RFC 27): a REP socket bound to
+ * ZAP_ENDPOINT in the same ZeroMQ context, which the ZeroMQ I/O thread asks
+ * for each new connection. It runs in its own thread, so that the handshake
+ * doesn't wait for the main loop.
+ */
+
+/* The key in binary. */
+#define CURVE_KEY_BINARY_SIZE 32
+
+#define ZAP_ENDPOINT "inproc://zeromq.zap.01"
+#define ZAP_VERSION "1.0"
+
+/* Version, request ID, domain, address, identity, mechanism and
+ * credentials: one for CURVE, the client public key.
+ */
+#define ZAP_MAX_REQUEST_PARTS 7
+
+struct _CurveAuthenticator
+{
+	void *socket;
+	GThread *thread;
+
+	/* The authorized client public keys, in binary, one after the
+	 * other. Read-only once the thread is started.
+	 */
+	GByteArray *keys;
+};
+
+G_DEFINE_QUARK (curve-error-quark, curve_error)
+
+/* Returns: the keys of @filename, in Z85, or %NULL on error. Free with
+ * g_strfreev().
+ */
+static char **
+read_keys (const char  *filename,
+	   GError     **error)
+{
+	char *contents;
+	char **lines;
+	GPtrArray *keys;
+	guint line_num;
+
+	if (!g_file_get_contents (filename, &contents, NULL, error))
+	{
+		return NULL;
+	}
+
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	keys = g_ptr_array_new ();
+
+	for (line_num = 0; lines[line_num] != NULL; line_num++)
+	{
+		char *line = g_strstrip (lines[line_num]);
+		guint8 key[CURVE_KEY_BINARY_SIZE];
+
+		if (line[0] == '\0' || line[0] == '#')
+		{
+			continue;
+		}
+
+		if (strlen (line) != CURVE_KEY_SIZE - 1 ||
+		    zmq_z85_decode (key, line) == NULL)
+		{
+			g_set_error (error,
+				     CURVE_ERROR,
+				     0,
+				     "%s:%u: invalid CURVE key, expected 40 characters in "
+				     "the Z85 encoding.",
+				     filename,
+				     line_num + 1);
+
+			g_ptr_array_free (keys, TRUE);
+			g_strfreev (lines);
+			return NULL;
+		}
+
+		g_ptr_array_add (keys, g_strdup (line));
+	}
+
+	g_ptr_array_add (keys, NULL);
+	g_strfreev (lines);
+
+	return (char **) g_ptr_array_free (keys, FALSE);
+}
+
+/* Reads the single key of @filename, in Z85. */
+gboolean
+curve_read_key_file (const char  *filename,
+		     char         key[CURVE_KEY_SIZE],
+		     GError     **error)
+{
+	char **keys;
+	guint n_keys;
+
+	keys = read_keys (filename, error);
+	if (keys == NULL)
+	{
+		return FALSE;
+	}
+
+	n_keys = g_strv_length (keys);
+	if (n_keys != 1)
+	{
+		g_set_error (error,
+			     CURVE_ERROR,
+			     0,
+			     "%s: expected one CURVE key, found %u.",
+			     filename,
+			     n_keys);
+		g_strfreev (keys);
+		return FALSE;
+	}
+
+	g_strlcpy (key, keys[0], CURVE_KEY_SIZE);
+	g_strfreev (keys);
+
+	return TRUE;
+}
+
+static gboolean
+check_curve_support (GError **error)
+{
+	if (!zmq_has ("curve"))
+	{
+		g_set_error_literal (error,
+				     CURVE_ERROR,
+				     0,
+				     "This libzmq has been built without CURVE support.");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Creates @filename with @mode, only if it doesn't exist, to never overwrite
+ * a key.
+ */
+static gboolean
+write_new_file (const char  *filename,
+		const char  *contents,
+		int          mode,
+		GError     **error)
+{
+	gsize len = strlen (contents);
+	int fd;
+
+	fd = g_open (filename, O_WRONLY | O_CREAT | O_EXCL, mode);
+	if (fd == -1)
+	{
+		int saved_errno = errno;
+
+		g_set_error (error,
+			     CURVE_ERROR,
+			     0,
+			     "Error when creating %s: %s",
+			     filename,
+			     g_strerror (saved_errno));
+		return FALSE;
+	}
+
+	if (write (fd, contents, len) != (gssize) len)
+	{
+		int saved_errno = errno;
+
+		g_set_error (error,
+			     CURVE_ERROR,
+			     0,
+			     "Error when writing %s: %s",
+			     filename,
+			     g_strerror (saved_errno));
+		close (fd);
+		return FALSE;
+	}
+
+	close (fd);
+	return TRUE;
+}
+
+/* Generates a keypair: the secret key in @prefix.key, readable only by the
+ * user, and the public key in @prefix.pub.
+ */
+gboolean
+curve_write_keypair (const char  *prefix,
+		     GError     **error)
+{
+	char public_key[CURVE_KEY_SIZE];
+	char secret_key[CURVE_KEY_SIZE];
+	char *filename;
+	char *contents;
+	gboolean ok;
+
+	if (!check_curve_support (error))
+	{
+		return FALSE;
+	}
+
+	if (zmq_curve_keypair (public_key, secret_key) != 0)
+	{
+		g_set_error (error,
+			     CURVE_ERROR,
+			     0,
+			     "Error when generating the CURVE keypair: %s",
+			     g_strerror (errno));
+		return FALSE;
+	}
+
+	filename = g_strconcat (prefix, ".key", NULL);
+	contents = g_strdup_printf ("# CURVE secret key, keep it private.\n%s\n", secret_key);
+	ok = write_new_file (filename, contents, 0600, error);
+	g_free (filename);
+	g_free (contents);
+
+	if (!ok)
+	{
+		return FALSE;
+	}
+
+	filename = g_strconcat (prefix, ".pub", NULL);
+	contents = g_strdup_printf ("# CURVE public key.\n%s\n", public_key);
+	ok = write_new_file (filename, contents, 0644, error);
+	g_free (filename);
+	g_free (contents);
+
+	return ok;
+}
+
+/* Reads a secret key, and computes its public key. */
+static gboolean
+read_secret_key (const char  *filename,
+		 char         secret_key[CURVE_KEY_SIZE],
+		 char         public_key[CURVE_KEY_SIZE],
+		 GError     **error)
+{
+	GStatBuf buf;
+
+	if (!curve_read_key_file (filename, secret_key, error))
+	{
+		return FALSE;
+	}
+
+	if (g_stat (filename, &buf) == 0 &&
+	    (buf.st_mode & 077) != 0)
+	{
+		g_warning ("The CURVE secret key %s is readable by other users.", filename);
+	}
+
+	if (zmq_curve_public (public_key, secret_key) != 0)
+	{
+		g_set_error (error,
+			     CURVE_ERROR,
+			     0,
+			     "%s: invalid CURVE secret key.",
+			     filename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+set_socket_option (void        *socket,
+		   int          option,
+		   const void  *value,
+		   size_t       size,
+		   GError     **error)
+{
+	if (zmq_setsockopt (socket, option, value, size) != 0)
+	{
+		g_set_error (error,
+			     CURVE_ERROR,
+			     0,
+			     "Error when setting the CURVE socket options: %s",
+			     g_strerror (errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Makes @socket a CURVE server. Must be called before zmq_bind(). Sets
+ * @public_key, to give to the clients.
+ */
+gboolean
+curve_setup_server (void        *socket,
+		    const char  *secret_key_file,
+		    char         public_key[CURVE_KEY_SIZE],
+		    GError     **error)
+{
+	char secret_key[CURVE_KEY_SIZE];
+	int server = 1;
+
+	return (check_curve_support (error) &&
+		read_secret_key (secret_key_file, secret_key, public_key, error) &&
+		set_socket_option (socket, ZMQ_CURVE_SERVER, &server, sizeof (server), error) &&
+		set_socket_option (socket, ZMQ_CURVE_SECRETKEY, secret_key, CURVE_KEY_SIZE, error));
+}
+
+/* Makes @socket a CURVE client of the server with the public key in
+ * @server_key_file. Must be called before zmq_connect().
+ */
+gboolean
+curve_setup_client (void        *socket,
+		    const char  *server_key_file,
+		    const char  *secret_key_file,
+		    GError     **error)
+{
+	char server_key[CURVE_KEY_SIZE];
+	char secret_key[CURVE_KEY_SIZE];
+	char public_key[CURVE_KEY_SIZE];
+
+	return (check_curve_support (error) &&
+		curve_read_key_file (server_key_file, server_key, error) &&
+		read_secret_key (secret_key_file, secret_key, public_key, error) &&
+		set_socket_option (socket, ZMQ_CURVE_SERVERKEY, server_key, CURVE_KEY_SIZE, error) &&
+		set_socket_option (socket, ZMQ_CURVE_PUBLICKEY, public_key, CURVE_KEY_SIZE, error) &&
+		set_socket_option (socket, ZMQ_CURVE_SECRETKEY, secret_key, CURVE_KEY_SIZE, error));
+}
+
+static gboolean
+is_authorized_key (CurveAuthenticator *authenticator,
+		   const void         *key)
+{
+	guint offset;
+
+	for (offset = 0; offset < authenticator->keys->len; offset += CURVE_KEY_BINARY_SIZE)
+	{
+		if (memcmp (authenticator->keys->data + offset, key, CURVE_KEY_BINARY_SIZE) == 0)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+part_equals (zmq_msg_t  *part,
+	     const char *str)
+{
+	return (zmq_msg_size (part) == strlen (str) &&
+		memcmp (zmq_msg_data (part), str, strlen (str)) == 0);
+}
+
+static void
+send_string (void       *socket,
+	     const char *str,
+	     int         flags)
+{
+	zmq_send (socket, str, strlen (str), flags);
+}
+
+/* Closes the first @n_parts messages of @parts. */
+static void
+close_parts (zmq_msg_t *parts,
+	     guint      n_parts)
+{
+	guint part_num;
+
+	for (part_num = 0; part_num < n_parts; part_num++)
+	{
+		zmq_msg_close (&parts[part_num]);
+	}
+}
+
+/* Receives a ZAP request and replies to it.
+ * Returns: %FALSE when the ZeroMQ context is terminated.
+ */
+static gboolean
+handle_zap_request (CurveAuthenticator *authenticator)
+{
+	zmq_msg_t parts[ZAP_MAX_REQUEST_PARTS];
+	guint n_parts = 0;
+	gboolean valid = TRUE;
+	gboolean authorized = FALSE;
+	gboolean more = TRUE;
+
+	while (more)
+	{
+		zmq_msg_t extra_part;
+		zmq_msg_t *part;
+
+		/* The extra parts make the request invalid. */
+		if (n_parts < ZAP_MAX_REQUEST_PARTS)
+		{
+			part = &parts[n_parts];
+		}
+		else
+		{
+			part = &extra_part;
+			valid = FALSE;
+		}
+
+		zmq_msg_init (part);
+
+		if (zmq_msg_recv (part, authenticator->socket, 0) == -1)
+		{
+			int saved_errno = errno;
+
+			zmq_msg_close (part);
+			close_parts (parts, n_parts);
+			return saved_errno != ETERM;
+		}
+
+		more = zmq_msg_more (part);
+
+		if (part == &extra_part)
+		{
+			zmq_msg_close (part);
+		}
+		else
+		{
+			n_parts++;
+		}
+	}
+
+	if (valid &&
+	    n_parts == ZAP_MAX_REQUEST_PARTS &&
+	    part_equals (&parts[0], ZAP_VERSION) &&
+	    part_equals (&parts[5], "CURVE") &&
+	    zmq_msg_size (&parts[6]) == CURVE_KEY_BINARY_SIZE)
+	{
+		authorized = is_authorized_key (authenticator, zmq_msg_data (&parts[6]));
+
+		if (!authorized)
+		{
+			char client_key[CURVE_KEY_SIZE];
+			char *address;
+
+			zmq_z85_encode (client_key, zmq_msg_data (&parts[6]), CURVE_KEY_BINARY_SIZE);
+			address = g_strndup (zmq_msg_data (&parts[3]), zmq_msg_size (&parts[3]));
+
+			g_warning ("Connection from %s refused, unknown CURVE key %s.",
+				   address,
+				   client_key);
+
+			g_free (address);
+		}
+	}
+
+	/* The reply: version, request ID, status code, status text, user ID
+	 * and metadata. Without a valid request ID, ZeroMQ drops the reply.
+	 */
+	send_string (authenticator->socket, ZAP_VERSION, ZMQ_SNDMORE);
+
+	if (n_parts >= 2)
+	{
+		zmq_send (authenticator->socket,
+			  zmq_msg_data (&parts[1]),
+			  zmq_msg_size (&parts[1]),
+			  ZMQ_SNDMORE);
+	}
+	else
+	{
+		send_string (authenticator->socket, "", ZMQ_SNDMORE);
+	}
+
+	send_string (authenticator->socket, authorized ? "200" : "400", ZMQ_SNDMORE);
+	send_string (authenticator->socket, authorized ? "OK" : "Unauthorized", ZMQ_SNDMORE);
+	send_string (authenticator->socket, "", ZMQ_SNDMORE);
+	send_string (authenticator->socket, "", 0);
+
+	close_parts (parts, n_parts);
+
+	return TRUE;
+}
+
+static gpointer
+authenticator_thread (gpointer user_data)
+{
+	CurveAuthenticator *authenticator = user_data;
+
+	realtime_reset_thread ();
+
+	while (handle_zap_request (authenticator))
+	{
+	}
+
+	/* Lets zmq_ctx_destroy() return. */
+	zmq_close (authenticator->socket);
+	authenticator->socket = NULL;
+
+	return NULL;
+}
+
+/* Starts the ZAP handler of @context, which accepts only the CURVE clients
+ * whose public key is in @authorized_keys_file. Must be called before
+ * binding the CURVE sockets. It stops when @context is terminated, free it
+ * with curve_authenticator_free() after zmq_ctx_destroy().
+ */
+CurveAuthenticator *
+curve_authenticator_new (void        *context,
+			 const char  *authorized_keys_file,
+			 GError     **error)
+{
+	CurveAuthenticator *authenticator;
+	char **keys;
+	guint key_num;
+	int linger_ms = 0;
+
+	keys = read_keys (authorized_keys_file, error);
+	if (keys == NULL)
+	{
+		return NULL;
+	}
+
+	authenticator = g_new0 (CurveAuthenticator, 1);
+	authenticator->keys = g_byte_array_new ();
+
+	for (key_num = 0; keys[key_num] != NULL; key_num++)
+	{
+		guint8 key[CURVE_KEY_BINARY_SIZE];
+
+		zmq_z85_decode (key, keys[key_num]);
+		g_byte_array_append (authenticator->keys, key, CURVE_KEY_BINARY_SIZE);
+	}
+
+	g_strfreev (keys);
+
+	if (authenticator->keys->len == 0)
+	{
+		g_warning ("%s contains no key, all the clients are refused.",
+			   authorized_keys_file);
+	}
+
+	authenticator->socket = zmq_socket (context, ZMQ_REP);
+	zmq_setsockopt (authenticator->socket, ZMQ_LINGER, &linger_ms, sizeof (int));
+
+	if (zmq_bind (authenticator->socket, ZAP_ENDPOINT) != 0)
+	{
+		g_set_error (error,
+			     CURVE_ERROR,
+			     0,
+			     "Error when binding the ZAP handler: %s",
+			     g_strerror (errno));
+
+		zmq_close (authenticator->socket);
+		authenticator->socket = NULL;
+		curve_authenticator_free (authenticator);
+		return NULL;
+	}
+
+	authenticator->thread = g_thread_new ("zap-handler", authenticator_thread, authenticator);
+
+	return authenticator;
+}
+
+void
+curve_authenticator_free (CurveAuthenticator *authenticator)
+{
+	if (authenticator == NULL)
+	{
+		return;
+	}
+
+	if (authenticator->thread != NULL)
+	{
+		g_thread_join (authenticator->thread);
+	}
+
+	g_byte_array_free (authenticator->keys, TRUE);
+	g_free (authenticator);
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_CURVE_H
+#define COSY_CURVE_H
+
+#include <glib.h>
+
+/* A CURVE key in the Z85 encoding, with the nul byte. */
+#define CURVE_KEY_SIZE 41
+
+#define CURVE_ERROR (curve_error_quark ())
+
+typedef struct _CurveAuthenticator CurveAuthenticator;
+
+GQuark		curve_error_quark		(void);
+
+gboolean	curve_read_key_file		(const char  *filename,
+						 char         key[CURVE_KEY_SIZE],
+						 GError     **error);
+
+gboolean	curve_write_keypair		(const char  *prefix,
+						 GError     **error);
+
+gboolean	curve_setup_server		(void        *socket,
+						 const char  *secret_key_file,
+						 char         public_key[CURVE_KEY_SIZE],
+						 GError     **error);
+
+gboolean	curve_setup_client		(void        *socket,
+						 const char  *server_key_file,
+						 const char  *secret_key_file,
+						 GError     **error);
+
+CurveAuthenticator *
+		curve_authenticator_new		(void        *context,
+						 const char  *authorized_keys_file,
+						 GError     **error);
+
+void		curve_authenticator_free	(CurveAuthenticator *authenticator);
+
+#endif /* COSY_CURVE_H */
@@ -0,0 +1,208 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "data-binary.h"
+#include <string.h>
+#include <zstd.h>
+
+/* Binary format of the receive_data reply, see also the README.
+ *
+ * The header has 16 bytes, all integers are little-endian:
+ * - "COSY" magic (4 bytes)
+ * - version (uint8), currently 2 (the version 1 had 8 columns)
+ * - encoding (uint8), currently always 1: XOR delta + byte shuffle
+ * - compression (uint8): 0 for none, 1 for zstd
+ * - number of columns (uint8), currently 12
+ * - number of samples (uint32)
+ * - size of the payload once decompressed (uint32), so a reply has at most
+ *   DATA_BINARY_MAX_SAMPLES samples
+ *
+ * The payload follows, compressed or not. The columns are stored one after
+ * the other, in the same order as the text format: timestamp, pupil_diameter,
+ * pupil_x, pupil_y, pupil_confidence, gaze_x, gaze_y, gaze_confidence,
+ * followed by the columns of the gaze filter (see data_fields).
+ *
+ * Each value of a column is a little-endian IEEE 754 double, XORed with the
+ * previous value of the same column (the first value is XORed with 0).
+ * Consecutive timestamps and positions are close to each other, so the result
+ * has many zero bits in the sign, exponent and high mantissa. The bytes of a
+ * column are then shuffled: first the byte 0 of all the values, then the byte
+ * 1 of all the values, etc. The zero bytes are thus grouped together, which
+ * compresses very well.
+ *
+ * To decode a column: unshuffle the bytes, then v[i] = x[i] XOR v[i-1].
+ */
+
+#define HEADER_SIZE 16
+#define FORMAT_VERSION 2
+#define ENCODING_XOR_SHUFFLE 1
+
+#define N_COLUMNS DATA_N_FIELDS
+
+struct _DataBinaryEncoder
+{
+	/* The header followed by the uncompressed payload. */
+	guint8 *buffer;
+
+	guint n_samples;
+	guint n_appended;
+
+	guint64 previous_values[N_COLUMNS];
+};
+
+G_DEFINE_QUARK (data-binary-error-quark, data_binary_error)
+
+/* Returns: a new encoder for @n_samples samples, or %NULL if their payload
+ * would not fit in the header (more than DATA_BINARY_MAX_SAMPLES samples).
+ */
+DataBinaryEncoder *
+data_binary_encoder_new (guint    n_samples,
+			 GError **error)
+{
+	DataBinaryEncoder *encoder;
+
+	if (n_samples > DATA_BINARY_MAX_SAMPLES)
+	{
+		g_set_error (error,
+			     DATA_BINARY_ERROR,
+			     0,
+			     "Too many samples for the binary format: %u, the maximum is %u.",
+			     n_samples,
+			     (guint) DATA_BINARY_MAX_SAMPLES);
+		return NULL;
+	}
+
+	encoder = g_new0 (DataBinaryEncoder, 1);
+	encoder->n_samples = n_samples;
+	encoder->buffer = g_malloc (HEADER_SIZE + (gsize) n_samples * N_COLUMNS * sizeof (guint64));
+
+	return encoder;
+}
+
+void
+data_binary_encoder_append (DataBinaryEncoder *encoder,
+			    const Data        *data)
+{
+	guint8 *payload;
+	gsize column_size;
+	guint column_num;
+
+	g_return_if_fail (encoder->n_appended < encoder->n_samples);
+
+	payload = encoder->buffer + HEADER_SIZE;
+	column_size = (gsize) encoder->n_samples * sizeof (guint64);
+
+	for (column_num = 0; column_num < N_COLUMNS; column_num++)
+	{
+		guint8 *column = payload + column_num * column_size;
+		double value;
+		guint64 bits;
+		guint64 xored;
+		guint byte_num;
+
+		value = DATA_FIELD_VALUE (data, column_num);
+		memcpy (&bits, &value, sizeof (bits));
+
+		xored = bits ^ encoder->previous_values[column_num];
+		encoder->previous_values[column_num] = bits;
+
+		for (byte_num = 0; byte_num < sizeof (guint64); byte_num++)
+		{
+			column[byte_num * encoder->n_samples + encoder->n_appended] = (xored >> (8 * byte_num)) & 0xff;
+		}
+	}
+
+	encoder->n_appended++;
+}
+
+static void
+write_uint32 (guint8  *p,
+	      guint32  value)
+{
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = (value >> 24) & 0xff;
+}
+
+static void
+write_header (guint8                *header,
+	      DataBinaryCompression  compression,
+	      guint                  n_samples,
+	      gsize                  payload_size)
+{
+	memcpy (header, "COSY", 4);
+	header[4] = FORMAT_VERSION;
+	header[5] = ENCODING_XOR_SHUFFLE;
+	header[6] = compression;
+	header[7] = N_COLUMNS;
+	write_uint32 (header + 8, n_samples);
+	write_uint32 (header + 12, payload_size);
+}
+
+/* Frees @encoder and returns the encoded data, of @size bytes. Free the return
+ * value with g_free() when no longer needed.
+ */
+char *
+data_binary_encoder_finish (DataBinaryEncoder     *encoder,
+			    DataBinaryCompression  compression,
+			    int                    compression_level,
+			    gsize                 *size)
+{
+	gsize payload_size;
+	guint8 *result;
+
+	g_return_val_if_fail (size != NULL, NULL);
+	g_warn_if_fail (encoder->n_appended == encoder->n_samples);
+
+	payload_size = (gsize) encoder->n_samples * N_COLUMNS * sizeof (guint64);
+
+	if (compression == DATA_BINARY_COMPRESSION_ZSTD)
+	{
+		gsize compressed_size;
+
+		result = g_malloc (HEADER_SIZE + ZSTD_compressBound (payload_size));
+		compressed_size = ZSTD_compress (result + HEADER_SIZE,
+						 ZSTD_compressBound (payload_size),
+						 encoder->buffer + HEADER_SIZE,
+						 payload_size,
+						 compression_level);
+
+		if (!ZSTD_isError (compressed_size))
+		{
+			write_header (result, compression, encoder->n_samples, payload_size);
+			*size = HEADER_SIZE + compressed_size;
+
+			g_free (encoder->buffer);
+			g_free (encoder);
+			return (char *) result;
+		}
+
+		g_warning ("zstd compression failed: %s. Send uncompressed data.",
+			   ZSTD_getErrorName (compressed_size));
+		g_free (result);
+	}
+
+	result = encoder->buffer;
+	write_header (result, DATA_BINARY_COMPRESSION_NONE, encoder->n_samples, payload_size);
+	*size = HEADER_SIZE + payload_size;
+
+	g_free (encoder);
+	return (char *) result;
+}
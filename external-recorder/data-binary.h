@@ -0,0 +1,52 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_DATA_BINARY_H
+#define COSY_DATA_BINARY_H
+
+#include <glib.h>
+#include "data.h"
+
+#define DATA_BINARY_ERROR (data_binary_error_quark ())
+
+/* The size of the payload is a uint32 in the header. */
+#define DATA_BINARY_MAX_SAMPLES (G_MAXUINT32 / (DATA_N_FIELDS * sizeof (guint64)))
+
+typedef enum
+{
+	DATA_BINARY_COMPRESSION_NONE = 0,
+	DATA_BINARY_COMPRESSION_ZSTD = 1
+} DataBinaryCompression;
+
+typedef struct _DataBinaryEncoder DataBinaryEncoder;
+
+GQuark			data_binary_error_quark		(void);
+
+DataBinaryEncoder *	data_binary_encoder_new		(guint                  n_samples,
+							 GError               **error);
+
+void			data_binary_encoder_append	(DataBinaryEncoder     *encoder,
+							 const Data            *data);
+
+char *			data_binary_encoder_finish	(DataBinaryEncoder     *encoder,
+							 DataBinaryCompression  compression,
+							 int                    compression_level,
+							 gsize                 *size);
+
+#endif /* COSY_DATA_BINARY_H */
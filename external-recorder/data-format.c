@@ -0,0 +1,207 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "data-format.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Text format of the receive_data reply.
+ *
+ * The format is the historical one, produced with g_string_append_printf() and
+ * "%lf" for each field. Calling the printf machinery eight times per sample
+ * dominates receive_data() for long recordings, so the doubles are formatted
+ * here with a dedicated fixed-precision conversion, which produces exactly the
+ * same bytes as "%lf" (external-recorder doesn't call setlocale(), so the
+ * decimal separator is always a dot).
+ */
+
+/* Doubles below this absolute value have an integer part that fits exactly in
+ * a guint64, with at most 15 digits.
+ */
+#define FAST_PATH_LIMIT 1e15
+
+/* Sign + 15 integer digits + dot + 6 decimals. */
+#define FAST_PATH_MAX_LEN 23
+
+/* The labels and the newlines of one sample. */
+#define SAMPLE_LABELS_LEN (sizeof ("timestamp:\n"		\
+				   "pupil_diameter:\n"		\
+				   "pupil_x:\n"			\
+				   "pupil_y:\n"			\
+				   "pupil_confidence:\n"	\
+				   "gaze_x:\n"			\
+				   "gaze_y:\n"			\
+				   "gaze_confidence:\n") - 1)
+
+#define N_SAMPLE_FIELDS 8
+
+/* Maximum length of a sample when all its doubles take the fast path. */
+#define SAMPLE_FAST_MAX_LEN (SAMPLE_LABELS_LEN + N_SAMPLE_FIELDS * FAST_PATH_MAX_LEN)
+
+/* Maximum length of a sample in all cases. */
+#define SAMPLE_MAX_LEN (SAMPLE_LABELS_LEN + N_SAMPLE_FIELDS * DATA_FORMAT_DOUBLE_BUF_SIZE)
+
+/* Writes @value at @buf, like printf() with "%lf". No nul byte is written.
+ * @buf must have a size of at least DATA_FORMAT_DOUBLE_BUF_SIZE bytes.
+ * Returns: the number of bytes written.
+ */
+gsize
+data_format_double (char   *buf,
+		    double  value)
+{
+	char *p = buf;
+	char digits[20];
+	double abs_value;
+	double integer_part;
+	double scaled;
+	double rounded;
+	double remainder;
+	guint64 integer;
+	guint64 fraction;
+	int n_digits = 0;
+	int i;
+
+	if (!isfinite (value) || fabs (value) >= FAST_PATH_LIMIT)
+	{
+		goto fallback;
+	}
+
+	abs_value = fabs (value);
+	integer_part = floor (abs_value);
+
+	/* The subtraction is exact. The multiplication has an error of at
+	 * most half an ulp of @scaled, which is below 2^-33 since @scaled is
+	 * below 2^20.
+	 */
+	scaled = (abs_value - integer_part) * 1e6;
+	rounded = floor (scaled);
+	remainder = scaled - rounded;
+
+	/* Ties (and near-ties that the rounding error could have moved to the
+	 * other side) are left to printf, which rounds the exact binary value.
+	 */
+	if (fabs (remainder - 0.5) < 1e-9)
+	{
+		goto fallback;
+	}
+
+	if (remainder > 0.5)
+	{
+		rounded += 1.0;
+	}
+
+	integer = (guint64) integer_part;
+	fraction = (guint64) rounded;
+
+	if (fraction == 1000000)
+	{
+		integer++;
+		fraction = 0;
+	}
+
+	/* printf prints the sign of negative values rounded to zero, and of
+	 * -0.0.
+	 */
+	if (signbit (value))
+	{
+		*p++ = '-';
+	}
+
+	do
+	{
+		digits[n_digits++] = '0' + integer % 10;
+		integer /= 10;
+	}
+	while (integer > 0);
+
+	while (n_digits > 0)
+	{
+		*p++ = digits[--n_digits];
+	}
+
+	*p++ = '.';
+
+	for (i = 5; i >= 0; i--)
+	{
+		p[i] = '0' + fraction % 10;
+		fraction /= 10;
+	}
+	p += 6;
+
+	return p - buf;
+
+fallback:
+	return snprintf (buf, DATA_FORMAT_DOUBLE_BUF_SIZE, "%lf", value);
+}
+
+/* Returns: a new GString big enough to contain @n_samples in the text format
+ * without being reallocated (unless some values don't take the fast path, for
+ * example huge values, which doesn't happen with Pupil data).
+ */
+GString *
+data_format_text_new (guint n_samples)
+{
+	return g_string_sized_new ((gsize) n_samples * SAMPLE_FAST_MAX_LEN + SAMPLE_MAX_LEN);
+}
+
+static char *
+append_field (char       *p,
+	      const char *label,
+	      gsize       label_len,
+	      double      value)
+{
+	memcpy (p, label, label_len);
+	p += label_len;
+	p += data_format_double (p, value);
+	*p++ = '\n';
+
+	return p;
+}
+
+#define APPEND_FIELD(p, label, value) \
+	(p = append_field (p, label, sizeof (label) - 1, value))
+
+/* Appends @data to @str, in the text format of the receive_data reply. */
+void
+data_format_text_append (GString    *str,
+			 const Data *data)
+{
+	gsize old_len;
+	char *p;
+
+	old_len = str->len;
+
+	/* Doesn't reallocate if @str has been created with
+	 * data_format_text_new(), it only changes the length.
+	 */
+	g_string_set_size (str, old_len + SAMPLE_MAX_LEN);
+	p = str->str + old_len;
+
+	APPEND_FIELD (p, "timestamp:", data->timestamp);
+	APPEND_FIELD (p, "pupil_diameter:", data->pupil_diameter);
+	APPEND_FIELD (p, "pupil_x:", data->pupil_norm_pos_x);
+	APPEND_FIELD (p, "pupil_y:", data->pupil_norm_pos_y);
+	APPEND_FIELD (p, "pupil_confidence:", data->pupil_confidence);
+	APPEND_FIELD (p, "gaze_x:", data->gaze_norm_pos_x);
+	APPEND_FIELD (p, "gaze_y:", data->gaze_norm_pos_y);
+	APPEND_FIELD (p, "gaze_confidence:", data->gaze_confidence);
+
+	g_string_truncate (str, p - str->str);
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_DATA_FORMAT_H
+#define COSY_DATA_FORMAT_H
+
+#include <glib.h>
+#include "data.h"
+
+/* Enough for any double formatted with "%lf", including DBL_MAX. */
+#define DATA_FORMAT_DOUBLE_BUF_SIZE 320
+
+gsize		data_format_double		(char       *buf,
+						 double      value);
+
+GString *	data_format_text_new		(guint       n_samples);
+
+void		data_format_text_append		(GString    *str,
+						 const Data *data);
+
+#endif /* COSY_DATA_FORMAT_H */
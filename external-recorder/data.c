@@ -0,0 +1,55 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "data.h"
+#include "gaze-filter.h"
+
+const DataField data_fields[DATA_N_FIELDS] =
+{
+	{ "timestamp", G_STRUCT_OFFSET (Data, timestamp) },
+	{ "pupil_diameter", G_STRUCT_OFFSET (Data, pupil_diameter) },
+	{ "pupil_x", G_STRUCT_OFFSET (Data, pupil_norm_pos_x) },
+	{ "pupil_y", G_STRUCT_OFFSET (Data, pupil_norm_pos_y) },
+	{ "pupil_confidence", G_STRUCT_OFFSET (Data, pupil_confidence) },
+	{ "gaze_x", G_STRUCT_OFFSET (Data, gaze_norm_pos_x) },
+	{ "gaze_y", G_STRUCT_OFFSET (Data, gaze_norm_pos_y) },
+	{ "gaze_confidence", G_STRUCT_OFFSET (Data, gaze_confidence) },
+	{ "gaze_filtered_x", G_STRUCT_OFFSET (Data, gaze_filtered_x) },
+	{ "gaze_filtered_y", G_STRUCT_OFFSET (Data, gaze_filtered_y) },
+	{ "gaze_velocity", G_STRUCT_OFFSET (Data, gaze_velocity) },
+	{ "gaze_class", G_STRUCT_OFFSET (Data, gaze_class) }
+};
+
+/* Sets all the fields to -1, i.e. not available. */
+void
+data_init (Data *data)
+{
+	data->timestamp = -1.0;
+	data->pupil_diameter = -1.0;
+	data->pupil_norm_pos_x = -1.0;
+	data->pupil_norm_pos_y = -1.0;
+	data->pupil_confidence = -1.0;
+	data->gaze_filtered_x = -1.0;
+	data->gaze_filtered_y = -1.0;
+	data->gaze_velocity = -1.0;
+	data->gaze_class = GAZE_CLASS_UNKNOWN;
+	data->gaze_norm_pos_x = -1.0;
+	data->gaze_norm_pos_y = -1.0;
+	data->gaze_confidence = -1.0;
+}
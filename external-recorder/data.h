@@ -0,0 +1,70 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2016, 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Sébastien Wilmet
+ */
+
+#ifndef COSY_DATA_H
+#define COSY_DATA_H
+
+#include <glib.h>
+
+typedef struct _Data Data;
+struct _Data
+{
+	double timestamp;
+	double pupil_diameter;
+
+	double pupil_norm_pos_x;
+	double pupil_norm_pos_y;
+	double pupil_confidence;
+
+	double gaze_norm_pos_x;
+	double gaze_norm_pos_y;
+	double gaze_confidence;
+
+	/* Computed by the gaze filter (see gaze-filter.c), -1 if the filter
+	 * is disabled or if the sample has been ignored.
+	 */
+	double gaze_filtered_x;
+	double gaze_filtered_y;
+	double gaze_velocity;
+	double gaze_class;
+};
+
+/* Describes a column (a field of Data), for the columnar formats. */
+typedef struct _DataField DataField;
+struct _DataField
+{
+	const char *name;
+	gsize offset;
+};
+
+#define DATA_N_FIELDS 12
+
+/* In the same order as the receive_data text format, followed by the columns
+ * of the gaze filter, which are not in the text format.
+ */
+extern const DataField data_fields[DATA_N_FIELDS];
+
+#define DATA_FIELD_VALUE(data, field_num) \
+	G_STRUCT_MEMBER (double, (data), data_fields[(field_num)].offset)
+
+void	data_init	(Data *data);
+
+#endif /* COSY_DATA_H */
@@ -0,0 +1,590 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "export.h"
+#include "realtime.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+
+/* Export of recorded samples to files, for analysis in Python or elsewhere,
+ * without going through the lossy "%lf" text format.
+ *
+ * Formats:
+ * - NPY: @path is a directory, with one NumPy .npy file per column
+ *   (timestamp.npy, pupil_diameter.npy, ...). Each file is a 1-D array of
+ *   little-endian doubles ('<f8'), readable with numpy.load(). The files
+ *   are written with a .tmp suffix, and renamed when they are all complete.
+ * - CSV: @path is a file, with a header line and one line per sample. Unlike
+ *   the receive_data text format, the values are read back exactly.
+ *
+ * The export runs in a background thread, which streams the samples from the
+ * store in batches, so a long session never blocks the main loop (ingest and
+ * requests). While an export is running, the store must not be cleared.
+ */
+
+#define BATCH_SIZE SAMPLE_STORE_CHUNK_SIZE
+#define FILE_BUFFER_SIZE (1024 * 1024)
+
+#define EXPORT_ERROR (export_error_quark ())
+
+typedef enum
+{
+	EXPORT_STATE_IDLE,
+	EXPORT_STATE_RUNNING,
+	EXPORT_STATE_DONE,
+	EXPORT_STATE_FAILED
+} ExportState;
+
+struct _Exporter
+{
+	SampleStore *store;
+
+	GThread *thread;
+
+	/* Parameters of the current or last export. */
+	ExportFormat format;
+	char *path;
+	guint begin;
+	guint end;
+
+	/* Written by the export thread. */
+	volatile gint state;
+	volatile gint n_exported;
+	GError *error;
+};
+
+static GQuark export_error_quark (void);
+G_DEFINE_QUARK (export-error-quark, export_error)
+
+static void
+set_error_from_errno (GError     **error,
+		      const char  *filename)
+{
+	int saved_errno = errno;
+
+	g_set_error (error,
+		     EXPORT_ERROR,
+		     0,
+		     "Error when writing %s: %s",
+		     filename,
+		     g_strerror (saved_errno));
+}
+
+static FILE *
+open_file (const char  *filename,
+	   GError     **error)
+{
+	FILE *file;
+
+	file = fopen (filename, "wb");
+	if (file == NULL)
+	{
+		set_error_from_errno (error, filename);
+		return NULL;
+	}
+
+	setvbuf (file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+	return file;
+}
+
+static gboolean
+close_file (FILE        *file,
+	    const char  *filename,
+	    GError     **error)
+{
+	if (ferror (file) != 0 || fclose (file) != 0)
+	{
+		set_error_from_errno (error, filename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Writes the header of a NPY file (format version 1.0) for a 1-D array of
+ * @n_values little-endian doubles. The header is padded so that the data is
+ * aligned on 64 bytes.
+ */
+static void
+write_npy_header (FILE  *file,
+		  guint  n_values)
+{
+	GString *header;
+	guint16 header_len;
+	guint8 header_len_le[2];
+
+	header = g_string_new (NULL);
+	g_string_append_printf (header,
+				"{'descr': '<f8', 'fortran_order': False, 'shape': (%u,), }",
+				n_values);
+
+	/* Magic (6 bytes) + version (2 bytes) + header length (2 bytes). */
+	while ((10 + header->len + 1) % 64 != 0)
+	{
+		g_string_append_c (header, ' ');
+	}
+	g_string_append_c (header, '\n');
+
+	header_len = header->len;
+	header_len_le[0] = header_len & 0xff;
+	header_len_le[1] = header_len >> 8;
+
+	fwrite ("\x93NUMPY\x01\x00", 1, 8, file);
+	fwrite (header_len_le, 1, 2, file);
+	fwrite (header->str, 1, header->len, file);
+
+	g_string_free (header, TRUE);
+}
+
+/* Copies the batch of samples starting at @index to @batch. Fails if some of
+ * them are no longer in the store, instead of writing a shorter export than
+ * the requested range.
+ */
+static gboolean
+copy_batch (Exporter  *exporter,
+	    guint      index,
+	    Data      *batch,
+	    guint     *n_copied,
+	    GError   **error)
+{
+	guint n_requested = MIN (BATCH_SIZE, exporter->end - index);
+
+	*n_copied = sample_store_copy (exporter->store, index, n_requested, batch);
+	if (*n_copied != n_requested)
+	{
+		g_set_error (error,
+			     EXPORT_ERROR,
+			     0,
+			     "The samples %u to %u are no longer in the store.",
+			     index + *n_copied,
+			     exporter->end - 1);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+export_npy (Exporter  *exporter,
+	    GError   **error)
+{
+	FILE *files[DATA_N_FIELDS] = { NULL };
+	char *filenames[DATA_N_FIELDS] = { NULL };
+	char *tmp_filenames[DATA_N_FIELDS] = { NULL };
+	Data *batch = NULL;
+	double *column = NULL;
+	guint n_samples = exporter->end - exporter->begin;
+	guint index;
+	guint field_num;
+	gboolean ok = FALSE;
+
+	if (g_mkdir_with_parents (exporter->path, 0755) != 0)
+	{
+		set_error_from_errno (error, exporter->path);
+		return FALSE;
+	}
+
+	for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+	{
+		char *basename;
+
+		basename = g_strconcat (data_fields[field_num].name, ".npy", NULL);
+		filenames[field_num] = g_build_filename (exporter->path, basename, NULL);
+		g_free (basename);
+
+		/* Like for the CSV format, the files are renamed once they are
+		 * all complete.
+		 */
+		tmp_filenames[field_num] = g_strconcat (filenames[field_num], ".tmp", NULL);
+
+		files[field_num] = open_file (tmp_filenames[field_num], error);
+		if (files[field_num] == NULL)
+		{
+			goto out;
+		}
+
+		write_npy_header (files[field_num], n_samples);
+	}
+
+	batch = g_new (Data, BATCH_SIZE);
+	column = g_new (double, BATCH_SIZE);
+
+	for (index = exporter->begin; index < exporter->end; index += BATCH_SIZE)
+	{
+		guint n;
+		guint i;
+
+		/* The headers already hold n_samples: a shorter array would
+		 * be read as garbage, so fail rather than write it.
+		 */
+		if (!copy_batch (exporter, index, batch, &n, error))
+		{
+			goto out;
+		}
+
+		for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+		{
+			for (i = 0; i < n; i++)
+			{
+				column[i] = DATA_FIELD_VALUE (&batch[i], field_num);
+			}
+
+			/* x86 is little-endian, like the '<f8' descr. */
+			fwrite (column, sizeof (double), n, files[field_num]);
+		}
+
+		g_atomic_int_set (&exporter->n_exported, index + n - exporter->begin);
+	}
+
+	ok = TRUE;
+
+out:
+	g_free (batch);
+	g_free (column);
+
+	for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+	{
+		if (files[field_num] != NULL &&
+		    !close_file (files[field_num], tmp_filenames[field_num], ok ? error : NULL))
+		{
+			ok = FALSE;
+		}
+	}
+
+	for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+	{
+		if (ok &&
+		    g_rename (tmp_filenames[field_num], filenames[field_num]) != 0)
+		{
+			set_error_from_errno (error, filenames[field_num]);
+			ok = FALSE;
+		}
+
+		if (!ok && files[field_num] != NULL)
+		{
+			g_remove (tmp_filenames[field_num]);
+		}
+
+		g_free (filenames[field_num]);
+		g_free (tmp_filenames[field_num]);
+	}
+
+	return ok;
+}
+
+/* Formats @value with the fewest digits that read back to the same double:
+ * 15 significant digits are enough for most values (e.g. 0.1 instead of
+ * 0.10000000000000001), 17 digits for the others.
+ */
+static int
+format_csv_value (char   *buf,
+		  gsize   buf_size,
+		  double  value)
+{
+	int len;
+
+	len = g_snprintf (buf, buf_size, "%.15g", value);
+	if (g_ascii_strtod (buf, NULL) != value)
+	{
+		len = g_snprintf (buf, buf_size, "%.17g", value);
+	}
+
+	return len;
+}
+
+static gboolean
+export_csv (Exporter  *exporter,
+	    GError   **error)
+{
+	FILE *file;
+	char *tmp_filename;
+	Data *batch;
+	guint index;
+	guint field_num;
+	gboolean ok = TRUE;
+
+	/* Write to a temporary file, so that a partial file is never taken
+	 * for a complete export.
+	 */
+	tmp_filename = g_strconcat (exporter->path, ".tmp", NULL);
+
+	file = open_file (tmp_filename, error);
+	if (file == NULL)
+	{
+		g_free (tmp_filename);
+		return FALSE;
+	}
+
+	for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+	{
+		fprintf (file, "%s%c",
+			 data_fields[field_num].name,
+			 field_num + 1 < DATA_N_FIELDS ? ',' : '\n');
+	}
+
+	batch = g_new (Data, BATCH_SIZE);
+
+	for (index = exporter->begin; index < exporter->end; index += BATCH_SIZE)
+	{
+		guint n;
+		guint i;
+
+		if (!copy_batch (exporter, index, batch, &n, error))
+		{
+			ok = FALSE;
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			char line[DATA_N_FIELDS * 32];
+			char *p = line;
+
+			for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+			{
+				p += format_csv_value (p, 32, DATA_FIELD_VALUE (&batch[i], field_num));
+				*p++ = field_num + 1 < DATA_N_FIELDS ? ',' : '\n';
+			}
+
+			fwrite (line, 1, p - line, file);
+		}
+
+		g_atomic_int_set (&exporter->n_exported, index + n - exporter->begin);
+	}
+
+	g_free (batch);
+
+	if (!close_file (file, tmp_filename, ok ? error : NULL) || !ok)
+	{
+		g_remove (tmp_filename);
+		g_free (tmp_filename);
+		return FALSE;
+	}
+
+	if (g_rename (tmp_filename, exporter->path) != 0)
+	{
+		set_error_from_errno (error, exporter->path);
+		g_remove (tmp_filename);
+		g_free (tmp_filename);
+		return FALSE;
+	}
+
+	g_free (tmp_filename);
+	return TRUE;
+}
+
+static gboolean
+export_run (Exporter  *exporter,
+	    GError   **error)
+{
+	switch (exporter->format)
+	{
+		case EXPORT_FORMAT_NPY:
+			return export_npy (exporter, error);
+
+		case EXPORT_FORMAT_CSV:
+			return export_csv (exporter, error);
+
+		default:
+			g_assert_not_reached ();
+			return FALSE;
+	}
+}
+
+static gpointer
+export_thread (gpointer user_data)
+{
+	Exporter *exporter = user_data;
+	gboolean ok;
+
+	/* A long export must not take the CPU of the main loop. */
+	realtime_reset_thread ();
+
+	ok = export_run (exporter, &exporter->error);
+
+	g_atomic_int_set (&exporter->state, ok ? EXPORT_STATE_DONE : EXPORT_STATE_FAILED);
+	return NULL;
+}
+
+Exporter *
+exporter_new (SampleStore *store)
+{
+	Exporter *exporter;
+
+	exporter = g_new0 (Exporter, 1);
+	exporter->store = store;
+	exporter->state = EXPORT_STATE_IDLE;
+
+	return exporter;
+}
+
+/* Joins the thread if the export is finished. */
+static void
+join_finished_thread (Exporter *exporter)
+{
+	if (exporter->thread != NULL &&
+	    g_atomic_int_get (&exporter->state) != EXPORT_STATE_RUNNING)
+	{
+		g_thread_join (exporter->thread);
+		exporter->thread = NULL;
+	}
+}
+
+/* Waits for the end of the current export, if any. */
+void
+exporter_free (Exporter *exporter)
+{
+	if (exporter == NULL)
+	{
+		return;
+	}
+
+	if (exporter->thread != NULL)
+	{
+		g_thread_join (exporter->thread);
+	}
+
+	g_clear_error (&exporter->error);
+	g_free (exporter->path);
+	g_free (exporter);
+}
+
+gboolean
+exporter_parse_format (const char   *str,
+		       ExportFormat *format)
+{
+	if (g_strcmp0 (str, "npy") == 0)
+	{
+		*format = EXPORT_FORMAT_NPY;
+		return TRUE;
+	}
+
+	if (g_strcmp0 (str, "csv") == 0)
+	{
+		*format = EXPORT_FORMAT_CSV;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Starts to export the samples [@begin, @end) of the store to @path in a
+ * background thread. Only one export can run at a time.
+ */
+gboolean
+exporter_start (Exporter      *exporter,
+		ExportFormat   format,
+		const char    *path,
+		guint          begin,
+		guint          end,
+		GError       **error)
+{
+	join_finished_thread (exporter);
+
+	if (exporter->thread != NULL)
+	{
+		g_set_error_literal (error,
+				     EXPORT_ERROR,
+				     0,
+				     "An export is already running.");
+		return FALSE;
+	}
+
+	g_free (exporter->path);
+	exporter->path = g_strdup (path);
+	exporter->format = format;
+	exporter->begin = begin;
+	exporter->end = MAX (begin, end);
+	exporter->n_exported = 0;
+	g_clear_error (&exporter->error);
+
+	exporter->state = EXPORT_STATE_RUNNING;
+	exporter->thread = g_thread_try_new ("export", export_thread, exporter, error);
+	if (exporter->thread == NULL)
+	{
+		exporter->state = EXPORT_STATE_IDLE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Exports synchronously, in the calling thread. */
+gboolean
+exporter_run (SampleStore   *store,
+	      ExportFormat   format,
+	      const char    *path,
+	      guint          begin,
+	      guint          end,
+	      GError       **error)
+{
+	Exporter *exporter;
+	gboolean ok;
+
+	exporter = exporter_new (store);
+	exporter->format = format;
+	exporter->path = g_strdup (path);
+	exporter->begin = begin;
+	exporter->end = MAX (begin, end);
+
+	ok = export_run (exporter, error);
+
+	exporter_free (exporter);
+	return ok;
+}
+
+gboolean
+exporter_is_running (Exporter *exporter)
+{
+	join_finished_thread (exporter);
+	return exporter->thread != NULL;
+}
+
+/* Returns: the status of the current or last export, as a string:
+ * "idle", "running <n exported>/<n total> <path>", "done <n> <path>" or
+ * "failed <error message>".
+ */
+char *
+exporter_get_status (Exporter *exporter)
+{
+	guint n_total = exporter->end - exporter->begin;
+
+	join_finished_thread (exporter);
+
+	switch (g_atomic_int_get (&exporter->state))
+	{
+		case EXPORT_STATE_RUNNING:
+			return g_strdup_printf ("running %d/%u %s",
+						g_atomic_int_get (&exporter->n_exported),
+						n_total,
+						exporter->path);
+
+		case EXPORT_STATE_DONE:
+			return g_strdup_printf ("done %u %s", n_total, exporter->path);
+
+		case EXPORT_STATE_FAILED:
+			return g_strdup_printf ("failed %s", exporter->error->message);
+
+		case EXPORT_STATE_IDLE:
+		default:
+			return g_strdup ("idle");
+	}
+}
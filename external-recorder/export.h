@@ -0,0 +1,59 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_EXPORT_H
+#define COSY_EXPORT_H
+
+#include <glib.h>
+#include "sample-store.h"
+
+typedef enum
+{
+	EXPORT_FORMAT_NPY,
+	EXPORT_FORMAT_CSV
+} ExportFormat;
+
+typedef struct _Exporter Exporter;
+
+Exporter *	exporter_new			(SampleStore   *store);
+
+void		exporter_free			(Exporter      *exporter);
+
+gboolean	exporter_parse_format		(const char    *str,
+						 ExportFormat  *format);
+
+gboolean	exporter_start			(Exporter      *exporter,
+						 ExportFormat   format,
+						 const char    *path,
+						 guint          begin,
+						 guint          end,
+						 GError       **error);
+
+gboolean	exporter_run			(SampleStore   *store,
+						 ExportFormat   format,
+						 const char    *path,
+						 guint          begin,
+						 guint          end,
+						 GError       **error);
+
+gboolean	exporter_is_running		(Exporter      *exporter);
+
+char *		exporter_get_status		(Exporter      *exporter);
+
+#endif /* COSY_EXPORT_H */
@@ -23,8 +23,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 #include <zmq.h>
-#include <msgpack.h>
+#include "data.h"
+#include "data-format.h"
+#include "data-binary.h"
+#include "sample-store.h"
+#include "config.h"
+#include "realtime.h"
+#include "jitter-stats.h"
+#include "export.h"
+#include "gaze-filter.h"
+#include "shm-ring.h"
+#include "pupil-decoder.h"
+#include "load-monitor.h"
+#include "curve.h"
+#include "watchdog.h"
 
 /* Architecture notes:
  *
@@ -47,69 +63,195 @@
  *   we would loose some data.
  */
 
-#define PUPIL_REMOTE_ADDRESS "tcp://localhost:50020"
-#define REPLIER_ENDPOINT "tcp://*:6000"
+/* A Pupil Capture instance, with its own connection, decoding and store. The
+ * first source is configured by the [pupil] group, the others by the
+ * [source:NAME] groups, for example to record two participants, or a
+ * head-mounted and a remote eye tracker.
+ */
+typedef struct _PupilSource PupilSource;
+struct _PupilSource
+{
+	/* From the configuration. */
+	const char *name;
+	const char *remote_address;
+	const char *subscriber_host;
+	const char *subscription;
 
-#define DEBUG FALSE
+	/* The requester to the Pupil Remote plugin, for the R and r requests. */
+	void *pupil_remote;
 
-typedef struct _Data Data;
-struct _Data
-{
-	double timestamp;
-	double pupil_diameter;
+	/* Another requester to Pupil Remote, for the non-blocking SUB_PORT
+	 * handshake, see maintain_pupil_connection().
+	 */
+	void *pupil_probe;
+
+	/* The subscriber to listen to the data coming from Pupil Capture.
+	 * %NULL while Pupil Capture is unreachable.
+	 */
+	void *subscriber;
+
+	/* The port of @subscriber, given by Pupil Remote. */
+	char *sub_port;
+
+	/* Reconnection to Pupil Capture, see maintain_pupil_connection(). */
+	gint64 last_message_time_us;
+	gint64 next_connect_attempt_us;
+	gint64 probe_sent_time_us;
+	int connect_backoff_ms;
+
+	/* The recorded data. It is kept until the clear request, so that it
+	 * can be queried by time range or by trial.
+	 */
+	SampleStore *store;
+
+	/* Writes the recorded data to files, in a background thread. */
+	Exporter *exporter;
+
+	/* Index in @store of the first sample not yet returned by
+	 * receive_data.
+	 */
+	guint receive_data_cursor;
+
+	/* Extracts the samples from the msgpack data. */
+	PupilDecoder *decoder;
+
+	/* The recorded samples decoded since the last flush_batch(). They are
+	 * processed together and then added to @store.
+	 */
+	GArray *batch;
+
+	/* %NULL if the gaze filter is disabled. */
+	GazeFilter *gaze_filter;
+
+	/* Index of the first event not yet returned by the events request. */
+	guint events_cursor;
+
+	/* Switches to cheaper modes when the ingest lags behind Pupil
+	 * Capture. Also gives the clock offset of the source.
+	 */
+	LoadMonitor load;
 
-	double pupil_norm_pos_x;
-	double pupil_norm_pos_y;
-	double pupil_confidence;
+	/* Number of samples at the end of @store that have not been processed
+	 * by the gaze filter yet, because of the defer mode.
+	 */
+	guint n_deferred;
+
+	/* Frames received while not recording, and how many of them have not
+	 * been decoded, see should_decode_frame().
+	 */
+	guint64 n_idle_frames;
+	guint64 n_undecoded_frames;
+
+	/* The gaze frames received, decoded or not, see track_frame(). */
+	guint64 n_frames;
+	gint64 last_frame_time_us;
+	double last_frame_timestamp;
+	double frame_rate;
+	double rate_window_start;
+	guint rate_window_n_frames;
+
+	/* Time since the last frame, or since the startup before the first
+	 * one. @frame_age_name is "<name>_frame_age".
+	 */
+	WatchdogCheck frame_age;
+	char *frame_age_name;
+
+	/* Whether Pupil messages are received, i.e. a recording would get
+	 * data.
+	 */
+	guint pupil_ready : 1;
+
+	/* Whether the latest request to Pupil Remote, or the latest SUB_PORT
+	 * handshake, got no reply in time.
+	 */
+	guint pupil_remote_down : 1;
 
-	double gaze_norm_pos_x;
-	double gaze_norm_pos_y;
-	double gaze_confidence;
+	/* Whether Pupil Remote has acknowledged the R request, so the r
+	 * request must be sent.
+	 */
+	guint pupil_recording : 1;
 };
 
 typedef struct _Recorder Recorder;
 struct _Recorder
 {
+	/* The configuration, validated at startup. */
+	Config *config;
+
 	/* The zeromq context. */
 	void *context;
 
-	/* The requester to the Pupil Remote plugin. */
-	void *pupil_remote;
-
-	/* The subscriber to listen to the data coming from Pupil Capture. */
-	void *subscriber;
-
 	/* The replier, to listen and reply to some requests coming from another
 	 * program than the Pupil (in our case, a Matlab script running on
 	 * another computer).
 	 */
 	void *replier;
 
-	/* Contains a list of recorded Data*. */
-	GQueue *data_queue;
+	/* The ZAP handler authenticating the CURVE clients of the replier.
+	 * %NULL without CURVE or without client authentication.
+	 */
+	CurveAuthenticator *authenticator;
+
+	/* The PupilSource, the first one is the [pupil] group. They all
+	 * record the same trials, and are served by the same main loop.
+	 */
+	GPtrArray *sources;
+
+	/* Trial ID used by the next start request without ID. */
+	gint64 next_trial_id;
 
 	GTimer *timer;
 
+	/* How late the main loop wakes up after the replier timeout. */
+	JitterStats wakeup_jitter;
+
+	/* All the decoded samples of the first source, for the consumers on
+	 * the same computer. %NULL if disabled.
+	 */
+	ShmRing *shm_ring;
+
+	/* Cost of the gaze filter, for all the sources: per batch, and in
+	 * total.
+	 */
+	JitterStats filter_batch_cost;
+	guint64 filter_n_samples;
+	gint64 filter_total_ns;
+	guint64 filter_n_over_budget;
+
+	/* The watchdog, see check_health(). The publisher sends the
+	 * heartbeats and the alarms.
+	 */
+	void *watchdog_publisher;
+	WatchdogCheck loop_jitter;
+	WatchdogCheck reply_latency;
+	gint64 start_time_us;
+	gint64 next_heartbeat_us;
+	guint64 n_heartbeats;
+
 	guint recording : 1;
+
+	/* Between start_block and stop_block. */
+	guint in_block : 1;
 };
 
-typedef enum
-{
-	TOPIC_PUPIL,
-	TOPIC_GAZE,
-	TOPIC_OTHER
-} Topic;
+/* Set by the SIGINT and SIGTERM handler, to leave the main loop. */
+static volatile sig_atomic_t quit_requested = 0;
+
+/* Initial delay before retrying to connect to Pupil Capture. It is doubled
+ * after each failure, up to pupil.reconnect-max-backoff-ms.
+ */
+#define CONNECT_INITIAL_BACKOFF_MS 100
 
 /* Prototypes */
-static gboolean extract_info_from_msgpack_map (Data           *data,
-					       msgpack_object *obj,
-					       Topic           topic);
+static void flush_batch (Recorder    *recorder,
+			 PupilSource *source);
 
-/* Receives the next zmq message part as a string.
- * Free the return value with g_free() when no longer needed.
+/* Receives the next zmq message part as a string, with the zmq_msg_recv()
+ * @flags. Free the return value with g_free() when no longer needed.
  */
 static char *
-receive_next_message (void *socket)
+receive_message (void *socket,
+		 int   flags)
 {
 	zmq_msg_t msg;
 	int n_bytes;
@@ -119,7 +261,7 @@ receive_next_message (void *socket)
 	ok = zmq_msg_init (&msg);
 	g_return_val_if_fail (ok == 0, NULL);
 
-	n_bytes = zmq_msg_recv (&msg, socket, 0);
+	n_bytes = zmq_msg_recv (&msg, socket, flags);
 	if (n_bytes > 0)
 	{
 		void *raw_data;
@@ -138,16 +280,24 @@ receive_next_message (void *socket)
 	return str;
 }
 
-static void
-init_pupil_remote (Recorder *recorder)
+static char *
+receive_next_message (void *socket)
+{
+	return receive_message (socket, 0);
+}
+
+/* Returns: a new REQ socket connected to the Pupil Remote of @source. */
+static void *
+create_pupil_remote_socket (Recorder    *recorder,
+			    PupilSource *source)
 {
+	void *socket;
 	int timeout_ms;
+	int linger_ms;
 	int ok;
 
-	g_assert (recorder->pupil_remote == NULL);
-
-	recorder->pupil_remote = zmq_socket (recorder->context, ZMQ_REQ);
-	ok = zmq_connect (recorder->pupil_remote, PUPIL_REMOTE_ADDRESS);
+	socket = zmq_socket (recorder->context, ZMQ_REQ);
+	ok = zmq_connect (socket, source->remote_address);
 	if (ok != 0)
 	{
 		g_error ("Error when connecting to Pupil Remote: %s", g_strerror (errno));
@@ -157,8 +307,8 @@ init_pupil_remote (Recorder *recorder)
 	 * computer. Setting a timeout permits to know if we can't communicate
 	 * with the Pupil Remote plugin.
 	 */
-	timeout_ms = 1000;
-	ok = zmq_setsockopt (recorder->pupil_remote,
+	timeout_ms = recorder->config->pupil_remote_timeout_ms;
+	ok = zmq_setsockopt (socket,
 			     ZMQ_RCVTIMEO,
 			     &timeout_ms,
 			     sizeof (int));
@@ -167,20 +317,81 @@ init_pupil_remote (Recorder *recorder)
 		g_error ("Error when setting ZeroMQ socket option for the Pupil Remote: %s",
 			 g_strerror (errno));
 	}
+
+	ok = zmq_setsockopt (socket,
+			     ZMQ_SNDTIMEO,
+			     &timeout_ms,
+			     sizeof (int));
+	if (ok != 0)
+	{
+		g_error ("Error when setting ZeroMQ socket option for the Pupil Remote: %s",
+			 g_strerror (errno));
+	}
+
+	/* Don't keep unsent requests when the socket is closed, to not block
+	 * zmq_ctx_destroy() if Pupil Capture is gone.
+	 */
+	linger_ms = 0;
+	ok = zmq_setsockopt (socket,
+			     ZMQ_LINGER,
+			     &linger_ms,
+			     sizeof (int));
+	if (ok != 0)
+	{
+		g_error ("Error when setting ZeroMQ socket option for the Pupil Remote: %s",
+			 g_strerror (errno));
+	}
+
+	return socket;
+}
+
+/* Sends @request to Pupil Remote and returns its reply, or %NULL if Pupil
+ * Remote doesn't reply in time. A REQ socket can't send another request
+ * before receiving the reply, so in that case the socket is recreated (in the
+ * same ZeroMQ context).
+ */
+static char *
+pupil_remote_request (Recorder    *recorder,
+		      PupilSource *source,
+		      const char  *request)
+{
+	char *reply = NULL;
+
+	if (zmq_send (source->pupil_remote, request, strlen (request), 0) != -1)
+	{
+		reply = receive_next_message (source->pupil_remote);
+	}
+
+	source->pupil_remote_down = reply == NULL;
+
+	if (reply == NULL)
+	{
+		g_warning ("[%s] Impossible to communicate with the Pupil Remote plugin "
+			   "(request \"%s\").",
+			   source->name,
+			   request);
+
+		zmq_close (source->pupil_remote);
+		source->pupil_remote = create_pupil_remote_socket (recorder, source);
+	}
+
+	return reply;
 }
 
+/* @sub_port: the port of the Pupil publisher, given by Pupil Remote. */
 static void
-init_subscriber (Recorder *recorder)
+init_subscriber (Recorder    *recorder,
+		 PupilSource *source,
+		 const char  *sub_port)
 {
-	const char *request;
-	char *sub_port;
 	char *address;
 	const char *filter;
 	int timeout_ms;
+	int linger_ms;
+	int hwm;
 	int ok;
 
-	g_assert (recorder->pupil_remote != NULL);
-	g_assert (recorder->subscriber == NULL);
+	g_assert (source->subscriber == NULL);
 
 	/* Do the same as in:
 	 * https://github.com/pupil-labs/pupil-helpers/blob/master/pupil_remote/filter_messages.py
@@ -188,42 +399,21 @@ init_subscriber (Recorder *recorder)
 	 * Plus tune some ZeroMQ options.
 	 */
 
-	/* Ask to Pupil Remote the subscriber port. */
-	request = "SUB_PORT";
-	zmq_send (recorder->pupil_remote,
-		  request,
-		  strlen (request),
-		  0);
-
-	sub_port = receive_next_message (recorder->pupil_remote);
-	if (sub_port == NULL)
-	{
-		g_error ("Timeout. Impossible to communicate with the Pupil Remote plugin.");
-	}
+	address = g_strdup_printf ("tcp://%s:%s",
+				   source->subscriber_host,
+				   sub_port);
 
-	address = g_strdup_printf ("tcp://localhost:%s", sub_port);
-
-	recorder->subscriber = zmq_socket (recorder->context, ZMQ_SUB);
-	ok = zmq_connect (recorder->subscriber, address);
+	source->subscriber = zmq_socket (recorder->context, ZMQ_SUB);
+	ok = zmq_connect (source->subscriber, address);
 	if (ok != 0)
 	{
 		g_error ("Error when connecting to the ZeroMQ subscriber: %s",
 			 g_strerror (errno));
 	}
 
-	if (DEBUG)
-	{
-		/* Receive all messages. */
-		/*filter = "";*/
-
-		filter = "gaze";
-	}
-	else
-	{
-		filter = "gaze";
-	}
+	filter = source->subscription;
 
-	ok = zmq_setsockopt (recorder->subscriber,
+	ok = zmq_setsockopt (source->subscriber,
 			     ZMQ_SUBSCRIBE,
 			     filter,
 			     strlen (filter));
@@ -233,11 +423,25 @@ init_subscriber (Recorder *recorder)
 			 g_strerror (errno));
 	}
 
+	/* Number of Pupil messages queued by ZeroMQ when we are late. Beyond
+	 * that, messages are dropped.
+	 */
+	hwm = recorder->config->subscriber_hwm;
+	ok = zmq_setsockopt (source->subscriber,
+			     ZMQ_RCVHWM,
+			     &hwm,
+			     sizeof (int));
+	if (ok != 0)
+	{
+		g_error ("Error when setting ZeroMQ socket option for the subscriber: %s",
+			 g_strerror (errno));
+	}
+
 	/* Don't block the subscriber, to prioritize the replier, to have the
 	 * minimum latency between the client and server.
 	 */
 	timeout_ms = 0;
-	ok = zmq_setsockopt (recorder->subscriber,
+	ok = zmq_setsockopt (source->subscriber,
 			     ZMQ_RCVTIMEO,
 			     &timeout_ms,
 			     sizeof (int));
@@ -247,24 +451,246 @@ init_subscriber (Recorder *recorder)
 			 g_strerror (errno));
 	}
 
-	g_free (sub_port);
+	linger_ms = 0;
+	ok = zmq_setsockopt (source->subscriber,
+			     ZMQ_LINGER,
+			     &linger_ms,
+			     sizeof (int));
+	if (ok != 0)
+	{
+		g_error ("Error when setting ZeroMQ socket option for the subscriber: %s",
+			 g_strerror (errno));
+	}
+
 	g_free (address);
 }
 
+/* Handles the reply of Pupil Remote to SUB_PORT: (re)creates the subscriber
+ * if the port has changed (e.g. Pupil Capture has been restarted). If the
+ * port is the same, ZeroMQ reconnects the existing subscriber by itself.
+ */
+static void
+set_sub_port (Recorder    *recorder,
+	      PupilSource *source,
+	      char        *sub_port)
+{
+	if (source->subscriber != NULL &&
+	    g_strcmp0 (sub_port, source->sub_port) == 0)
+	{
+		g_free (sub_port);
+		return;
+	}
+
+	if (source->subscriber != NULL)
+	{
+		g_print ("[%s] The Pupil publisher port changed from %s to %s, reconnecting.\n",
+			 source->name,
+			 source->sub_port,
+			 sub_port);
+
+		/* Flush the samples of the old subscriber. */
+		flush_batch (recorder, source);
+		load_monitor_reset (&source->load);
+
+		zmq_close (source->subscriber);
+		source->subscriber = NULL;
+	}
+	else
+	{
+		g_print ("[%s] Pupil Remote replied, subscribing to the Pupil publisher.\n",
+			 source->name);
+	}
+
+	/* Connecting is asynchronous, so the subscription is established
+	 * in the background, while the main loop goes on.
+	 */
+	init_subscriber (recorder, source, sub_port);
+
+	g_free (source->sub_port);
+	source->sub_port = sub_port;
+}
+
+/* Called at each iteration of the main loop, for each source, never blocks.
+ *
+ * The SUB_PORT handshake with Pupil Remote is done on its own socket
+ * (@pupil_probe), without waiting for the reply: the request is sent, and the
+ * reply is read in a later iteration. So external-recorder replies to its
+ * clients while Pupil Capture is starting (status "waiting_for_pupil").
+ *
+ * The handshake is done at startup, and again if no Pupil message has been
+ * received for pupil.reconnect-silence-ms. Without reply after
+ * pupil.remote-timeout-ms, the socket is recreated and the handshake is
+ * retried after an exponential backoff.
+ */
+static void
+maintain_pupil_connection (Recorder    *recorder,
+			   PupilSource *source)
+{
+	const Config *config = recorder->config;
+	gint64 now_us;
+
+	now_us = g_get_monotonic_time ();
+
+	if (source->probe_sent_time_us != 0)
+	{
+		char *sub_port;
+
+		sub_port = receive_message (source->pupil_probe, ZMQ_DONTWAIT);
+		if (sub_port != NULL)
+		{
+			source->probe_sent_time_us = 0;
+			source->pupil_remote_down = FALSE;
+			set_sub_port (recorder, source, sub_port);
+
+			/* Wait for another silence period before asking
+			 * again.
+			 */
+			source->last_message_time_us = now_us;
+			source->connect_backoff_ms = CONNECT_INITIAL_BACKOFF_MS;
+			source->next_connect_attempt_us = 0;
+		}
+		else if (now_us - source->probe_sent_time_us > config->pupil_remote_timeout_ms * (gint64) 1000)
+		{
+			g_print ("[%s] Pupil Remote doesn't reply, retrying in %d ms.\n",
+				 source->name,
+				 source->connect_backoff_ms);
+
+			/* A REQ socket can't send another request before
+			 * receiving the reply.
+			 */
+			zmq_close (source->pupil_probe);
+			source->pupil_probe = create_pupil_remote_socket (recorder, source);
+			source->probe_sent_time_us = 0;
+			source->pupil_remote_down = TRUE;
+
+			source->next_connect_attempt_us = now_us + source->connect_backoff_ms * (gint64) 1000;
+			source->connect_backoff_ms = MIN (source->connect_backoff_ms * 2,
+							  config->pupil_reconnect_max_backoff_ms);
+		}
+
+		return;
+	}
+
+	if (source->subscriber != NULL &&
+	    now_us - source->last_message_time_us < config->pupil_reconnect_silence_ms * (gint64) 1000)
+	{
+		return;
+	}
+
+	if (source->pupil_ready)
+	{
+		g_warning ("[%s] No Pupil message for %d ms, waiting for Pupil Capture.",
+			   source->name,
+			   config->pupil_reconnect_silence_ms);
+		source->pupil_ready = FALSE;
+	}
+
+	if (now_us < source->next_connect_attempt_us)
+	{
+		return;
+	}
+
+	if (zmq_send (source->pupil_probe, "SUB_PORT", strlen ("SUB_PORT"), ZMQ_DONTWAIT) != -1)
+	{
+		source->probe_sent_time_us = now_us;
+	}
+	else
+	{
+		source->next_connect_attempt_us = now_us + source->connect_backoff_ms * (gint64) 1000;
+	}
+}
+
+/* Encrypts the replier with CURVE, if a secret key is configured. The
+ * requests and replies travel on the lab network, and the data of the
+ * participants must not be readable or injectable by other computers.
+ */
+static void
+init_replier_security (Recorder *recorder)
+{
+	const Config *config = recorder->config;
+	char public_key[CURVE_KEY_SIZE];
+	GError *error = NULL;
+
+	if (config->replier_curve_secret_key_file[0] == '\0')
+	{
+		return;
+	}
+
+	/* The ZAP handler must be bound before the replier, otherwise the
+	 * first clients are not authenticated.
+	 */
+	if (config->replier_curve_authorized_keys_file[0] != '\0')
+	{
+		recorder->authenticator = curve_authenticator_new (recorder->context,
+								   config->replier_curve_authorized_keys_file,
+								   &error);
+		if (error != NULL)
+		{
+			g_error ("Error when loading the authorized CURVE keys: %s",
+				 error->message);
+		}
+	}
+	else
+	{
+		g_warning ("No [replier] curve-authorized-keys-file: the traffic is "
+			   "encrypted, but all the clients knowing the public key "
+			   "of the server are accepted.");
+	}
+
+	if (!curve_setup_server (recorder->replier,
+				 config->replier_curve_secret_key_file,
+				 public_key,
+				 &error))
+	{
+		g_error ("Error when enabling CURVE on the replier: %s",
+			 error->message);
+	}
+
+	g_print ("CURVE enabled, public key of the replier: %s\n", public_key);
+}
+
 static void
 init_replier (Recorder *recorder)
 {
 	int timeout_ms;
+	int linger_ms;
+	int hwm;
 	int ok;
 
 	g_assert (recorder->replier == NULL);
 
 	recorder->replier = zmq_socket (recorder->context, ZMQ_REP);
-	ok = zmq_bind (recorder->replier, REPLIER_ENDPOINT);
+
+	linger_ms = 0;
+	ok = zmq_setsockopt (recorder->replier,
+			     ZMQ_LINGER,
+			     &linger_ms,
+			     sizeof (int));
+	if (ok != 0)
+	{
+		g_error ("Error when setting ZeroMQ socket option for the replier: %s",
+			 g_strerror (errno));
+	}
+
+	hwm = recorder->config->replier_send_hwm;
+	ok = zmq_setsockopt (recorder->replier,
+			     ZMQ_SNDHWM,
+			     &hwm,
+			     sizeof (int));
+	if (ok != 0)
+	{
+		g_error ("Error when setting ZeroMQ socket option for the replier: %s",
+			 g_strerror (errno));
+	}
+
+	init_replier_security (recorder);
+
+	ok = zmq_bind (recorder->replier, recorder->config->replier_endpoint);
 	if (ok != 0)
 	{
-		g_error ("Error when creating ZeroMQ socket at \"" REPLIER_ENDPOINT "\": %s.\n"
+		g_error ("Error when creating ZeroMQ socket at \"%s\": %s.\n"
 			 "Is another external-recorder process running?",
+			 recorder->config->replier_endpoint,
 			 g_strerror (errno));
 	}
 
@@ -275,7 +701,7 @@ init_replier (Recorder *recorder)
 	 * normally the time to process all Pupil messages and change the
 	 * socket to see if there is a request.
 	 */
-	timeout_ms = 10;
+	timeout_ms = recorder->config->replier_timeout_ms;
 	ok = zmq_setsockopt (recorder->replier,
 			     ZMQ_RCVTIMEO,
 			     &timeout_ms,
@@ -288,468 +714,532 @@ init_replier (Recorder *recorder)
 }
 
 static void
-recorder_init (Recorder *recorder)
+reset_filter_cost (Recorder *recorder)
 {
-	g_assert (recorder->context == NULL);
-	recorder->context = zmq_ctx_new ();
-
-	init_pupil_remote (recorder);
-	init_subscriber (recorder);
-	init_replier (recorder);
-
-	recorder->data_queue = g_queue_new ();
-	recorder->timer = NULL;
-	recorder->recording = FALSE;
+	jitter_stats_reset (&recorder->filter_batch_cost);
+	recorder->filter_n_samples = 0;
+	recorder->filter_total_ns = 0;
+	recorder->filter_n_over_budget = 0;
+}
 
-	g_print ("Initialized successfully.\n\n");
+static void
+reset_stream_stats (PupilSource *source)
+{
+	source->n_frames = 0;
+	source->last_frame_time_us = 0;
+	source->last_frame_timestamp = -1.0;
+	source->frame_rate = 0.0;
+	source->rate_window_start = 0.0;
+	source->rate_window_n_frames = 0;
 }
 
+/* Adds a source and starts its Pupil handshake. */
 static void
-recorder_finalize (Recorder *recorder)
+add_source (Recorder   *recorder,
+	    const char *name,
+	    const char *remote_address,
+	    const char *subscriber_host,
+	    const char *subscription)
 {
-	zmq_close (recorder->subscriber);
-	recorder->subscriber = NULL;
+	const Config *config = recorder->config;
+	PupilSource *source;
 
-	zmq_close (recorder->pupil_remote);
-	recorder->pupil_remote = NULL;
+	source = g_new0 (PupilSource, 1);
+	source->name = name;
+	source->remote_address = remote_address;
+	source->subscriber_host = subscriber_host;
+	source->subscription = subscription;
 
-	zmq_close (recorder->replier);
-	recorder->replier = NULL;
+	/* Start the Pupil handshake now, it goes on in the background (in the
+	 * ZeroMQ I/O thread) while the store is allocated and prefaulted.
+	 */
+	source->pupil_remote = create_pupil_remote_socket (recorder, source);
+	source->pupil_probe = create_pupil_remote_socket (recorder, source);
+	source->connect_backoff_ms = CONNECT_INITIAL_BACKOFF_MS;
+	maintain_pupil_connection (recorder, source);
 
-	zmq_ctx_destroy (recorder->context);
-	recorder->context = NULL;
+	source->store = sample_store_new (config->store_capacity);
+	if (config->prefault_store)
+	{
+		sample_store_prefault (source->store);
+	}
 
-	g_queue_free_full (recorder->data_queue, g_free);
-	recorder->data_queue = NULL;
+	source->exporter = exporter_new (source->store);
+	source->receive_data_cursor = 0;
 
-	if (recorder->timer != NULL)
+	source->decoder = pupil_decoder_new ();
+	pupil_decoder_set_debug (source->decoder, config->debug);
+
+	source->batch = g_array_sized_new (FALSE, FALSE, sizeof (Data), SAMPLE_STORE_CHUNK_SIZE);
+
+	if (config->filter_enabled)
 	{
-		g_timer_destroy (recorder->timer);
-		recorder->timer = NULL;
+		GazeFilterParams params;
+
+		params.min_cutoff_hz = config->filter_min_cutoff_hz;
+		params.beta = config->filter_beta;
+		params.derivative_cutoff_hz = config->filter_derivative_cutoff_hz;
+		params.min_confidence = config->filter_min_confidence;
+		params.saccade_velocity = config->filter_saccade_velocity;
+
+		source->gaze_filter = gaze_filter_new (&params);
 	}
-}
 
-static Data *
-data_new (void)
-{
-	Data *data;
+	source->events_cursor = 0;
 
-	data = g_new (Data, 1);
+	load_monitor_init (&source->load,
+			   config->load_adaptive,
+			   config->load_quiet_lag_ms / 1000.0,
+			   config->load_defer_lag_ms / 1000.0,
+			   config->load_decimate_lag_ms / 1000.0);
+	source->n_deferred = 0;
+	source->n_idle_frames = 0;
+	source->n_undecoded_frames = 0;
+	reset_stream_stats (source);
 
-	data->timestamp = -1.0;
-	data->pupil_diameter = -1.0;
-	data->pupil_norm_pos_x = -1.0;
-	data->pupil_norm_pos_y = -1.0;
-	data->pupil_confidence = -1.0;
+	watchdog_check_init (&source->frame_age,
+			     (gint64) config->watchdog_frame_age_budget_ms * 1000);
+	source->frame_age_name = g_strdup_printf ("%s_frame_age", name);
 
-	return data;
+	g_ptr_array_add (recorder->sources, source);
 }
 
-/* Returns whether something has been extracted. */
-static gboolean
-extract_info_from_msgpack_key_value (Data              *data,
-				     msgpack_object_kv *key_value,
-				     Topic              topic)
+static PupilSource *
+get_source (Recorder *recorder,
+	    guint     source_num)
 {
-	msgpack_object *key;
-	msgpack_object *value;
-	msgpack_object_str *key_str;
-
-	key = &key_value->key;
-	value = &key_value->val;
-
-	if (key->type != MSGPACK_OBJECT_STR)
-	{
-		g_warning ("msgpack: expected a string for the key in a key_value pair, "
-			   "got type=%d instead.",
-			   key->type);
-		return FALSE;
-	}
+	return g_ptr_array_index (recorder->sources, source_num);
+}
 
-	key_str = &key->via.str;
-	if (key_str->ptr == NULL)
-	{
-		return FALSE;
-	}
+/* Returns: the source called @name, or %NULL. */
+static PupilSource *
+find_source (Recorder   *recorder,
+	     const char *name)
+{
+	guint source_num;
 
-	if (strncmp (key_str->ptr, "topic", key_str->size) == 0)
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
 	{
-		msgpack_object_str *str;
-		char *topic_str;
+		PupilSource *source = get_source (recorder, source_num);
 
-		if (value->type != MSGPACK_OBJECT_STR)
+		if (g_str_equal (source->name, name))
 		{
-			g_warning ("msgpack: expected a string for the topic value, "
-				   "got type=%d instead.",
-				   value->type);
-			return FALSE;
+			return source;
 		}
+	}
 
-		str = &value->via.str;
-		topic_str = g_strndup (str->ptr, str->size);
+	return NULL;
+}
 
-		/* Sanity checking */
-		if (topic == TOPIC_GAZE &&
-		    g_strcmp0 (topic_str, "gaze") != 0)
-		{
-			g_warning ("msgpack: expected gaze topic, "
-				   "got '%s' instead.",
-				   topic_str);
-		}
-		else if (topic == TOPIC_PUPIL &&
-			 g_strcmp0 (topic_str, "pupil") != 0)
-		{
-			g_warning ("msgpack: expected pupil topic, "
-				   "got '%s' instead.",
-				   topic_str);
-		}
+/* The publisher is local (an ipc:// endpoint by default): it is for the
+ * experiment scripts and the monitoring tools running next to
+ * external-recorder. With CURVE, it uses the key of the replier. There is no
+ * publisher if watchdog.endpoint is empty.
+ */
+static void
+init_watchdog (Recorder *recorder)
+{
+	const Config *config = recorder->config;
+	int linger_ms = 0;
+	int hwm = 100;
 
-		g_free (topic_str);
+	watchdog_check_init (&recorder->loop_jitter,
+			     config->watchdog_loop_jitter_budget_us);
+	watchdog_check_init (&recorder->reply_latency,
+			     config->watchdog_reply_latency_budget_us);
 
-		/* Nothing was extracted into the @data struct. */
-		return FALSE;
-	}
+	recorder->start_time_us = g_get_monotonic_time ();
+	recorder->next_heartbeat_us = recorder->start_time_us +
+		(gint64) config->watchdog_heartbeat_interval_ms * 1000;
+	recorder->n_heartbeats = 0;
 
-	if (topic == TOPIC_GAZE &&
-	    strncmp (key_str->ptr, "base_data", key_str->size) == 0)
+	if (config->watchdog_endpoint[0] == '\0')
 	{
-		msgpack_object_array *array;
-		msgpack_object *element;
+		recorder->watchdog_publisher = NULL;
+		return;
+	}
 
-		if (value->type != MSGPACK_OBJECT_ARRAY)
-		{
-			g_warning ("msgpack: expected an array for the base_data value, "
-				   "got type=%d instead.",
-				   value->type);
-			return FALSE;
-		}
+	recorder->watchdog_publisher = zmq_socket (recorder->context, ZMQ_PUB);
 
-		array = &value->via.array;
+	if (zmq_setsockopt (recorder->watchdog_publisher, ZMQ_LINGER, &linger_ms, sizeof (int)) != 0 ||
+	    zmq_setsockopt (recorder->watchdog_publisher, ZMQ_SNDHWM, &hwm, sizeof (int)) != 0)
+	{
+		g_error ("Error when setting ZeroMQ socket option for the watchdog: %s",
+			 g_strerror (errno));
+	}
 
-		if (array->size == 0)
-		{
-			g_warning ("msgpack: expected 1 element in the base_data array, "
-				   "got 0 elements instead.");
-			return FALSE;
-		}
+	if (config->replier_curve_secret_key_file[0] != '\0')
+	{
+		char public_key[CURVE_KEY_SIZE];
+		GError *error = NULL;
 
-		if (array->size > 1)
+		if (!curve_setup_server (recorder->watchdog_publisher,
+					 config->replier_curve_secret_key_file,
+					 public_key,
+					 &error))
 		{
-			g_warning ("msgpack: expected 1 element in the base_data array, "
-				   "got %d elements instead. Only the first element "
-				   "will be taken into account.",
-				   array->size);
+			g_error ("Error when enabling CURVE on the watchdog: %s",
+				 error->message);
 		}
-
-		element = &array->ptr[0];
-		return extract_info_from_msgpack_map (data, element, TOPIC_PUPIL);
 	}
 
-	if (topic == TOPIC_PUPIL &&
-	    strncmp (key_str->ptr, "timestamp", key_str->size) == 0)
+	if (zmq_bind (recorder->watchdog_publisher, config->watchdog_endpoint) != 0)
 	{
-		if (value->type != MSGPACK_OBJECT_FLOAT)
-		{
-			g_warning ("msgpack: expected a float for the timestamp value, "
-				   "got type=%d instead.",
-				   value->type);
-			return FALSE;
-		}
-
-		data->timestamp = value->via.f64;
-		return TRUE;
+		g_error ("Error when creating ZeroMQ socket at \"%s\": %s.",
+			 config->watchdog_endpoint,
+			 g_strerror (errno));
 	}
 
-	if (topic == TOPIC_PUPIL &&
-	    strncmp (key_str->ptr, "diameter", key_str->size) == 0)
-	{
-		if (value->type != MSGPACK_OBJECT_FLOAT)
-		{
-			g_warning ("msgpack: expected a float for the diameter value, "
-				   "got type=%d instead.",
-				   value->type);
-			return FALSE;
-		}
+	g_print ("Watchdog publisher: %s\n", config->watchdog_endpoint);
+}
 
-		data->pupil_diameter = value->via.f64;
-		return TRUE;
-	}
+/* Returns: %FALSE if SIGINT or SIGTERM was received during the
+ * initialization (e.g. while a big store is prefaulted), which then stops
+ * after the current source. recorder_finalize() must be called in both
+ * cases.
+ */
+static gboolean
+recorder_init (Recorder *recorder,
+	       Config   *config)
+{
+	guint i;
 
-	if (strncmp (key_str->ptr, "confidence", key_str->size) == 0)
-	{
-		if (value->type != MSGPACK_OBJECT_FLOAT)
-		{
-			g_warning ("msgpack: expected a float for the confidence value, "
-				   "got type=%d instead.",
-				   value->type);
-			return FALSE;
-		}
+	g_assert (recorder->context == NULL);
+	recorder->config = config;
+	recorder->context = zmq_ctx_new ();
 
-		switch (topic)
-		{
-			case TOPIC_PUPIL:
-				data->pupil_confidence = value->via.f64;
-				return TRUE;
-
-			case TOPIC_GAZE:
-				data->gaze_confidence = value->via.f64;
-				return TRUE;
-
-			case TOPIC_OTHER:
-			default:
-				g_warn_if_reached ();
-				break;
-		}
+	/* Bind the replier first, so that clients can connect and ask the
+	 * status while Pupil Capture is starting.
+	 */
+	init_replier (recorder);
 
-		return FALSE;
-	}
+	recorder->sources = g_ptr_array_new ();
+
+	add_source (recorder,
+		    config->pupil_name,
+		    config->pupil_remote_address,
+		    config->subscriber_host,
+		    config->subscription);
 
-	if (strncmp (key_str->ptr, "norm_pos", key_str->size) == 0)
+	for (i = 0; i < config->sources->len; i++)
 	{
-		msgpack_object_array *array;
-		msgpack_object *first_element;
-		msgpack_object *second_element;
+		const SourceConfig *source_config = g_ptr_array_index (config->sources, i);
 
-		if (value->type != MSGPACK_OBJECT_ARRAY)
+		if (quit_requested)
 		{
-			g_warning ("msgpack: expected an array for the norm_pos value, "
-				   "got type=%d instead.",
-				   value->type);
 			return FALSE;
 		}
 
-		array = &value->via.array;
+		add_source (recorder,
+			    source_config->name,
+			    source_config->remote_address,
+			    source_config->subscriber_host,
+			    source_config->subscription);
+	}
 
-		if (array->size != 2)
-		{
-			g_warning ("msgpack: expected 2 elements in the norm_pos array, "
-				   "got %d elements instead.",
-				   array->size);
-			return FALSE;
-		}
+	jitter_stats_reset (&recorder->wakeup_jitter);
+	reset_filter_cost (recorder);
+	init_watchdog (recorder);
 
-		first_element = &array->ptr[0];
-		second_element = &array->ptr[1];
+	if (config->shm_name[0] != '\0')
+	{
+		GError *error = NULL;
 
-		if (first_element->type != MSGPACK_OBJECT_FLOAT ||
-		    second_element->type != MSGPACK_OBJECT_FLOAT)
+		recorder->shm_ring = shm_ring_new (config->shm_name, config->shm_n_slots, &error);
+		if (recorder->shm_ring == NULL)
 		{
-			g_warning ("msgpack: expected float elements in the norm_pos array, "
-				   "got types %d and %d instead.",
-				   first_element->type,
-				   second_element->type);
-			return FALSE;
+			g_warning ("%s", error->message);
+			g_error_free (error);
 		}
+	}
 
-		switch (topic)
-		{
-			case TOPIC_PUPIL:
-				data->pupil_norm_pos_x = first_element->via.f64;
-				data->pupil_norm_pos_y = second_element->via.f64;
-				return TRUE;
-
-			case TOPIC_GAZE:
-				data->gaze_norm_pos_x = first_element->via.f64;
-				data->gaze_norm_pos_y = second_element->via.f64;
-				return TRUE;
-
-			case TOPIC_OTHER:
-			default:
-				g_warn_if_reached ();
-				break;
-		}
+	recorder->next_trial_id = 1;
+
+	recorder->timer = NULL;
+	recorder->recording = FALSE;
+	recorder->in_block = FALSE;
 
+	if (quit_requested)
+	{
 		return FALSE;
 	}
 
-	return FALSE;
+	g_print ("Initialized successfully, %u Pupil source(s).\n\n",
+		 recorder->sources->len);
+	return TRUE;
 }
 
-static gboolean
-extract_info_from_msgpack_map (Data           *data,
-			       msgpack_object *obj,
-			       Topic           topic)
+static void
+close_source_sockets (PupilSource *source)
+{
+	if (source->subscriber != NULL)
+	{
+		zmq_close (source->subscriber);
+		source->subscriber = NULL;
+	}
+
+	g_free (source->sub_port);
+	source->sub_port = NULL;
+
+	zmq_close (source->pupil_remote);
+	source->pupil_remote = NULL;
+
+	zmq_close (source->pupil_probe);
+	source->pupil_probe = NULL;
+}
+
+static void
+free_source (PupilSource *source)
+{
+	/* Waits for the end of the export, if any. */
+	exporter_free (source->exporter);
+	sample_store_free (source->store);
+	pupil_decoder_free (source->decoder);
+	g_array_free (source->batch, TRUE);
+	gaze_filter_free (source->gaze_filter);
+	g_free (source->frame_age_name);
+	g_free (source);
+}
+
+static void
+recorder_finalize (Recorder *recorder)
 {
-	msgpack_object_map *map;
-	uint32_t kv_num;
-	gboolean something_extracted = FALSE;
+	guint source_num;
 
-	if (obj->type != MSGPACK_OBJECT_MAP)
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
 	{
-		g_warning ("msgpack: expected a map, got type=%d instead.",
-			   obj->type);
-		return FALSE;
+		close_source_sockets (get_source (recorder, source_num));
 	}
 
-	map = &obj->via.map;
+	zmq_close (recorder->replier);
+	recorder->replier = NULL;
 
-	for (kv_num = 0; kv_num < map->size; kv_num++)
+	if (recorder->watchdog_publisher != NULL)
 	{
-		msgpack_object_kv *key_value;
+		zmq_close (recorder->watchdog_publisher);
+		recorder->watchdog_publisher = NULL;
+	}
 
-		key_value = &map->ptr[kv_num];
+	zmq_ctx_destroy (recorder->context);
+	recorder->context = NULL;
 
-		if (extract_info_from_msgpack_key_value (data, key_value, topic))
-		{
-			something_extracted = TRUE;
-		}
+	/* Its thread has stopped with the context. */
+	curve_authenticator_free (recorder->authenticator);
+	recorder->authenticator = NULL;
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		free_source (get_source (recorder, source_num));
 	}
 
-	return something_extracted;
-}
+	g_ptr_array_free (recorder->sources, TRUE);
+	recorder->sources = NULL;
 
-static void
-extract_info_from_msgpack_root_object (Recorder       *recorder,
-				       msgpack_object *obj)
-{
-	Data *data;
-	gboolean something_extracted;
-
-	data = data_new ();
-
-	something_extracted = extract_info_from_msgpack_map (data, obj, TOPIC_GAZE);
-
-	if (something_extracted)
-	{
-		g_print ("%s"
-			 "timestamp=%.2lf, "
-			 "diameter=%.2lf, "
-			 "pupil_confidence=%.2lf, "
-			 "pupil_x=%.2lf, "
-			 "pupil_y=%.2lf, "
-			 "gaze_confidence=%.2lf, "
-			 "gaze_x=%.2lf, "
-			 "gaze_y=%.2lf\n",
-			 recorder->recording ? "[Recording] " : "",
-			 data->timestamp,
-			 data->pupil_diameter,
-			 data->pupil_confidence,
-			 data->pupil_norm_pos_x,
-			 data->pupil_norm_pos_y,
-			 data->gaze_confidence,
-			 data->gaze_norm_pos_x,
-			 data->gaze_norm_pos_y);
+	shm_ring_free (recorder->shm_ring);
+	recorder->shm_ring = NULL;
 
-		if (recorder->recording)
-		{
-			g_queue_push_tail (recorder->data_queue, data);
-			data = NULL;
-		}
+	if (recorder->timer != NULL)
+	{
+		g_timer_destroy (recorder->timer);
+		recorder->timer = NULL;
 	}
+}
 
-	g_free (data);
+static void
+print_sample (Recorder    *recorder,
+	      PupilSource *source,
+	      const Data  *data)
+{
+	g_print ("%s%s%s"
+		 "timestamp=%.2lf, "
+		 "diameter=%.2lf, "
+		 "pupil_confidence=%.2lf, "
+		 "pupil_x=%.2lf, "
+		 "pupil_y=%.2lf, "
+		 "gaze_confidence=%.2lf, "
+		 "gaze_x=%.2lf, "
+		 "gaze_y=%.2lf\n",
+		 recorder->recording ? "[Recording] " : "",
+		 recorder->sources->len > 1 ? source->name : "",
+		 recorder->sources->len > 1 ? ": " : "",
+		 data->timestamp,
+		 data->pupil_diameter,
+		 data->pupil_confidence,
+		 data->pupil_norm_pos_x,
+		 data->pupil_norm_pos_y,
+		 data->gaze_confidence,
+		 data->gaze_norm_pos_x,
+		 data->gaze_norm_pos_y);
 }
 
+/* Keeps the liveness, the frame rate and the clock sync up-to-date, for
+ * every gaze frame, even those that are not decoded.
+ */
 static void
-read_msgpack_data (Recorder *recorder)
+track_frame (Recorder    *recorder,
+	     PupilSource *source,
+	     double       timestamp)
 {
-	zmq_msg_t zeromq_msg;
-	int n_bytes;
-	int ok;
-	void *raw_data;
-	msgpack_unpacker *unpacker;
-	msgpack_unpacked unpacked;
-	gboolean unpacked_is_init = FALSE;
-	msgpack_unpack_return unpack_ret;
-	msgpack_object obj;
+	gint64 now_us;
 
-	ok = zmq_msg_init (&zeromq_msg);
-	g_return_if_fail (ok == 0);
+	now_us = g_get_monotonic_time ();
 
-	n_bytes = zmq_msg_recv (&zeromq_msg, recorder->subscriber, 0);
-	if (n_bytes <= 0)
+	source->n_frames++;
+	source->last_frame_time_us = now_us;
+	source->last_frame_timestamp = timestamp;
+
+	/* On Pupil Time in a window of at least one second, so that it
+	 * doesn't depend on the delivery jitter.
+	 */
+	if (source->rate_window_n_frames == 0 ||
+	    timestamp < source->rate_window_start)
 	{
-		goto out;
+		source->rate_window_start = timestamp;
+		source->rate_window_n_frames = 0;
 	}
-
-	raw_data = zmq_msg_data (&zeromq_msg);
-
-	unpacker = msgpack_unpacker_new (1024);
-	if (unpacker == NULL)
+	else if (timestamp - source->rate_window_start >= 1.0)
 	{
-		goto out;
+		source->frame_rate = source->rate_window_n_frames /
+			(timestamp - source->rate_window_start);
+		source->rate_window_start = timestamp;
+		source->rate_window_n_frames = 0;
 	}
 
-	if (msgpack_unpacker_buffer_capacity (unpacker) < n_bytes)
-	{
-		bool result;
+	source->rate_window_n_frames++;
 
-		result = msgpack_unpacker_reserve_buffer (unpacker, n_bytes);
-		if (!result)
-		{
-			g_warning ("msgpack: memory allocation error.");
-			goto out;
-		}
+	if (load_monitor_add_sample (&source->load, timestamp, now_us / 1e6))
+	{
+		g_print ("[%s] Load mode: %s (lag of %.1f ms).\n",
+			 source->name,
+			 load_mode_to_string (source->load.mode),
+			 source->load.lag * 1000.0);
+
+		pupil_decoder_set_debug (source->decoder,
+					 recorder->config->debug &&
+					 source->load.mode == LOAD_MODE_NORMAL);
 	}
+}
 
-	memcpy (msgpack_unpacker_buffer (unpacker), raw_data, n_bytes);
-	msgpack_unpacker_buffer_consumed (unpacker, n_bytes);
-
-	msgpack_unpacked_init (&unpacked);
-	unpacked_is_init = TRUE;
+static void
+add_sample (Recorder    *recorder,
+	    PupilSource *source,
+	    const Data  *data)
+{
+	track_frame (recorder, source, data->timestamp);
 
-	unpack_ret = msgpack_unpacker_next (unpacker, &unpacked);
-	if (unpack_ret != MSGPACK_UNPACK_SUCCESS)
+	/* Printing each sample is a write to stdout per frame. */
+	if (source->load.mode == LOAD_MODE_NORMAL)
 	{
-		g_warning ("msgpack: unpacking failed. The Pupil message "
-			   "received was apparently not packed with msgpack.");
-		goto out;
+		print_sample (recorder, source, data);
 	}
 
-	obj = unpacked.data;
-
-	if (DEBUG)
+	if (recorder->recording)
 	{
-		g_print ("msgpack data: ");
-		msgpack_object_print (stdout, obj);
-		g_print ("\n");
+		g_array_append_vals (source->batch, data, 1);
 	}
+	else if (recorder->shm_ring != NULL &&
+		 source == get_source (recorder, 0))
+	{
+		/* The recorded samples are written by flush_batch(),
+		 * after the gaze filter.
+		 */
+		shm_ring_write (recorder->shm_ring, data, FALSE);
+	}
+}
+
+/* Receives the msgpack data of a gaze frame. If @decode is %FALSE, only its
+ * timestamp is read.
+ */
+static void
+read_msgpack_data (Recorder    *recorder,
+		   PupilSource *source,
+		   gboolean     decode)
+{
+	zmq_msg_t zeromq_msg;
+	int n_bytes;
+	int ok;
+	Data data;
+	double timestamp;
 
-	extract_info_from_msgpack_root_object (recorder, &obj);
+	ok = zmq_msg_init (&zeromq_msg);
+	g_return_if_fail (ok == 0);
 
-out:
-	if (unpacker != NULL)
+	n_bytes = zmq_msg_recv (&zeromq_msg, source->subscriber, 0);
+	if (n_bytes <= 0)
 	{
-		msgpack_unpacker_free (unpacker);
+		/* Nothing to read. */
 	}
-
-	if (unpacked_is_init)
+	else if (decode)
+	{
+		if (pupil_decoder_decode_gaze (source->decoder,
+					       zmq_msg_data (&zeromq_msg),
+					       n_bytes,
+					       &data) == PUPIL_DECODER_RESULT_EXTRACTED)
+		{
+			add_sample (recorder, source, &data);
+		}
+	}
+	else if (pupil_decoder_peek_timestamp (zmq_msg_data (&zeromq_msg),
+					       n_bytes,
+					       &timestamp))
 	{
-		msgpack_unpacked_destroy (&unpacked);
+		track_frame (recorder, source, timestamp);
 	}
 
 	ok = zmq_msg_close (&zeromq_msg);
 	g_return_if_fail (ok == 0);
 }
 
-static Topic
-determine_topic (const char *topic_str)
+/* While not recording, only one frame out of idle.decode-interval is
+ * decoded, to print it. The shared memory ring needs all the frames of the
+ * first source. The decimate mode divides the number of decoded frames by
+ * load.decimation, see load_monitor_get_decode_interval(), so the shared
+ * memory then misses frames. The recorded frames are always decoded.
+ */
+static gboolean
+should_decode_frame (Recorder    *recorder,
+		     PupilSource *source)
 {
-	if (topic_str == NULL)
+	int interval;
+
+	if (recorder->recording)
 	{
-		return TOPIC_OTHER;
+		return TRUE;
 	}
 
-	if (g_str_has_prefix (topic_str, "gaze"))
+	source->n_idle_frames++;
+
+	if (recorder->shm_ring != NULL &&
+	    source == get_source (recorder, 0))
 	{
-		return TOPIC_GAZE;
+		interval = 1;
 	}
+	else
+	{
+		interval = recorder->config->idle_decode_interval;
+	}
+
+	interval = load_monitor_get_decode_interval (&source->load,
+						     interval,
+						     recorder->config->load_decimation);
 
-	if (g_str_has_prefix (topic_str, "pupil"))
+	if (source->n_idle_frames % interval == 0)
 	{
-		return TOPIC_PUPIL;
+		return TRUE;
 	}
 
-	return TOPIC_OTHER;
+	source->n_undecoded_frames++;
+	return FALSE;
 }
 
-/* Reads a Pupil message from the subscriber.
+/* Reads a Pupil message from the subscriber of @source.
  * It must be a multi-part message, with exactly two parts: the topic and the
  * msgpack data.
  * Returns: TRUE if a message has been read, FALSE if there were no messages.
  */
 static gboolean
-read_pupil_message (Recorder *recorder)
+read_pupil_message (Recorder    *recorder,
+		    PupilSource *source)
 {
 	char *topic_str;
 	Topic topic;
@@ -757,21 +1247,22 @@ read_pupil_message (Recorder *recorder)
 	size_t more_size = sizeof (more);
 	int ok;
 
-	topic_str = receive_next_message (recorder->subscriber);
+	topic_str = receive_next_message (source->subscriber);
 	if (topic_str == NULL)
 	{
 		/* Timeout, no messages. */
 		return FALSE;
 	}
 
-	if (DEBUG)
+	if (recorder->config->debug &&
+	    source->load.mode == LOAD_MODE_NORMAL)
 	{
-		g_print ("Topic: %s\n", topic_str);
+		g_print ("[%s] Topic: %s\n", source->name, topic_str);
 	}
 
-	topic = determine_topic (topic_str);
+	topic = pupil_decoder_determine_topic (topic_str);
 
-	if (topic != TOPIC_GAZE && !DEBUG)
+	if (topic != TOPIC_GAZE && !recorder->config->debug)
 	{
 		g_warning ("I'm not supposed to receive other topics than with the 'gaze' prefix. "
 			   "Topic received: '%s'",
@@ -782,7 +1273,7 @@ read_pupil_message (Recorder *recorder)
 	topic_str = NULL;
 
 	/* Determine if more message parts are to follow. */
-	ok = zmq_getsockopt (recorder->subscriber, ZMQ_RCVMORE, &more, &more_size);
+	ok = zmq_getsockopt (source->subscriber, ZMQ_RCVMORE, &more, &more_size);
 	g_return_val_if_fail (ok == 0, FALSE);
 	if (!more)
 	{
@@ -792,20 +1283,20 @@ read_pupil_message (Recorder *recorder)
 
 	if (topic == TOPIC_GAZE)
 	{
-		read_msgpack_data (recorder);
+		read_msgpack_data (recorder, source, should_decode_frame (recorder, source));
 	}
 	else
 	{
 		char *msg;
 
-		msg = receive_next_message (recorder->subscriber);
+		msg = receive_next_message (source->subscriber);
 		g_free (msg);
 	}
 
 	/* Determine if more message parts are to follow.
 	 * There must be exactly two parts. If there are more, it's an error.
 	 */
-	ok = zmq_getsockopt (recorder->subscriber, ZMQ_RCVMORE, &more, &more_size);
+	ok = zmq_getsockopt (source->subscriber, ZMQ_RCVMORE, &more, &more_size);
 	g_return_val_if_fail (ok == 0, FALSE);
 	if (more)
 	{
@@ -818,10 +1309,10 @@ read_pupil_message (Recorder *recorder)
 		{
 			char *msg;
 
-			msg = receive_next_message (recorder->subscriber);
+			msg = receive_next_message (source->subscriber);
 			g_free (msg);
 
-			ok = zmq_getsockopt (recorder->subscriber, ZMQ_RCVMORE, &more, &more_size);
+			ok = zmq_getsockopt (source->subscriber, ZMQ_RCVMORE, &more, &more_size);
 			g_return_val_if_fail (ok == 0, FALSE);
 		}
 	}
@@ -829,177 +1320,1631 @@ read_pupil_message (Recorder *recorder)
 	return TRUE;
 }
 
+/* The filter costs tens of nanoseconds per sample, so the microseconds of
+ * g_get_monotonic_time() are not enough.
+ */
+static gint64
+get_monotonic_time_ns (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (gint64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Runs the gaze filter of @source on @samples, in place, and measures its
+ * cost.
+ */
 static void
-read_all_pupil_messages (Recorder *recorder)
+run_gaze_filter (Recorder    *recorder,
+		 PupilSource *source,
+		 Data        *samples,
+		 guint        n_samples)
 {
-	while (read_pupil_message (recorder))
-		;
+	gint64 begin_ns;
+	gint64 cost_ns;
+
+	begin_ns = get_monotonic_time_ns ();
+	gaze_filter_process (source->gaze_filter, samples, n_samples);
+	cost_ns = get_monotonic_time_ns () - begin_ns;
+
+	jitter_stats_add (&recorder->filter_batch_cost, (cost_ns + 500) / 1000);
+	recorder->filter_n_samples += n_samples;
+	recorder->filter_total_ns += cost_ns;
+
+	if (cost_ns > (gint64) recorder->config->filter_cost_budget_ns * n_samples)
+	{
+		recorder->filter_n_over_budget++;
+
+		if (recorder->config->debug)
+		{
+			g_warning ("Gaze filter over budget: %" G_GINT64_FORMAT " ns for %u samples.",
+				   cost_ns,
+				   n_samples);
+		}
+	}
 }
 
-static char *
-recorder_start (Recorder *recorder)
+/* Runs the gaze filter on the samples stored during the defer mode, and
+ * updates them in the store. The clients that have already received them
+ * got -1 for the filtered values, and so did the shared memory.
+ */
+static void
+process_deferred_samples (Recorder    *recorder,
+			  PupilSource *source)
 {
-	const char *request_pupil_remote;
-	char *reply_pupil_remote;
-	char *reply;
+	guint n_samples = source->n_deferred;
+	guint begin;
+	Data *samples;
 
-	if (recorder->recording)
+	if (n_samples == 0 || source->gaze_filter == NULL)
 	{
-		g_warning ("Already recording.");
-		reply = g_strdup ("already recording");
-		return reply;
+		source->n_deferred = 0;
+		return;
 	}
 
-	g_print ("Send request to start recording to the Pupil Remote plugin...\n");
-	recorder->recording = TRUE;
+	begin = sample_store_get_length (source->store) - n_samples;
+
+	samples = g_new (Data, n_samples);
+	sample_store_copy (source->store, begin, n_samples, samples);
+	run_gaze_filter (recorder, source, samples, n_samples);
+	sample_store_update (source->store, begin, n_samples, samples);
+	g_free (samples);
 
-	request_pupil_remote = "R";
-	zmq_send (recorder->pupil_remote,
-		  request_pupil_remote,
-		  strlen (request_pupil_remote),
-		  0);
+	source->n_deferred = 0;
+}
+
+/* Runs the gaze filter on the batch of @source, measuring its cost, or defers
+ * it in the defer mode. Then adds the batch to the store and to the shared
+ * memory.
+ */
+static void
+flush_batch (Recorder    *recorder,
+	     PupilSource *source)
+{
+	Data *samples = (Data *) source->batch->data;
+	guint n_samples = source->batch->len;
+	guint i;
 
-	reply_pupil_remote = receive_next_message (recorder->pupil_remote);
-	if (reply_pupil_remote == NULL)
+	if (n_samples == 0)
 	{
-		g_error ("Timeout. Impossible to communicate with the Pupil Remote plugin.");
+		return;
 	}
 
-	g_print ("Pupil Remote reply: %s\n", reply_pupil_remote);
-	g_free (reply_pupil_remote);
+	if (source->gaze_filter != NULL)
+	{
+		/* The deferred samples are bounded, so that processing them
+		 * doesn't stall the main loop when the load decreases.
+		 */
+		if (source->load.mode >= LOAD_MODE_DEFER &&
+		    source->n_deferred + n_samples <= SAMPLE_STORE_CHUNK_SIZE)
+		{
+			source->n_deferred += n_samples;
+		}
+		else
+		{
+			/* The filter is recursive, the samples must be
+			 * processed in order.
+			 */
+			process_deferred_samples (recorder, source);
+			run_gaze_filter (recorder, source, samples, n_samples);
+		}
+	}
 
-	if (recorder->timer == NULL)
+	for (i = 0; i < n_samples; i++)
 	{
-		recorder->timer = g_timer_new ();
+		sample_store_append (source->store, &samples[i]);
 	}
-	else
+
+	if (recorder->shm_ring != NULL &&
+	    source == get_source (recorder, 0))
 	{
-		g_timer_start (recorder->timer);
+		for (i = 0; i < n_samples; i++)
+		{
+			shm_ring_write (recorder->shm_ring, &samples[i], TRUE);
+		}
 	}
 
-	reply = g_strdup ("ack");
-	return reply;
+	g_array_set_size (source->batch, 0);
 }
 
-static char *
-recorder_stop (Recorder *recorder)
+/* Reads the Pupil messages waiting in the queue of @source, at most
+ * load.max-messages-per-iteration so that the requests and the other sources
+ * are not delayed when there is a backlog.
+ * Returns: whether messages may be left in the queue.
+ */
+static gboolean
+read_source_messages (Recorder    *recorder,
+		      PupilSource *source)
 {
-	const char *request_pupil_remote;
-	char *reply_pupil_remote;
-	char *reply;
+	guint max_messages = recorder->config->load_max_messages_per_iteration;
+	guint n_messages = 0;
 
-	if (!recorder->recording)
+	if (source->subscriber == NULL)
 	{
-		g_warning ("Already stopped.");
-		reply = g_strdup ("already stopped");
-		return reply;
+		return FALSE;
 	}
 
-	g_print ("Send request to stop recording to the Pupil Remote plugin...\n");
-
-	if (recorder->timer != NULL)
+	while (n_messages < max_messages &&
+	       read_pupil_message (recorder, source))
 	{
-		g_timer_stop (recorder->timer);
-		reply = g_strdup_printf ("%lf", g_timer_elapsed (recorder->timer, NULL));
+		n_messages++;
 	}
-	else
+
+	if (n_messages > 0)
 	{
-		reply = g_strdup ("no timer");
-	}
+		source->last_message_time_us = g_get_monotonic_time ();
 
-	request_pupil_remote = "r";
-	zmq_send (recorder->pupil_remote,
-		  request_pupil_remote,
-		  strlen (request_pupil_remote),
-		  0);
+		if (!source->pupil_ready)
+		{
+			g_print ("[%s] Receiving Pupil messages, ready.\n", source->name);
+			source->pupil_ready = TRUE;
 
-	reply_pupil_remote = receive_next_message (recorder->pupil_remote);
-	if (reply_pupil_remote == NULL)
-	{
-		g_error ("Timeout. Impossible to communicate with the Pupil Remote plugin.");
+			/* Pupil Capture may have been restarted, with another
+			 * clock.
+			 */
+			load_monitor_reset (&source->load);
+		}
 	}
 
-	g_print ("Pupil Remote reply: %s\n", reply_pupil_remote);
-	g_free (reply_pupil_remote);
+	flush_batch (recorder, source);
 
-	recorder->recording = FALSE;
+	if (source->load.mode < LOAD_MODE_DEFER)
+	{
+		process_deferred_samples (recorder, source);
+	}
 
-	return reply;
+	return n_messages == max_messages;
 }
 
-static char *
-receive_data (Recorder *recorder)
+/* The sources are served in turn by the main loop.
+ * Returns: whether messages may be left in a queue.
+ */
+static gboolean
+read_all_pupil_messages (Recorder *recorder)
 {
-	GString *str;
-	GList *l;
+	gboolean backlog = FALSE;
+	guint source_num;
 
-	if (g_queue_is_empty (recorder->data_queue))
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
 	{
-		return g_strdup ("no data");
-	}
-
-	str = g_string_new (NULL);
-
-	for (l = recorder->data_queue->head; l != NULL; l = l->next)
-	{
-		Data *data = l->data;
-
-		g_string_append_printf (str,
-					"timestamp:%lf\n"
-					"pupil_diameter:%lf\n"
-					"pupil_x:%lf\n"
-					"pupil_y:%lf\n"
-					"pupil_confidence:%lf\n"
-					"gaze_x:%lf\n"
-					"gaze_y:%lf\n"
-					"gaze_confidence:%lf\n",
-					data->timestamp,
-					data->pupil_diameter,
-					data->pupil_norm_pos_x,
-					data->pupil_norm_pos_y,
-					data->pupil_confidence,
-					data->gaze_norm_pos_x,
-					data->gaze_norm_pos_y,
-					data->gaze_confidence);
+		if (read_source_messages (recorder, get_source (recorder, source_num)))
+		{
+			backlog = TRUE;
+		}
 	}
 
-	return g_string_free (str, FALSE);
+	return backlog;
 }
 
 static void
-read_request (Recorder *recorder)
+maintain_pupil_connections (Recorder *recorder)
 {
-	char *request;
-	char *reply = NULL;
+	guint source_num;
 
-	request = receive_next_message (recorder->replier);
-	if (request == NULL)
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
 	{
-		return;
+		maintain_pupil_connection (recorder, get_source (recorder, source_num));
 	}
+}
+
+/* Returns: whether all the sources receive Pupil messages. */
+static gboolean
+all_sources_ready (Recorder *recorder)
+{
+	guint source_num;
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		if (!get_source (recorder, source_num)->pupil_ready)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+parse_int64 (const char *str,
+	     gint64     *value)
+{
+	char *end = NULL;
+
+	if (str == NULL || str[0] == '\0')
+	{
+		return FALSE;
+	}
+
+	*value = g_ascii_strtoll (str, &end, 10);
+	return *end == '\0';
+}
+
+static gboolean
+parse_double (const char *str,
+	      double     *value)
+{
+	char *end = NULL;
+
+	if (str == NULL || str[0] == '\0')
+	{
+		return FALSE;
+	}
+
+	*value = g_ascii_strtod (str, &end);
+	return *end == '\0';
+}
+
+/* Starts (@start is %TRUE) or stops the recording of Pupil Capture, with the
+ * R or r request to the Pupil Remote of each source. If Pupil Remote doesn't
+ * reply, external-recorder records anyway. Don't wait for the timeout if
+ * Pupil Remote is known to be down.
+ *
+ * The r request is sent to the sources that have acknowledged the R request,
+ * even if their gaze data has stopped meanwhile, so that Pupil Capture
+ * doesn't keep recording.
+ */
+static void
+pupil_capture_record (Recorder *recorder,
+		      gboolean  start)
+{
+	guint source_num;
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+		char *reply_pupil_remote;
+
+		if (start && source->pupil_remote_down)
+		{
+			g_warning ("[%s] Pupil Remote is not reachable, recording without it.",
+				   source->name);
+			continue;
+		}
+
+		if (!start && !source->pupil_recording)
+		{
+			continue;
+		}
+
+		if (start && !source->pupil_ready)
+		{
+			g_warning ("[%s] No Pupil message received yet, the recording may "
+				   "miss samples.",
+				   source->name);
+		}
+
+		g_print ("[%s] Send request to %s recording to the Pupil Remote plugin...\n",
+			 source->name,
+			 start ? "start" : "stop");
+
+		reply_pupil_remote = pupil_remote_request (recorder, source, start ? "R" : "r");
+		if (reply_pupil_remote != NULL)
+		{
+			g_print ("[%s] Pupil Remote reply: %s\n", source->name, reply_pupil_remote);
+			g_free (reply_pupil_remote);
+		}
+
+		/* Without reply to r, Pupil Remote is down and the recording
+		 * is lost anyway, so don't send r again.
+		 */
+		source->pupil_recording = start && reply_pupil_remote != NULL;
+	}
+}
+
+/* @trial_id_str: the trial ID given by the client, or %NULL to use the
+ * previous trial ID + 1.
+ *
+ * The trial is opened in all the sources at once: no Pupil message is read
+ * in between, so the trials of the sources begin at the same instant.
+ *
+ * In a block (see recorder_start_block()), only the trial is opened: Pupil
+ * Capture is already recording.
+ */
+static char *
+recorder_start (Recorder   *recorder,
+		const char *trial_id_str)
+{
+	char *reply;
+	gint64 trial_id = recorder->next_trial_id;
+	guint source_num;
+
+	if (recorder->recording)
+	{
+		g_warning ("Already recording.");
+		reply = g_strdup ("already recording");
+		return reply;
+	}
+
+	if (trial_id_str != NULL &&
+	    !parse_int64 (trial_id_str, &trial_id))
+	{
+		g_warning ("Invalid trial ID: %s", trial_id_str);
+		reply = g_strdup ("invalid trial ID");
+		return reply;
+	}
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+
+		sample_store_begin_trial (source->store, trial_id);
+
+		if (source->gaze_filter != NULL)
+		{
+			gaze_filter_reset (source->gaze_filter);
+		}
+	}
+
+	recorder->next_trial_id = trial_id + 1;
+	recorder->recording = TRUE;
+
+	if (!recorder->in_block)
+	{
+		pupil_capture_record (recorder, TRUE);
+	}
+
+	if (recorder->timer == NULL)
+	{
+		recorder->timer = g_timer_new ();
+	}
+	else
+	{
+		g_timer_start (recorder->timer);
+	}
+
+	reply = g_strdup ("ack");
+	return reply;
+}
+
+/* In a block, only the trial is closed. */
+static char *
+recorder_stop (Recorder *recorder)
+{
+	char *reply;
+	guint source_num;
+
+	if (!recorder->recording)
+	{
+		g_warning ("Already stopped.");
+		reply = g_strdup ("already stopped");
+		return reply;
+	}
+
+	if (recorder->timer != NULL)
+	{
+		g_timer_stop (recorder->timer);
+		reply = g_strdup_printf ("%lf", g_timer_elapsed (recorder->timer, NULL));
+	}
+	else
+	{
+		reply = g_strdup ("no timer");
+	}
+
+	if (!recorder->in_block)
+	{
+		pupil_capture_record (recorder, FALSE);
+	}
+
+	recorder->recording = FALSE;
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+
+		sample_store_end_trial (source->store);
+
+		/* The events must be complete after a stop. */
+		process_deferred_samples (recorder, source);
+
+		if (source->gaze_filter != NULL)
+		{
+			gaze_filter_flush (source->gaze_filter);
+		}
+	}
+
+	return reply;
+}
+
+/* Segment mode: Pupil Capture records continuously during a block of trials,
+ * and the start and stop requests only open and close trials in
+ * external-recorder, which is cheap. Without a block, each trial starts and
+ * stops a Pupil Capture recording, with its disk I/O and the restart of the
+ * video encoders.
+ */
+static char *
+recorder_start_block (Recorder *recorder)
+{
+	if (recorder->in_block)
+	{
+		g_warning ("Already in a block.");
+		return g_strdup ("already in block");
+	}
+
+	if (recorder->recording)
+	{
+		g_warning ("A block can't be started during a trial.");
+		return g_strdup ("already recording");
+	}
+
+	pupil_capture_record (recorder, TRUE);
+	recorder->in_block = TRUE;
+
+	return g_strdup ("ack");
+}
+
+/* Stops the current trial, if any, and the Pupil Capture recording. */
+static char *
+recorder_stop_block (Recorder *recorder)
+{
+	if (!recorder->in_block)
+	{
+		g_warning ("Not in a block.");
+		return g_strdup ("not in block");
+	}
+
+	if (recorder->recording)
+	{
+		g_free (recorder_stop (recorder));
+	}
+
+	pupil_capture_record (recorder, FALSE);
+	recorder->in_block = FALSE;
+
+	return g_strdup ("ack");
+}
+
+/* A time range [t0, t1], to select the samples of a range of indexes. */
+typedef struct _TimeRange TimeRange;
+struct _TimeRange
+{
+	double t0;
+	double t1;
+};
+
+/* Returns: whether @data is selected by @time_range, which can be %NULL to
+ * select all the samples.
+ */
+static gboolean
+is_in_time_range (const Data      *data,
+		  const TimeRange *time_range)
+{
+	return (time_range == NULL ||
+		sample_store_in_time_range (data, time_range->t0, time_range->t1));
+}
+
+/* Returns the samples [@begin, @end) of @store selected by @time_range, in
+ * the text format.
+ */
+static char *
+format_samples_text (SampleStore     *store,
+		     guint            begin,
+		     guint            end,
+		     const TimeRange *time_range)
+{
+	GString *str;
+	guint i;
+
+	if (begin >= end)
+	{
+		return g_strdup ("no data");
+	}
+
+	str = data_format_text_new (end - begin);
+
+	for (i = begin; i < end; i++)
+	{
+		const Data *data = sample_store_get (store, i);
+
+		if (is_in_time_range (data, time_range))
+		{
+			data_format_text_append (str, data);
+		}
+	}
+
+	if (str->len == 0)
+	{
+		g_string_free (str, TRUE);
+		return g_strdup ("no data");
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+/* Returns the samples [@begin, @end) of @store in the binary format, see
+ * data-binary.c. The binary format is returned even if there is no data, with
+ * zero samples. Returns "too many samples" if they don't fit in the format.
+ */
+static char *
+format_samples_binary (Recorder              *recorder,
+		       SampleStore           *store,
+		       guint                  begin,
+		       guint                  end,
+		       const TimeRange       *time_range,
+		       DataBinaryCompression  compression,
+		       gsize                 *size)
+{
+	DataBinaryEncoder *encoder;
+	GError *error = NULL;
+	guint n_samples;
+	guint i;
+
+	end = MAX (begin, end);
+	n_samples = end - begin;
+
+	/* The encoder needs the number of samples first. */
+	if (time_range != NULL)
+	{
+		n_samples = 0;
+
+		for (i = begin; i < end; i++)
+		{
+			if (is_in_time_range (sample_store_get (store, i), time_range))
+			{
+				n_samples++;
+			}
+		}
+	}
+
+	encoder = data_binary_encoder_new (n_samples, &error);
+	if (encoder == NULL)
+	{
+		g_warning ("%s", error->message);
+		g_error_free (error);
+		return g_strdup ("too many samples");
+	}
+
+	for (i = begin; i < end; i++)
+	{
+		const Data *data = sample_store_get (store, i);
+
+		if (is_in_time_range (data, time_range))
+		{
+			data_binary_encoder_append (encoder, data);
+		}
+	}
+
+	return data_binary_encoder_finish (encoder,
+					   compression,
+					   recorder->config->zstd_level,
+					   size);
+}
+
+/* Parses the format argument of receive_data and query. Without argument,
+ * the format is the one of the configuration (the text format by default).
+ */
+static gboolean
+parse_output_format_arg (Recorder     *recorder,
+			 const char   *arg,
+			 OutputFormat *format)
+{
+	if (arg == NULL)
+	{
+		*format = recorder->config->receive_data_format;
+		return TRUE;
+	}
+
+	if (g_str_equal (arg, "text"))
+	{
+		*format = OUTPUT_FORMAT_TEXT;
+		return TRUE;
+	}
+
+	if (g_str_equal (arg, "binary"))
+	{
+		*format = OUTPUT_FORMAT_BINARY;
+		return TRUE;
+	}
+
+	if (g_str_equal (arg, "zstd"))
+	{
+		*format = OUTPUT_FORMAT_ZSTD;
+		return TRUE;
+	}
+
+	g_warning ("Unknown format: %s", arg);
+	return FALSE;
+}
+
+/* Returns the samples [@begin, @end) of @store in @format, only those in
+ * @time_range if it is not %NULL. @size is set for the binary formats, it is
+ * left to 0 for the text format.
+ */
+static char *
+format_samples (Recorder        *recorder,
+		SampleStore     *store,
+		guint            begin,
+		guint            end,
+		const TimeRange *time_range,
+		OutputFormat     format,
+		gsize           *size)
+{
+	switch (format)
+	{
+		case OUTPUT_FORMAT_BINARY:
+			return format_samples_binary (recorder, store, begin, end, time_range,
+						      DATA_BINARY_COMPRESSION_NONE,
+						      size);
+
+		case OUTPUT_FORMAT_ZSTD:
+			return format_samples_binary (recorder, store, begin, end, time_range,
+						      DATA_BINARY_COMPRESSION_ZSTD,
+						      size);
+
+		case OUTPUT_FORMAT_TEXT:
+		default:
+			return format_samples_text (store, begin, end, time_range);
+	}
+}
+
+/* Unless store.keep-received is set, discards the samples already returned by
+ * receive_data, so that the memory stays bounded when the client never sends
+ * the clear request. The samples not yet processed by the gaze filter are
+ * kept, and nothing is discarded during an export, which reads the store in
+ * another thread. The gaze events already returned by the events request and
+ * ended before the first sample kept are discarded too.
+ */
+static void
+trim_store (Recorder    *recorder,
+	    PupilSource *source)
+{
+	guint limit;
+	guint first;
+	double first_timestamp;
+	guint n_events;
+
+	if (recorder->config->store_keep_received ||
+	    exporter_is_running (source->exporter))
+	{
+		return;
+	}
+
+	limit = MIN (source->receive_data_cursor,
+		     sample_store_get_length (source->store) - source->n_deferred);
+
+	sample_store_discard_before (source->store, limit);
+
+	first = sample_store_get_first (source->store);
+	if (source->gaze_filter == NULL ||
+	    first >= sample_store_get_length (source->store))
+	{
+		return;
+	}
+
+	first_timestamp = sample_store_get (source->store, first)->timestamp;
+
+	n_events = 0;
+	while (n_events < source->events_cursor &&
+	       gaze_filter_get_event (source->gaze_filter, n_events)->end < first_timestamp)
+	{
+		n_events++;
+	}
+
+	gaze_filter_discard_events (source->gaze_filter, n_events);
+	source->events_cursor -= n_events;
+}
+
+/* The query request, which doesn't consume the data:
+ * - "query time <t0> <t1> [format]": the samples with a Pupil timestamp
+ *   between t0 and t1, inclusive.
+ * - "query trial <id> [format]": the samples of a trial.
+ */
+static char *
+query (Recorder     *recorder,
+       PupilSource  *source,
+       char        **args,
+       gsize        *size)
+{
+	OutputFormat format;
+	TimeRange time_range;
+	const TimeRange *selection = NULL;
+	guint begin;
+	guint end;
+
+	if (g_strcmp0 (args[1], "time") == 0)
+	{
+		if (!parse_double (args[2], &time_range.t0) ||
+		    !parse_double (args[3], &time_range.t1) ||
+		    !parse_output_format_arg (recorder, args[4], &format))
+		{
+			return g_strdup ("invalid query");
+		}
+
+		begin = sample_store_lower_bound (source->store, time_range.t0);
+		end = sample_store_upper_bound (source->store, time_range.t1);
+		selection = &time_range;
+	}
+	else if (g_strcmp0 (args[1], "trial") == 0)
+	{
+		const SampleStoreTrial *trial;
+		gint64 id;
+
+		if (!parse_int64 (args[2], &id) ||
+		    !parse_output_format_arg (recorder, args[3], &format) ||
+		    (args[3] != NULL && args[4] != NULL))
+		{
+			return g_strdup ("invalid query");
+		}
+
+		trial = sample_store_find_trial (source->store, id);
+		if (trial == NULL)
+		{
+			return g_strdup ("unknown trial");
+		}
+
+		/* The beginning of the trial can have been discarded, see
+		 * trim_store().
+		 */
+		begin = MAX (trial->begin, sample_store_get_first (source->store));
+		end = MIN (trial->end, sample_store_get_length (source->store));
+	}
+	else
+	{
+		return g_strdup ("invalid query");
+	}
+
+	return format_samples (recorder, source->store, begin, end, selection, format, size);
+}
+
+/* "query_merged <t0> <t1>": the samples of all the sources between t0 and
+ * t1, inclusive, in the Pupil Time of the first source. The timestamps of the
+ * other sources are converted with the clock offsets measured by their load
+ * monitors, so the alignment is exact up to the difference between the
+ * minimum transport latencies of the sources.
+ *
+ * The reply is in the text format. Each source begins with a "source:<name>"
+ * line and a "clock_offset:<seconds>" line, the value added to its
+ * timestamps. If the offset is unknown ("clock_offset:unknown"), e.g. while
+ * the source is not connected, its samples are omitted.
+ */
+static char *
+query_merged (Recorder  *recorder,
+	      char     **args)
+{
+	const PupilSource *reference = get_source (recorder, 0);
+	double t0;
+	double t1;
+	GString *str;
+	guint source_num;
+
+	if (!parse_double (args[1], &t0) ||
+	    !parse_double (args[2], &t1) ||
+	    args[3] != NULL)
+	{
+		return g_strdup ("invalid query");
+	}
+
+	str = g_string_new (NULL);
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+		double shift = 0.0;
+		guint begin;
+		guint end;
+		guint i;
+
+		g_string_append_printf (str, "source:%s\n", source->name);
+
+		if (source != reference)
+		{
+			if (!source->load.has_baseline || !reference->load.has_baseline)
+			{
+				g_string_append (str, "clock_offset:unknown\n");
+				continue;
+			}
+
+			shift = source->load.baseline - reference->load.baseline;
+		}
+
+		g_string_append_printf (str, "clock_offset:%lf\n", shift);
+
+		begin = sample_store_lower_bound (source->store, t0 - shift);
+		end = sample_store_upper_bound (source->store, t1 - shift);
+
+		for (i = begin; i < end; i++)
+		{
+			Data data = *sample_store_get (source->store, i);
+
+			if (!sample_store_in_time_range (&data, t0 - shift, t1 - shift))
+			{
+				continue;
+			}
+
+			data.timestamp += shift;
+			data_format_text_append (str, &data);
+		}
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+/* Returns the events of the gaze filter not yet returned, in the same
+ * "key:value" text format as receive_data.
+ */
+static char *
+receive_events (PupilSource *source)
+{
+	GString *str;
+	guint n_events;
+	guint event_num;
+
+	if (source->gaze_filter == NULL)
+	{
+		return g_strdup ("filter disabled");
+	}
+
+	str = g_string_new (NULL);
+	n_events = gaze_filter_get_n_events (source->gaze_filter);
+
+	for (event_num = source->events_cursor; event_num < n_events; event_num++)
+	{
+		const GazeEvent *event;
+
+		event = gaze_filter_get_event (source->gaze_filter, event_num);
+
+		g_string_append_printf (str,
+					"type:%s\n"
+					"begin:%lf\n"
+					"end:%lf\n"
+					"x:%lf\n"
+					"y:%lf\n"
+					"peak_velocity:%lf\n",
+					gaze_class_to_string (event->type),
+					event->begin,
+					event->end,
+					event->x,
+					event->y,
+					event->peak_velocity);
+	}
+
+	source->events_cursor = n_events;
+
+	return g_string_free (str, FALSE);
+}
+
+/* Returns: the load mode and lag (see load_monitor_to_string()), followed by
+ * the number of frames received while not recording, how many of them have
+ * not been decoded, and the number of samples waiting for the gaze filter.
+ */
+static char *
+load_to_string (PupilSource *source)
+{
+	char *monitor_str;
+	char *str;
+
+	monitor_str = load_monitor_to_string (&source->load);
+	str = g_strdup_printf ("%s"
+			       "idle_frames=%" G_GUINT64_FORMAT "\n"
+			       "undecoded_frames=%" G_GUINT64_FORMAT "\n"
+			       "deferred_samples=%u\n",
+			       monitor_str,
+			       source->n_idle_frames,
+			       source->n_undecoded_frames,
+			       source->n_deferred);
+	g_free (monitor_str);
+
+	return str;
+}
+
+/* Returns: the state of the gaze stream, kept up-to-date even for the frames
+ * that are not decoded, as "key=value" lines. last_frame_age_ms is -1 if no
+ * frames have been received. clock_offset is the minimum of the local
+ * monotonic time minus Pupil Time, in seconds.
+ */
+static char *
+stream_to_string (PupilSource *source)
+{
+	double last_frame_age_ms = -1.0;
+	char clock_offset[G_ASCII_DTOSTR_BUF_SIZE] = "unknown";
+
+	if (source->n_frames > 0)
+	{
+		last_frame_age_ms = (g_get_monotonic_time () - source->last_frame_time_us) / 1000.0;
+	}
+
+	if (source->load.has_baseline)
+	{
+		g_ascii_formatd (clock_offset, sizeof (clock_offset), "%.6f", source->load.baseline);
+	}
+
+	return g_strdup_printf ("connected=%s\n"
+				"frames=%" G_GUINT64_FORMAT "\n"
+				"undecoded_frames=%" G_GUINT64_FORMAT "\n"
+				"frame_rate_hz=%.1f\n"
+				"last_timestamp=%.6f\n"
+				"last_frame_age_ms=%.1f\n"
+				"clock_offset=%s\n",
+				source->pupil_ready ? "true" : "false",
+				source->n_frames,
+				source->n_undecoded_frames,
+				source->frame_rate,
+				source->last_frame_timestamp,
+				last_frame_age_ms,
+				clock_offset);
+}
+
+/* Returns: one "<name>=<status>" line per source, the first one is the
+ * [pupil] group.
+ */
+static char *
+sources_to_string (Recorder *recorder)
+{
+	GString *str;
+	guint source_num;
+
+	str = g_string_new (NULL);
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+
+		g_string_append_printf (str, "%s=%s\n",
+					source->name,
+					source->pupil_ready ? "ready" : "waiting_for_pupil");
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+static void
+append_alarm_name (GString       *alarms,
+		   WatchdogCheck *check,
+		   const char    *name)
+{
+	if (!check->alarm)
+	{
+		return;
+	}
+
+	if (alarms->len > 0)
+	{
+		g_string_append_c (alarms, ',');
+	}
+
+	g_string_append (alarms, name);
+}
+
+/* Returns: the state of the watchdog, as "key=value" lines. status is "alarm"
+ * if at least one alarm is raised, alarms is the list of their names,
+ * separated by commas. Then for each check, its last value, its max since
+ * the last heartbeat, its budget, the number of values over the budget and
+ * of alarms, and whether its alarm is raised.
+ */
+static char *
+health_to_string (Recorder *recorder)
+{
+	GString *str;
+	GString *alarms;
+	guint source_num;
+
+	alarms = g_string_new (NULL);
+	append_alarm_name (alarms, &recorder->loop_jitter, "loop_jitter");
+	append_alarm_name (alarms, &recorder->reply_latency, "reply_latency");
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+
+		append_alarm_name (alarms, &source->frame_age, source->frame_age_name);
+	}
+
+	str = g_string_new (NULL);
+	g_string_append_printf (str,
+				"status=%s\n"
+				"alarms=%s\n"
+				"heartbeats=%" G_GUINT64_FORMAT "\n",
+				alarms->len > 0 ? "alarm" : "ok",
+				alarms->str,
+				recorder->n_heartbeats);
+	g_string_free (alarms, TRUE);
+
+	watchdog_check_append_to_string (&recorder->loop_jitter, "loop_jitter", str);
+	watchdog_check_append_to_string (&recorder->reply_latency, "reply_latency", str);
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+
+		watchdog_check_append_to_string (&source->frame_age, source->frame_age_name, str);
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+/* A watchdog message has two parts: the topic, "heartbeat" or "alarm", for
+ * the subscriptions, and the body. The publisher never blocks, a message is
+ * dropped if a subscriber is too slow.
+ */
+static void
+publish_watchdog_message (Recorder   *recorder,
+			  const char *topic,
+			  const char *body)
+{
+	if (recorder->watchdog_publisher == NULL)
+	{
+		return;
+	}
+
+	zmq_send (recorder->watchdog_publisher, topic, strlen (topic), ZMQ_SNDMORE | ZMQ_DONTWAIT);
+	zmq_send (recorder->watchdog_publisher, body, strlen (body), ZMQ_DONTWAIT);
+}
+
+static void
+publish_alarm (Recorder      *recorder,
+	       WatchdogCheck *check,
+	       const char    *name)
+{
+	char *body;
+
+	if (check->alarm)
+	{
+		g_warning ("Watchdog: %s over budget (%" G_GINT64_FORMAT " µs > %" G_GINT64_FORMAT " µs).",
+			   name,
+			   check->last_us,
+			   check->budget_us);
+	}
+	else
+	{
+		g_print ("Watchdog: %s back within budget.\n", name);
+	}
+
+	body = g_strdup_printf ("check=%s\n"
+				"state=%s\n"
+				"value_us=%" G_GINT64_FORMAT "\n"
+				"budget_us=%" G_GINT64_FORMAT "\n",
+				name,
+				check->alarm ? "raised" : "cleared",
+				check->last_us,
+				check->budget_us);
+	publish_watchdog_message (recorder, "alarm", body);
+	g_free (body);
+}
+
+static void
+add_watchdog_value (Recorder      *recorder,
+		    WatchdogCheck *check,
+		    const char    *name,
+		    gint64         value_us)
+{
+	if (watchdog_check_add (check, value_us))
+	{
+		publish_alarm (recorder, check, name);
+	}
+}
+
+static void
+end_watchdog_window (Recorder      *recorder,
+		     WatchdogCheck *check,
+		     const char    *name)
+{
+	if (watchdog_check_end_window (check))
+	{
+		publish_alarm (recorder, check, name);
+	}
+}
+
+/* Called at each iteration of the main loop: updates the frame ages, and
+ * publishes the heartbeat when it is time. The loop jitter and the reply
+ * latency are measured in read_request().
+ *
+ * A heartbeat contains the same lines as the health request. A subscriber
+ * not receiving it knows that the main loop is stuck, or that
+ * external-recorder has quit.
+ */
+static void
+check_health (Recorder *recorder)
+{
+	gint64 interval_us;
+	gint64 now_us;
+	guint source_num;
+	char *health;
+
+	interval_us = (gint64) recorder->config->watchdog_heartbeat_interval_ms * 1000;
+	now_us = g_get_monotonic_time ();
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+		gint64 since_us;
+
+		since_us = source->n_frames > 0 ? source->last_frame_time_us : recorder->start_time_us;
+		add_watchdog_value (recorder, &source->frame_age, source->frame_age_name, now_us - since_us);
+	}
+
+	if (now_us < recorder->next_heartbeat_us)
+	{
+		return;
+	}
+
+	recorder->n_heartbeats++;
+	health = health_to_string (recorder);
+	publish_watchdog_message (recorder, "heartbeat", health);
+	g_free (health);
+
+	end_watchdog_window (recorder, &recorder->loop_jitter, "loop_jitter");
+	end_watchdog_window (recorder, &recorder->reply_latency, "reply_latency");
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+
+		end_watchdog_window (recorder, &source->frame_age, source->frame_age_name);
+	}
+
+	recorder->next_heartbeat_us += interval_us;
+
+	/* Without catching up the missed heartbeats, if the loop has been
+	 * stuck.
+	 */
+	if (recorder->next_heartbeat_us <= now_us)
+	{
+		recorder->next_heartbeat_us = now_us + interval_us;
+	}
+}
+
+static char *
+filter_cost_to_string (Recorder *recorder)
+{
+	char *batch_stats;
+	char *str;
+
+	if (!recorder->config->filter_enabled)
+	{
+		return g_strdup ("filter disabled");
+	}
+
+	batch_stats = jitter_stats_to_string (&recorder->filter_batch_cost);
+
+	str = g_strdup_printf ("samples=%" G_GUINT64_FORMAT "\n"
+			       "mean_ns_per_sample=%.1f\n"
+			       "budget_ns_per_sample=%d\n"
+			       "batches_over_budget=%" G_GUINT64_FORMAT "\n"
+			       "%s",
+			       recorder->filter_n_samples,
+			       recorder->filter_n_samples > 0 ?
+			       (double) recorder->filter_total_ns / recorder->filter_n_samples :
+			       0.0,
+			       recorder->config->filter_cost_budget_ns,
+			       recorder->filter_n_over_budget,
+			       batch_stats);
+
+	g_free (batch_stats);
+	return str;
+}
+
+/* The clients are not trusted to write anywhere, external-recorder can run
+ * with high privileges.
+ * Returns: @path in export.directory, or %NULL if @path is absolute or
+ * contains "..". Free with g_free().
+ */
+static char *
+get_export_path (Recorder   *recorder,
+		 const char *path)
+{
+	char **components;
+	gboolean valid;
+
+	if (path == NULL ||
+	    path[0] == '\0' ||
+	    g_path_is_absolute (path))
+	{
+		return NULL;
+	}
+
+	components = g_strsplit (path, G_DIR_SEPARATOR_S, -1);
+	valid = !g_strv_contains ((const char * const *) components, "..");
+	g_strfreev (components);
+
+	if (!valid)
+	{
+		return NULL;
+	}
+
+	return g_build_filename (recorder->config->export_directory, path, NULL);
+}
+
+/* The export request, which writes samples to files in a background thread:
+ * - "export <npy|csv> <path>": all the samples.
+ * - "export <npy|csv> <path> trial <id>": the samples of a trial.
+ * The path is on the computer running the external-recorder, and can't
+ * contain spaces.
+ */
+static char *
+export (Recorder     *recorder,
+	PupilSource  *source,
+	char        **args)
+{
+	ExportFormat format;
+	char *path;
+	guint begin;
+	guint end;
+	GError *error = NULL;
+
+	if (recorder->config->export_directory[0] == '\0')
+	{
+		return g_strdup ("export disabled");
+	}
+
+	if (!exporter_parse_format (args[1], &format) ||
+	    args[2] == NULL || args[2][0] == '\0')
+	{
+		return g_strdup ("invalid export");
+	}
+
+	begin = sample_store_get_first (source->store);
+	end = sample_store_get_length (source->store);
+
+	if (g_strcmp0 (args[3], "trial") == 0)
+	{
+		const SampleStoreTrial *trial;
+		gint64 id;
+
+		if (!parse_int64 (args[4], &id))
+		{
+			return g_strdup ("invalid export");
+		}
+
+		trial = sample_store_find_trial (source->store, id);
+		if (trial == NULL)
+		{
+			return g_strdup ("unknown trial");
+		}
+
+		begin = MAX (trial->begin, begin);
+		end = MIN (trial->end, end);
+	}
+	else if (args[3] != NULL)
+	{
+		return g_strdup ("invalid export");
+	}
+
+	path = get_export_path (recorder, args[2]);
+	if (path == NULL)
+	{
+		g_warning ("Export path refused: %s", args[2]);
+		return g_strdup ("invalid export path");
+	}
+
+	if (!exporter_start (source->exporter, format, path, begin, end, &error))
+	{
+		char *reply;
+
+		g_warning ("Export failed: %s", error->message);
+		reply = g_strdup_printf ("error %s", error->message);
+		g_error_free (error);
+		g_free (path);
+		return reply;
+	}
+
+	g_free (path);
+	return g_strdup ("ack");
+}
+
+/* The clear request, for one source. */
+static char *
+clear_source (PupilSource *source)
+{
+	/* The export thread reads the store. */
+	if (exporter_is_running (source->exporter))
+	{
+		return g_strdup ("busy");
+	}
+
+	sample_store_clear (source->store);
+	source->receive_data_cursor = 0;
+
+	if (source->gaze_filter != NULL)
+	{
+		gaze_filter_clear_events (source->gaze_filter);
+	}
+	source->events_cursor = 0;
+	source->n_deferred = 0;
+
+	return g_strdup ("ack");
+}
+
+/* The clear request, for all the sources: nothing is cleared if an export is
+ * running.
+ */
+static char *
+clear_all_sources (Recorder *recorder)
+{
+	guint source_num;
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		if (exporter_is_running (get_source (recorder, source_num)->exporter))
+		{
+			return g_strdup ("busy");
+		}
+	}
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		g_free (clear_source (get_source (recorder, source_num)));
+	}
+
+	return g_strdup ("ack");
+}
+
+/* The requests that can be addressed to a source, see execute_request(). */
+static const char * const source_commands[] =
+{
+	"receive_data",
+	"query",
+	"events",
+	"export",
+	"export_status",
+	"clear",
+	"status",
+	"load",
+	"stream",
+	NULL
+};
+
+/* The maximum number of arguments of each request. The requests with a
+ * variable number of arguments check them further.
+ */
+typedef struct _RequestInfo RequestInfo;
+struct _RequestInfo
+{
+	const char *command;
+	guint max_args;
+};
+
+static const RequestInfo requests_info[] =
+{
+	{ "start", 1 },
+	{ "stop", 0 },
+	{ "start_block", 0 },
+	{ "stop_block", 0 },
+	{ "receive_data", 1 },
+	{ "query", 4 },
+	{ "query_merged", 2 },
+	{ "events", 0 },
+	{ "filter_stats", 1 },
+	{ "export", 4 },
+	{ "export_status", 0 },
+	{ "clear", 0 },
+	{ "status", 0 },
+	{ "sources", 0 },
+	{ "health", 0 },
+	{ "config", 0 },
+	{ "load", 0 },
+	{ "stream", 0 },
+	{ "jitter", 1 }
+};
+
+/* Returns: whether @args has no more arguments than allowed for its command,
+ * and for the requests taking an optional "reset", whether it is that one.
+ * An unknown command is checked later.
+ */
+static gboolean
+check_request_args (char **args)
+{
+	guint n_args;
+	guint i;
+
+	if (args[0] == NULL)
+	{
+		return TRUE;
+	}
+
+	n_args = g_strv_length (args) - 1;
+
+	if ((g_str_equal (args[0], "filter_stats") ||
+	     g_str_equal (args[0], "jitter")) &&
+	    n_args > 0 &&
+	    !g_str_equal (args[1], "reset"))
+	{
+		return FALSE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (requests_info); i++)
+	{
+		if (g_str_equal (args[0], requests_info[i].command))
+		{
+			return n_args <= requests_info[i].max_args;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Executes one command.
+ *
+ * The command can be preceded by "@<name>" to address a source, for the
+ * commands in source_commands[]. Without it, the commands that return data
+ * are for the first source, and clear and status are for all the sources.
+ * The other commands, like start and stop, are always for all the sources.
+ *
+ * Returns: the reply, of size @reply_size.
+ */
+static char *
+execute_request (Recorder   *recorder,
+		 const char *request,
+		 gsize      *reply_size)
+{
+	char **all_args;
+	char **args;
+	const char *command;
+	PupilSource *source;
+	gboolean source_given = FALSE;
+	char *reply = NULL;
+
+	*reply_size = 0;
 
 	g_print ("Request from cosy-pupil-client: %s\n", request);
 
-	if (g_str_equal (request, "start"))
+	/* A request is a command optionally followed by arguments, separated
+	 * by spaces.
+	 */
+	all_args = g_strsplit (request, " ", -1);
+	args = all_args;
+	source = get_source (recorder, 0);
+
+	if (args[0] != NULL && args[0][0] == '@')
+	{
+		source = find_source (recorder, args[0] + 1);
+		source_given = TRUE;
+		args++;
+	}
+
+	command = args[0] != NULL ? args[0] : "";
+
+	if (source == NULL)
+	{
+		g_warning ("Unknown source: %s", all_args[0] + 1);
+		reply = g_strdup ("unknown source");
+	}
+	else if (source_given &&
+		 !g_strv_contains (source_commands, command))
+	{
+		g_warning ("Not a request for a source: %s", request);
+		reply = g_strdup ("invalid source");
+	}
+	else if (!check_request_args (args))
 	{
-		reply = recorder_start (recorder);
+		g_warning ("Invalid arguments: %s", request);
+		reply = g_strdup ("invalid request");
 	}
-	else if (g_str_equal (request, "stop"))
+	else if (g_str_equal (command, "start"))
+	{
+		reply = recorder_start (recorder, args[1]);
+	}
+	else if (g_str_equal (command, "stop"))
 	{
 		reply = recorder_stop (recorder);
 	}
-	else if (g_str_equal (request, "receive_data"))
+	else if (g_str_equal (command, "start_block"))
+	{
+		reply = recorder_start_block (recorder);
+	}
+	else if (g_str_equal (command, "stop_block"))
+	{
+		reply = recorder_stop_block (recorder);
+	}
+	else if (g_str_equal (command, "receive_data"))
 	{
 		/* It's fine to send big messages with ZeroMQ. In our case, if
 		 * the recording lasts 2 minutes, the data should be below 1MB.
 		 * ZeroMQ supports data blobs from zero to gigabytes large (as
 		 * long as there is enough RAM on both sides). So 1MB should be
 		 * fingers in the nose.
+		 *
+		 * At 200 Hz and more, the text format reaches tens of MB, so
+		 * the client can ask the binary format, optionally compressed.
+		 *
+		 * The data is then released, see trim_store(), unless it is
+		 * kept for the queries, in which case only the receive_data
+		 * cursor moves.
+		 *
+		 * A binary reply has at most DATA_BINARY_MAX_SAMPLES samples
+		 * (about 62 hours at 200 Hz), the next ones are returned by
+		 * the next receive_data.
 		 */
-		reply = receive_data (recorder);
+		OutputFormat format;
+		guint end;
+
+		if (parse_output_format_arg (recorder, args[1], &format))
+		{
+			end = sample_store_get_length (source->store);
+			if (format != OUTPUT_FORMAT_TEXT)
+			{
+				end = MIN (end, source->receive_data_cursor + DATA_BINARY_MAX_SAMPLES);
+			}
+			reply = format_samples (recorder,
+						source->store,
+						source->receive_data_cursor,
+						end,
+						NULL,
+						format,
+						reply_size);
+			source->receive_data_cursor = end;
+			trim_store (recorder, source);
+		}
+		else
+		{
+			reply = g_strdup ("invalid request");
+		}
+	}
+	else if (g_str_equal (command, "query"))
+	{
+		reply = query (recorder, source, args, reply_size);
+	}
+	else if (g_str_equal (command, "query_merged"))
+	{
+		reply = query_merged (recorder, args);
+	}
+	else if (g_str_equal (command, "events"))
+	{
+		reply = receive_events (source);
+	}
+	else if (g_str_equal (command, "filter_stats"))
+	{
+		reply = filter_cost_to_string (recorder);
+
+		if (g_strcmp0 (args[1], "reset") == 0)
+		{
+			reset_filter_cost (recorder);
+		}
+	}
+	else if (g_str_equal (command, "export"))
+	{
+		reply = export (recorder, source, args);
+	}
+	else if (g_str_equal (command, "export_status"))
+	{
+		reply = exporter_get_status (source->exporter);
+	}
+	else if (g_str_equal (command, "clear"))
+	{
+		reply = source_given ? clear_source (source) : clear_all_sources (recorder);
+	}
+	else if (g_str_equal (command, "status"))
+	{
+		if (recorder->recording)
+		{
+			reply = g_strdup ("recording");
+		}
+		else if (!(source_given ? source->pupil_ready : all_sources_ready (recorder)))
+		{
+			reply = g_strdup ("waiting_for_pupil");
+		}
+		else
+		{
+			reply = g_strdup ("idle");
+		}
+	}
+	else if (g_str_equal (command, "sources"))
+	{
+		reply = sources_to_string (recorder);
+	}
+	else if (g_str_equal (command, "health"))
+	{
+		reply = health_to_string (recorder);
+	}
+	else if (g_str_equal (command, "config"))
+	{
+		reply = config_to_data (recorder->config);
+	}
+	else if (g_str_equal (command, "load"))
+	{
+		reply = load_to_string (source);
+	}
+	else if (g_str_equal (command, "stream"))
+	{
+		reply = stream_to_string (source);
+	}
+	else if (g_str_equal (command, "jitter"))
+	{
+		reply = jitter_stats_to_string (&recorder->wakeup_jitter);
 
-		g_queue_free_full (recorder->data_queue, g_free);
-		recorder->data_queue = g_queue_new ();
+		if (g_strcmp0 (args[1], "reset") == 0)
+		{
+			jitter_stats_reset (&recorder->wakeup_jitter);
+		}
 	}
 	else
 	{
@@ -1007,31 +2952,494 @@ read_request (Recorder *recorder)
 		reply = g_strdup ("unknown request");
 	}
 
-	g_print ("Send reply to cosy-pupil-client...\n");
-	zmq_send (recorder->replier,
-		  reply,
-		  strlen (reply),
-		  0);
-	g_print ("done.\n\n");
+	if (*reply_size == 0)
+	{
+		*reply_size = strlen (reply);
+	}
+
+	g_strfreev (all_args);
+	return reply;
+}
+
+static gboolean
+has_more_parts (void *socket)
+{
+	int more = 0;
+	size_t more_size = sizeof (more);
+
+	if (zmq_getsockopt (socket, ZMQ_RCVMORE, &more, &more_size) != 0)
+	{
+		return FALSE;
+	}
+
+	return more != 0;
+}
+
+/* A request message can contain several commands, one per message part (a
+ * batch). They are executed in order, and the reply has one part per
+ * command. A batch saves network round-trips, e.g. "stop", "receive_data"
+ * and "start" at a trial boundary.
+ *
+ * The Pupil messages are not read during a batch, so the commands see the
+ * same state as if they were executed at the same instant. In particular
+ * "stop" followed by "start" is gapless: the next trial begins exactly where
+ * the previous one ends, and the samples received in the meantime are queued
+ * by ZeroMQ and recorded in the next trial.
+ *
+ * If @wait is %FALSE, only a request already received is read, because Pupil
+ * messages are waiting.
+ */
+static void
+read_request (Recorder *recorder,
+	      gboolean  wait)
+{
+	GPtrArray *requests;
+	char *request;
+	gint64 wait_begin_us;
+	gint64 receive_us;
+	guint request_num;
+
+	wait_begin_us = g_get_monotonic_time ();
+
+	request = receive_message (recorder->replier, wait ? 0 : ZMQ_DONTWAIT);
+	if (request == NULL && (quit_requested || !wait))
+	{
+		return;
+	}
+
+	if (request == NULL)
+	{
+		/* Timeout: measure how late we wake up compared to the
+		 * timeout, which is the scheduling jitter of the main loop.
+		 */
+		gint64 jitter_us;
+
+		jitter_us = g_get_monotonic_time () - wait_begin_us -
+			recorder->config->replier_timeout_ms * 1000;
+
+		jitter_stats_add (&recorder->wakeup_jitter, jitter_us);
+		add_watchdog_value (recorder, &recorder->loop_jitter, "loop_jitter", jitter_us);
+		return;
+	}
+
+	/* The reply latency is from the reception of the request to the
+	 * sending of the reply, for the whole batch.
+	 */
+	receive_us = g_get_monotonic_time ();
+
+	requests = g_ptr_array_new_with_free_func (g_free);
+	g_ptr_array_add (requests, request);
+
+	while (has_more_parts (recorder->replier))
+	{
+		request = receive_next_message (recorder->replier);
+		g_ptr_array_add (requests, request != NULL ? request : g_strdup (""));
+	}
+
+	if (requests->len > 1)
+	{
+		g_print ("Batch of %u requests from cosy-pupil-client.\n", requests->len);
+	}
+
+	for (request_num = 0; request_num < requests->len; request_num++)
+	{
+		char *reply;
+		gsize reply_size;
+		gboolean last;
+
+		reply = execute_request (recorder,
+					 g_ptr_array_index (requests, request_num),
+					 &reply_size);
+
+		/* ZeroMQ delivers the parts all at once, after the last
+		 * one.
+		 */
+		last = request_num + 1 == requests->len;
+
+		g_print ("Send reply to cosy-pupil-client...\n");
+		zmq_send (recorder->replier,
+			  reply,
+			  reply_size,
+			  last ? 0 : ZMQ_SNDMORE);
+		g_print ("done.\n\n");
+
+		g_free (reply);
+	}
+
+	add_watchdog_value (recorder,
+			    &recorder->reply_latency,
+			    "reply_latency",
+			    g_get_monotonic_time () - receive_us);
+
+	g_ptr_array_free (requests, TRUE);
+}
+
+/* Returns: the configuration from the command line options and the
+ * configuration file, or %NULL on error.
+ */
+static Config *
+parse_command_line (int    *argc,
+		    char ***argv)
+{
+	GOptionContext *option_context;
+	char *config_filename = NULL;
+	char **assignments = NULL;
+	char *keypair_prefix = NULL;
+	gboolean debug = FALSE;
+	gboolean print_config = FALSE;
+	Config *config = NULL;
+	GError *error = NULL;
+	guint i;
+
+	GOptionEntry entries[] =
+	{
+		{ "config", 'c', 0, G_OPTION_ARG_FILENAME, &config_filename,
+		  "Load the configuration from FILE (GKeyFile format)", "FILE" },
+		{ "set", 's', 0, G_OPTION_ARG_STRING_ARRAY, &assignments,
+		  "Set a configuration value, after the configuration file. "
+		  "Can be repeated", "GROUP.KEY=VALUE" },
+		{ "debug", 'd', 0, G_OPTION_ARG_NONE, &debug,
+		  "Same as --set general.debug=true", NULL },
+		{ "print-config", 'p', 0, G_OPTION_ARG_NONE, &print_config,
+		  "Print the effective configuration and exit", NULL },
+		{ "generate-curve-keypair", 0, 0, G_OPTION_ARG_FILENAME, &keypair_prefix,
+		  "Write a CURVE secret key to PREFIX.key and its public key to "
+		  "PREFIX.pub, and exit", "PREFIX" },
+		{ NULL }
+	};
+
+	option_context = g_option_context_new (NULL);
+	g_option_context_set_summary (option_context,
+				      "Record Pupil Capture data and serve it to cosy-pupil-client.");
+	g_option_context_add_main_entries (option_context, entries, NULL);
+
+	if (!g_option_context_parse (option_context, argc, argv, &error))
+	{
+		goto out;
+	}
+
+	if (keypair_prefix != NULL)
+	{
+		if (!curve_write_keypair (keypair_prefix, &error))
+		{
+			goto out;
+		}
+
+		g_print ("CURVE keypair written to %s.key and %s.pub.\n",
+			 keypair_prefix,
+			 keypair_prefix);
+		exit (EXIT_SUCCESS);
+	}
+
+	config = config_new ();
+
+	if (config_filename != NULL &&
+	    !config_load_file (config, config_filename, &error))
+	{
+		goto out;
+	}
+
+	for (i = 0; assignments != NULL && assignments[i] != NULL; i++)
+	{
+		if (!config_parse_assignment (config, assignments[i], &error))
+		{
+			goto out;
+		}
+	}
+
+	if (debug)
+	{
+		config->debug = TRUE;
+	}
+
+	if (!config_validate (config, &error))
+	{
+		goto out;
+	}
+
+	if (print_config)
+	{
+		char *data;
+
+		data = config_to_data (config);
+		g_print ("%s", data);
+		g_free (data);
+
+		exit (EXIT_SUCCESS);
+	}
+
+out:
+	if (error != NULL)
+	{
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+
+		config_free (config);
+		config = NULL;
+	}
+
+	g_option_context_free (option_context);
+	g_free (config_filename);
+	g_free (keypair_prefix);
+	g_strfreev (assignments);
+
+	return config;
+}
+
+/* Must be called before recorder_init(), see realtime.c. Failures are not
+ * fatal: external-recorder still works, with less deterministic latencies.
+ */
+static void
+apply_realtime_config (Config *config)
+{
+	GError *error = NULL;
+
+	if (config->cpu_affinity[0] != '\0')
+	{
+		if (realtime_set_cpu_affinity (config->cpu_affinity, &error))
+		{
+			g_print ("CPU affinity: %s\n", config->cpu_affinity);
+		}
+		else
+		{
+			g_warning ("%s", error->message);
+			g_clear_error (&error);
+		}
+	}
+
+	if (config->sched_fifo_priority > 0)
+	{
+		if (realtime_set_fifo_priority (config->sched_fifo_priority, &error))
+		{
+			g_print ("Scheduling policy: SCHED_FIFO, priority %d\n",
+				 config->sched_fifo_priority);
+		}
+		else
+		{
+			g_warning ("%s", error->message);
+			g_clear_error (&error);
+		}
+	}
+
+	if (config->lock_memory)
+	{
+		if (realtime_lock_memory (&error))
+		{
+			realtime_prefault_stack ();
+			g_print ("Memory locked.\n");
+		}
+		else
+		{
+			g_warning ("%s", error->message);
+			g_clear_error (&error);
+		}
+	}
+}
+
+static void
+quit_signal_handler (int signum)
+{
+	quit_requested = 1;
+}
+
+static void
+install_signal_handlers (void)
+{
+	struct sigaction action;
+
+	memset (&action, 0, sizeof (action));
+	action.sa_handler = quit_signal_handler;
+	sigemptyset (&action.sa_mask);
+
+	/* Without SA_RESTART, the blocking receive on the replier returns with
+	 * EINTR, so the main loop quits without waiting for the timeout.
+	 * SA_RESETHAND: a second signal kills the process, in case the
+	 * shutdown is stuck.
+	 */
+	action.sa_flags = SA_RESETHAND;
+
+	if (sigaction (SIGINT, &action, NULL) != 0 ||
+	    sigaction (SIGTERM, &action, NULL) != 0)
+	{
+		g_warning ("Error when installing the signal handlers: %s",
+			   g_strerror (errno));
+	}
+}
+
+/* Saves the whole session of @source to shutdown.export-path, with the date
+ * and time appended to the name, so that the sessions are not overwritten.
+ * With several sources, the name of the source is appended too.
+ */
+static void
+save_session (Recorder    *recorder,
+	      PupilSource *source,
+	      const char  *date)
+{
+	const char *path = recorder->config->shutdown_export_path;
+	const char *separator = "";
+	const char *source_name = "";
+	ExportFormat format;
+	char *filename;
+	GError *error = NULL;
+
+	if (recorder->sources->len > 1)
+	{
+		separator = "-";
+		source_name = source->name;
+	}
+
+	if (g_str_has_suffix (path, ".csv"))
+	{
+		format = EXPORT_FORMAT_CSV;
+		filename = g_strdup_printf ("%.*s-%s%s%s.csv",
+					    (int) strlen (path) - 4,
+					    path,
+					    date,
+					    separator,
+					    source_name);
+	}
+	else
+	{
+		format = EXPORT_FORMAT_NPY;
+		filename = g_strdup_printf ("%s-%s%s%s", path, date, separator, source_name);
+	}
+
+	g_print ("Saving the session to %s...\n", filename);
+
+	if (exporter_run (source->store,
+			  format,
+			  filename,
+			  sample_store_get_first (source->store),
+			  sample_store_get_length (source->store),
+			  &error))
+	{
+		g_print ("done.\n");
+	}
+	else
+	{
+		g_warning ("Error when saving the session: %s", error->message);
+		g_error_free (error);
+	}
+
+	g_free (filename);
+}
+
+/* Without shutdown.export-path, the samples that receive_data has not returned
+ * yet are lost, so say it loudly.
+ */
+static void
+warn_unsaved_samples (Recorder *recorder)
+{
+	guint source_num;
+
+	for (source_num = 0; source_num < recorder->sources->len; source_num++)
+	{
+		PupilSource *source = get_source (recorder, source_num);
+		guint n_unsaved;
+
+		n_unsaved = sample_store_get_length (source->store) - source->receive_data_cursor;
+
+		if (n_unsaved > 0)
+		{
+			g_warning ("%u samples of %s were not received with receive_data "
+				   "and are lost: set shutdown.export-path to save them "
+				   "when quitting.",
+				   n_unsaved,
+				   source->name);
+		}
+	}
+}
+
+/* Called when quitting on SIGINT or SIGTERM: ends the recording and saves the
+ * session, so that the recorded samples are not lost.
+ */
+static void
+recorder_shutdown (Recorder *recorder)
+{
+	/* Store the samples already received. */
+	read_all_pupil_messages (recorder);
+
+	if (recorder->in_block)
+	{
+		g_free (recorder_stop_block (recorder));
+	}
+	else if (recorder->recording)
+	{
+		g_free (recorder_stop (recorder));
+	}
+
+	if (recorder->config->shutdown_export_path[0] != '\0')
+	{
+		GDateTime *now;
+		char *date;
+		guint source_num;
+
+		now = g_date_time_new_now_local ();
+		date = g_date_time_format (now, "%Y%m%d-%H%M%S");
+		g_date_time_unref (now);
+
+		for (source_num = 0; source_num < recorder->sources->len; source_num++)
+		{
+			PupilSource *source = get_source (recorder, source_num);
+
+			if (sample_store_get_length (source->store) >
+			    sample_store_get_first (source->store))
+			{
+				save_session (recorder, source, date);
+			}
+		}
 
-	g_free (request);
-	g_free (reply);
+		g_free (date);
+	}
+	else
+	{
+		warn_unsaved_samples (recorder);
+	}
 }
 
 int
-main (void)
+main (int    argc,
+      char **argv)
 {
 	Recorder recorder = { 0 };
+	Config *config;
+
+	config = parse_command_line (&argc, &argv);
+	if (config == NULL)
+	{
+		return EXIT_FAILURE;
+	}
+
+	/* Before the initialization, which can take a while (mlockall(),
+	 * prefaulted stores), so that a signal still releases the sockets and
+	 * the shared memory.
+	 */
+	install_signal_handlers ();
+
+	apply_realtime_config (config);
+
+	if (recorder_init (&recorder, config))
+	{
+		while (!quit_requested)
+		{
+			gboolean backlog;
 
-	recorder_init (&recorder);
+			maintain_pupil_connections (&recorder);
+			backlog = read_all_pupil_messages (&recorder);
+			read_request (&recorder, !backlog);
+			check_health (&recorder);
+		}
 
-	while (TRUE)
+		g_print ("Quitting...\n");
+		recorder_shutdown (&recorder);
+	}
+	else
 	{
-		read_all_pupil_messages (&recorder);
-		read_request (&recorder);
+		g_print ("Quitting during the initialization...\n");
 	}
 
 	recorder_finalize (&recorder);
+	config_free (config);
 
 	return EXIT_SUCCESS;
 }
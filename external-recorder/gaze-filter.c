@@ -0,0 +1,299 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gaze-filter.h"
+#include <math.h>
+
+/* Online processing of the recorded gaze positions, so that gaze-contingent
+ * experiments get smoothed gaze and saccades without reimplementing them in
+ * each client:
+ *
+ * - The gaze position is smoothed with a one euro filter [1]: a first-order
+ *   low-pass filter whose cutoff frequency increases with the speed, so that
+ *   the jitter is removed during fixations while the lag stays small during
+ *   saccades.
+ * - The velocity is computed from the filtered positions, in normalized
+ *   units per second.
+ * - Each sample is classified as fixation or saccade with a velocity
+ *   threshold (I-VT), and the runs of samples with the same class are
+ *   reported as events.
+ *
+ * The samples are processed in batches, in place, before being added to the
+ * store. The one euro filter is recursive, so a batch is processed
+ * sequentially, but the loop only does a few multiply-adds per sample with
+ * the state in registers.
+ *
+ * [1] Géry Casiez, Nicolas Roussel and Daniel Vogel. 1€ Filter: A Simple
+ *     Speed-based Low-pass Filter for Noisy Input in Interactive Systems.
+ *     CHI 2012.
+ */
+
+/* A longer gap between two valid samples restarts the filter, so that the
+ * filtered position doesn't slowly move from the position before the gap.
+ */
+#define MAX_GAP_SECONDS 0.1
+
+struct _GazeFilter
+{
+	GazeFilterParams params;
+
+	/* State of the filter, valid if @initialized is set. */
+	double last_timestamp;
+	double x;
+	double y;
+	double dx;
+	double dy;
+
+	/* The event being built, valid if @n_event_samples > 0. */
+	GazeEvent current_event;
+	double sum_x;
+	double sum_y;
+	guint n_event_samples;
+
+	/* Finished GazeEvent elements, in chronological order. */
+	GArray *events;
+
+	guint initialized : 1;
+};
+
+GazeFilter *
+gaze_filter_new (const GazeFilterParams *params)
+{
+	GazeFilter *filter;
+
+	filter = g_new0 (GazeFilter, 1);
+	filter->params = *params;
+	filter->events = g_array_new (FALSE, FALSE, sizeof (GazeEvent));
+
+	return filter;
+}
+
+void
+gaze_filter_free (GazeFilter *filter)
+{
+	if (filter != NULL)
+	{
+		g_array_free (filter->events, TRUE);
+		g_free (filter);
+	}
+}
+
+/* Ends the current event, if any. */
+void
+gaze_filter_flush (GazeFilter *filter)
+{
+	if (filter->n_event_samples > 0)
+	{
+		filter->current_event.x = filter->sum_x / filter->n_event_samples;
+		filter->current_event.y = filter->sum_y / filter->n_event_samples;
+		g_array_append_val (filter->events, filter->current_event);
+
+		filter->n_event_samples = 0;
+	}
+}
+
+/* Restarts the filter, for a new recording. The current event is ended. */
+void
+gaze_filter_reset (GazeFilter *filter)
+{
+	gaze_filter_flush (filter);
+	filter->initialized = FALSE;
+}
+
+/* Smoothing factor of a first-order low-pass filter. */
+static inline double
+get_alpha (double cutoff_hz,
+	   double dt)
+{
+	double tau = 1.0 / (2.0 * G_PI * cutoff_hz);
+
+	return dt / (dt + tau);
+}
+
+static inline void
+add_to_event (GazeFilter *filter,
+	      GazeClass   gaze_class,
+	      double      timestamp,
+	      double      x,
+	      double      y,
+	      double      velocity)
+{
+	GazeEvent *event = &filter->current_event;
+
+	if (filter->n_event_samples > 0 &&
+	    event->type != gaze_class)
+	{
+		gaze_filter_flush (filter);
+	}
+
+	if (filter->n_event_samples == 0)
+	{
+		event->type = gaze_class;
+		event->begin = timestamp;
+		event->peak_velocity = 0.0;
+		filter->sum_x = 0.0;
+		filter->sum_y = 0.0;
+	}
+
+	event->end = timestamp;
+	event->peak_velocity = MAX (event->peak_velocity, velocity);
+	filter->sum_x += x;
+	filter->sum_y += y;
+	filter->n_event_samples++;
+}
+
+/* Fills the gaze_filtered_x, gaze_filtered_y, gaze_velocity and gaze_class
+ * fields of @samples, which must be in chronological order.
+ */
+void
+gaze_filter_process (GazeFilter *filter,
+		     Data       *samples,
+		     guint       n_samples)
+{
+	const GazeFilterParams *params = &filter->params;
+	guint i;
+
+	for (i = 0; i < n_samples; i++)
+	{
+		Data *data = &samples[i];
+		double dt = data->timestamp - filter->last_timestamp;
+		double velocity;
+		GazeClass gaze_class;
+
+		if (data->gaze_confidence < params->min_confidence ||
+		    data->timestamp < 0.0)
+		{
+			data->gaze_filtered_x = -1.0;
+			data->gaze_filtered_y = -1.0;
+			data->gaze_velocity = -1.0;
+			data->gaze_class = GAZE_CLASS_UNKNOWN;
+			continue;
+		}
+
+		if (!filter->initialized ||
+		    dt <= 0.0 ||
+		    dt > MAX_GAP_SECONDS)
+		{
+			gaze_filter_flush (filter);
+
+			filter->x = data->gaze_norm_pos_x;
+			filter->y = data->gaze_norm_pos_y;
+			filter->dx = 0.0;
+			filter->dy = 0.0;
+			filter->initialized = TRUE;
+
+			velocity = 0.0;
+		}
+		else
+		{
+			double alpha_d = get_alpha (params->derivative_cutoff_hz, dt);
+			double alpha;
+			double x;
+			double y;
+
+			/* Filtered derivative, which adapts the cutoff. */
+			filter->dx += alpha_d * ((data->gaze_norm_pos_x - filter->x) / dt - filter->dx);
+			filter->dy += alpha_d * ((data->gaze_norm_pos_y - filter->y) / dt - filter->dy);
+
+			alpha = get_alpha (params->min_cutoff_hz +
+					   params->beta * sqrt (filter->dx * filter->dx +
+								filter->dy * filter->dy),
+					   dt);
+
+			x = filter->x + alpha * (data->gaze_norm_pos_x - filter->x);
+			y = filter->y + alpha * (data->gaze_norm_pos_y - filter->y);
+
+			velocity = sqrt ((x - filter->x) * (x - filter->x) +
+					 (y - filter->y) * (y - filter->y)) / dt;
+
+			filter->x = x;
+			filter->y = y;
+		}
+
+		filter->last_timestamp = data->timestamp;
+
+		gaze_class = velocity > params->saccade_velocity ?
+			     GAZE_CLASS_SACCADE :
+			     GAZE_CLASS_FIXATION;
+
+		data->gaze_filtered_x = filter->x;
+		data->gaze_filtered_y = filter->y;
+		data->gaze_velocity = velocity;
+		data->gaze_class = gaze_class;
+
+		add_to_event (filter, gaze_class, data->timestamp, filter->x, filter->y, velocity);
+	}
+}
+
+/* Returns: the number of finished events. The current event is not counted
+ * until the class changes or gaze_filter_flush() is called.
+ */
+guint
+gaze_filter_get_n_events (GazeFilter *filter)
+{
+	return filter->events->len;
+}
+
+const GazeEvent *
+gaze_filter_get_event (GazeFilter *filter,
+		       guint       event_num)
+{
+	g_return_val_if_fail (event_num < filter->events->len, NULL);
+
+	return &g_array_index (filter->events, GazeEvent, event_num);
+}
+
+/* Forgets the finished events. */
+void
+gaze_filter_clear_events (GazeFilter *filter)
+{
+	g_array_set_size (filter->events, 0);
+}
+
+/* Forgets the @n_events oldest finished events. The next ones are then
+ * numbered from 0.
+ */
+void
+gaze_filter_discard_events (GazeFilter *filter,
+			    guint       n_events)
+{
+	g_return_if_fail (n_events <= filter->events->len);
+
+	if (n_events > 0)
+	{
+		g_array_remove_range (filter->events, 0, n_events);
+	}
+}
+
+const char *
+gaze_class_to_string (GazeClass gaze_class)
+{
+	switch (gaze_class)
+	{
+		case GAZE_CLASS_FIXATION:
+			return "fixation";
+
+		case GAZE_CLASS_SACCADE:
+			return "saccade";
+
+		case GAZE_CLASS_UNKNOWN:
+		default:
+			return "unknown";
+	}
+}
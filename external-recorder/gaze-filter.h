@@ -0,0 +1,93 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_GAZE_FILTER_H
+#define COSY_GAZE_FILTER_H
+
+#include <glib.h>
+#include "data.h"
+
+/* Values of the gaze_class column. */
+typedef enum
+{
+	GAZE_CLASS_UNKNOWN = -1,
+	GAZE_CLASS_FIXATION = 0,
+	GAZE_CLASS_SACCADE = 1
+} GazeClass;
+
+typedef struct _GazeFilterParams GazeFilterParams;
+struct _GazeFilterParams
+{
+	/* One euro filter. */
+	double min_cutoff_hz;
+	double beta;
+	double derivative_cutoff_hz;
+
+	/* Samples with a lower gaze confidence are ignored. */
+	double min_confidence;
+
+	/* I-VT threshold, in normalized units per second. */
+	double saccade_velocity;
+};
+
+/* A fixation or a saccade: a run of samples with the same class. */
+typedef struct _GazeEvent GazeEvent;
+struct _GazeEvent
+{
+	GazeClass type;
+
+	/* Pupil timestamps of the first and last samples. */
+	double begin;
+	double end;
+
+	/* Mean filtered position. */
+	double x;
+	double y;
+
+	double peak_velocity;
+};
+
+typedef struct _GazeFilter GazeFilter;
+
+GazeFilter *	gaze_filter_new			(const GazeFilterParams *params);
+
+void		gaze_filter_free		(GazeFilter *filter);
+
+void		gaze_filter_reset		(GazeFilter *filter);
+
+void		gaze_filter_process		(GazeFilter *filter,
+						 Data       *samples,
+						 guint       n_samples);
+
+void		gaze_filter_flush		(GazeFilter *filter);
+
+guint		gaze_filter_get_n_events	(GazeFilter *filter);
+
+const GazeEvent *
+		gaze_filter_get_event		(GazeFilter *filter,
+						 guint       event_num);
+
+void		gaze_filter_clear_events	(GazeFilter *filter);
+
+void		gaze_filter_discard_events	(GazeFilter *filter,
+						 guint       n_events);
+
+const char *	gaze_class_to_string		(GazeClass   gaze_class);
+
+#endif /* COSY_GAZE_FILTER_H */
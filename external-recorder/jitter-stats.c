@@ -0,0 +1,118 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jitter-stats.h"
+#include <string.h>
+
+/* Statistics of latencies in microseconds, with a fixed-size histogram: adding
+ * a value is O(1) and doesn't allocate memory, so it can be done at each loop
+ * iteration. Percentiles have the resolution of the histogram buckets.
+ */
+
+static guint
+get_bucket (gint64 value_us)
+{
+	gint64 bucket;
+
+	if (value_us < JITTER_STATS_FINE_LIMIT_US)
+	{
+		return MAX (value_us, 0);
+	}
+
+	bucket = JITTER_STATS_FINE_LIMIT_US +
+		(value_us - JITTER_STATS_FINE_LIMIT_US) / JITTER_STATS_COARSE_STEP_US;
+
+	return MIN (bucket, JITTER_STATS_N_BUCKETS - 1);
+}
+
+/* Returns the lower bound of @bucket. */
+static gint64
+get_bucket_value (guint bucket)
+{
+	if (bucket < JITTER_STATS_FINE_LIMIT_US)
+	{
+		return bucket;
+	}
+
+	return JITTER_STATS_FINE_LIMIT_US +
+		(gint64) (bucket - JITTER_STATS_FINE_LIMIT_US) * JITTER_STATS_COARSE_STEP_US;
+}
+
+void
+jitter_stats_reset (JitterStats *stats)
+{
+	memset (stats, 0, sizeof (JitterStats));
+}
+
+void
+jitter_stats_add (JitterStats *stats,
+		  gint64       value_us)
+{
+	stats->buckets[get_bucket (value_us)]++;
+	stats->n_values++;
+	stats->sum_us += value_us;
+	stats->max_us = MAX (stats->max_us, value_us);
+}
+
+/* Returns: the nearest-rank @percentile, 0 if there are no values. */
+gint64
+jitter_stats_get_percentile (JitterStats *stats,
+			     double       percentile)
+{
+	guint64 rank;
+	guint64 count = 0;
+	guint bucket;
+
+	if (stats->n_values == 0)
+	{
+		return 0;
+	}
+
+	rank = (guint64) (percentile / 100.0 * stats->n_values + 0.999999);
+	rank = CLAMP (rank, 1, stats->n_values);
+
+	for (bucket = 0; bucket < JITTER_STATS_N_BUCKETS; bucket++)
+	{
+		count += stats->buckets[bucket];
+		if (count >= rank)
+		{
+			return MIN (get_bucket_value (bucket), stats->max_us);
+		}
+	}
+
+	return stats->max_us;
+}
+
+/* Returns: the statistics, as "key=value" lines. */
+char *
+jitter_stats_to_string (JitterStats *stats)
+{
+	return g_strdup_printf ("count=%" G_GUINT64_FORMAT "\n"
+				"mean_us=%.1lf\n"
+				"p50_us=%" G_GINT64_FORMAT "\n"
+				"p99_us=%" G_GINT64_FORMAT "\n"
+				"p99.9_us=%" G_GINT64_FORMAT "\n"
+				"max_us=%" G_GINT64_FORMAT "\n",
+				stats->n_values,
+				stats->n_values > 0 ? (double) stats->sum_us / stats->n_values : 0.0,
+				jitter_stats_get_percentile (stats, 50.0),
+				jitter_stats_get_percentile (stats, 99.0),
+				jitter_stats_get_percentile (stats, 99.9),
+				stats->max_us);
+}
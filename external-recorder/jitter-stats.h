@@ -0,0 +1,49 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_JITTER_STATS_H
+#define COSY_JITTER_STATS_H
+
+#include <glib.h>
+
+/* 1 µs resolution below 2 ms, then 100 µs resolution up to ~100 ms. */
+#define JITTER_STATS_FINE_LIMIT_US 2000
+#define JITTER_STATS_COARSE_STEP_US 100
+#define JITTER_STATS_N_BUCKETS (JITTER_STATS_FINE_LIMIT_US + 1000)
+
+typedef struct _JitterStats JitterStats;
+struct _JitterStats
+{
+	guint64 buckets[JITTER_STATS_N_BUCKETS];
+	guint64 n_values;
+	gint64 sum_us;
+	gint64 max_us;
+};
+
+void		jitter_stats_reset		(JitterStats *stats);
+
+void		jitter_stats_add		(JitterStats *stats,
+						 gint64       value_us);
+
+gint64		jitter_stats_get_percentile	(JitterStats *stats,
+						 double       percentile);
+
+char *		jitter_stats_to_string		(JitterStats *stats);
+
+#endif /* COSY_JITTER_STATS_H */
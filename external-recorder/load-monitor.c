@@ -0,0 +1,212 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "load-monitor.h"
+#include <string.h>
+
+/* Detects when external-recorder falls behind Pupil Capture, for example
+ * when Pupil Capture takes most of the CPU, so that cheaper modes can be
+ * used until the backlog is absorbed.
+ *
+ * The lag of a sample is the local monotonic time when it is decoded minus
+ * its Pupil timestamp, relative to a baseline. Both clocks run at the same
+ * rate but have a different origin, so the baseline is the minimum of the
+ * difference, i.e. when no message was waiting in the queue. It slowly
+ * increases, to follow a drift between the clocks, and is reset when the
+ * Pupil timestamps go back (Pupil Capture restarted or its time was set).
+ */
+
+/* In seconds per second. */
+#define BASELINE_DRIFT 1e-5
+
+/* A Pupil timestamp going back by more than that resets the baseline. */
+#define MAX_TIMESTAMP_JUMP_BACK_SECONDS 1.0
+
+static const char *mode_names[LOAD_N_MODES] =
+{
+	"normal",
+	"quiet",
+	"defer",
+	"decimate"
+};
+
+/* The lags are in seconds. If @enabled is %FALSE, the mode stays normal, but
+ * the baseline is still measured, it is the clock offset of the source.
+ */
+void
+load_monitor_init (LoadMonitor *monitor,
+		   gboolean     enabled,
+		   double       quiet_lag,
+		   double       defer_lag,
+		   double       decimate_lag)
+{
+	memset (monitor, 0, sizeof (LoadMonitor));
+
+	monitor->enabled = enabled != FALSE;
+	monitor->enter_lag[LOAD_MODE_NORMAL] = 0.0;
+	monitor->enter_lag[LOAD_MODE_QUIET] = quiet_lag;
+	monitor->enter_lag[LOAD_MODE_DEFER] = defer_lag;
+	monitor->enter_lag[LOAD_MODE_DECIMATE] = decimate_lag;
+
+	load_monitor_reset (monitor);
+}
+
+/* Forgets the baseline, e.g. when reconnecting to Pupil Capture. The mode
+ * and the statistics are kept.
+ */
+void
+load_monitor_reset (LoadMonitor *monitor)
+{
+	monitor->has_baseline = FALSE;
+	monitor->lag = 0.0;
+}
+
+static void
+update_baseline (LoadMonitor *monitor,
+		 double       pupil_timestamp,
+		 double       local_time)
+{
+	double offset = local_time - pupil_timestamp;
+
+	if (!monitor->has_baseline ||
+	    pupil_timestamp < monitor->last_pupil_timestamp - MAX_TIMESTAMP_JUMP_BACK_SECONDS)
+	{
+		monitor->baseline = offset;
+		monitor->has_baseline = TRUE;
+	}
+	else
+	{
+		monitor->baseline += (local_time - monitor->last_local_time) * BASELINE_DRIFT;
+		monitor->baseline = MIN (monitor->baseline, offset);
+	}
+
+	monitor->last_local_time = local_time;
+	monitor->last_pupil_timestamp = pupil_timestamp;
+
+	monitor->lag = offset - monitor->baseline;
+	monitor->max_lag = MAX (monitor->max_lag, monitor->lag);
+}
+
+/* Updates the lag with a sample decoded at @local_time, in seconds, and
+ * changes the mode if needed.
+ * Returns: whether the mode has changed.
+ */
+gboolean
+load_monitor_add_sample (LoadMonitor *monitor,
+			 double       pupil_timestamp,
+			 double       local_time)
+{
+	LoadMode old_mode = monitor->mode;
+
+	if (pupil_timestamp < 0.0)
+	{
+		return FALSE;
+	}
+
+	update_baseline (monitor, pupil_timestamp, local_time);
+
+	if (!monitor->enabled)
+	{
+		return FALSE;
+	}
+
+	while (monitor->mode < LOAD_MODE_DECIMATE &&
+	       monitor->lag > monitor->enter_lag[monitor->mode + 1])
+	{
+		monitor->mode++;
+	}
+
+	while (monitor->mode > LOAD_MODE_NORMAL &&
+	       monitor->lag < monitor->enter_lag[monitor->mode] / 2.0)
+	{
+		monitor->mode--;
+	}
+
+	monitor->n_samples_by_mode[monitor->mode]++;
+
+	if (monitor->mode != old_mode)
+	{
+		monitor->n_mode_changes++;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* @interval: one frame out of @interval is decoded while not recording, in
+ * the normal mode.
+ *
+ * The decimate mode multiplies @interval by @decimation, so that it decodes
+ * fewer frames whatever @interval: with the default idle.decode-interval of
+ * 50 and load.decimation of 4, one frame out of 200 instead of 50.
+ *
+ * Returns: the decode interval in the current mode.
+ */
+int
+load_monitor_get_decode_interval (LoadMonitor *monitor,
+				  int          interval,
+				  int          decimation)
+{
+	if (monitor->mode == LOAD_MODE_DECIMATE)
+	{
+		return interval * decimation;
+	}
+
+	return interval;
+}
+
+/* Returns: the mode, the current and maximum lags in milliseconds, the number
+ * of mode changes and the number of samples received in each mode, as
+ * "key=value" lines.
+ */
+char *
+load_monitor_to_string (LoadMonitor *monitor)
+{
+	GString *str;
+	guint mode;
+
+	str = g_string_new (NULL);
+
+	g_string_append_printf (str,
+				"mode=%s\n"
+				"lag_ms=%.1f\n"
+				"max_lag_ms=%.1f\n"
+				"mode_changes=%" G_GUINT64_FORMAT "\n",
+				load_mode_to_string (monitor->mode),
+				monitor->lag * 1000.0,
+				monitor->max_lag * 1000.0,
+				monitor->n_mode_changes);
+
+	for (mode = 0; mode < LOAD_N_MODES; mode++)
+	{
+		g_string_append_printf (str,
+					"samples_%s=%" G_GUINT64_FORMAT "\n",
+					mode_names[mode],
+					monitor->n_samples_by_mode[mode]);
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+const char *
+load_mode_to_string (LoadMode mode)
+{
+	g_return_val_if_fail (mode < LOAD_N_MODES, NULL);
+	return mode_names[mode];
+}
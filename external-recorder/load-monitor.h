@@ -0,0 +1,90 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_LOAD_MONITOR_H
+#define COSY_LOAD_MONITOR_H
+
+#include <glib.h>
+
+/* In order of increasing load, each mode includes the previous ones. */
+typedef enum
+{
+	LOAD_MODE_NORMAL,
+
+	/* The samples are not printed. */
+	LOAD_MODE_QUIET,
+
+	/* The gaze filter is run later, when the load decreases. */
+	LOAD_MODE_DEFER,
+
+	/* Only a fraction of the frames received while not recording are
+	 * decoded.
+	 */
+	LOAD_MODE_DECIMATE
+} LoadMode;
+
+#define LOAD_N_MODES (LOAD_MODE_DECIMATE + 1)
+
+typedef struct _LoadMonitor LoadMonitor;
+struct _LoadMonitor
+{
+	/* Lag above which each mode is entered, in seconds. A mode is left
+	 * when the lag goes below half of its threshold.
+	 */
+	double enter_lag[LOAD_N_MODES];
+	gboolean enabled;
+
+	/* Minimum of the local time minus the Pupil timestamp: the transport
+	 * latency plus the offset between the two clocks. Valid if
+	 * @has_baseline is set.
+	 */
+	double baseline;
+	double last_local_time;
+	double last_pupil_timestamp;
+	gboolean has_baseline;
+
+	double lag;
+	double max_lag;
+
+	LoadMode mode;
+	guint64 n_mode_changes;
+	guint64 n_samples_by_mode[LOAD_N_MODES];
+};
+
+void		load_monitor_init		(LoadMonitor *monitor,
+						 gboolean     enabled,
+						 double       quiet_lag,
+						 double       defer_lag,
+						 double       decimate_lag);
+
+void		load_monitor_reset		(LoadMonitor *monitor);
+
+gboolean	load_monitor_add_sample		(LoadMonitor *monitor,
+						 double       pupil_timestamp,
+						 double       local_time);
+
+int		load_monitor_get_decode_interval (LoadMonitor *monitor,
+						 int          interval,
+						 int          decimation);
+
+char *		load_monitor_to_string		(LoadMonitor *monitor);
+
+const char *	load_mode_to_string		(LoadMode     mode);
+
+#endif /* COSY_LOAD_MONITOR_H */
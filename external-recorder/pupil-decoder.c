@@ -0,0 +1,971 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pupil-decoder.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <msgpack.h>
+
+/* Extraction of the samples from the msgpack data of the Pupil messages.
+ *
+ * This is kept separate from the ZeroMQ code, so that it can be fed with
+ * arbitrary bytes by the conformance tests (tests/test-decoder.c) and by the
+ * fuzzer (fuzz/).
+ *
+ * The decoder doesn't fail on unexpected data: the keys that it doesn't know
+ * are ignored, and the known keys with an unexpected type are reported with a
+ * warning and skipped. Since such a message is usually sent at the frame rate,
+ * only the first warnings are logged.
+ */
+
+struct _PupilDecoder
+{
+	/* Reused for each message. */
+	msgpack_unpacked unpacked;
+
+	guint64 n_warnings;
+	guint max_warnings;
+
+	guint debug : 1;
+};
+
+/* Pupil Capture is written in Python, where a float field sometimes holds an
+ * int, for example 0 when a detector fails. So all the number types are
+ * accepted for the float values.
+ */
+static gboolean
+get_number (const msgpack_object *obj,
+	    double               *number)
+{
+	switch (obj->type)
+	{
+		case MSGPACK_OBJECT_FLOAT:
+#if MSGPACK_VERSION_MAJOR >= 2
+		case MSGPACK_OBJECT_FLOAT32:
+#endif
+			*number = obj->via.f64;
+			return TRUE;
+
+		case MSGPACK_OBJECT_POSITIVE_INTEGER:
+			*number = obj->via.u64;
+			return TRUE;
+
+		case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+			*number = obj->via.i64;
+			return TRUE;
+
+		default:
+			break;
+	}
+
+	return FALSE;
+}
+
+/* Prototypes */
+static gboolean extract_info_from_msgpack_map (PupilDecoder   *decoder,
+					       Data           *data,
+					       msgpack_object *obj,
+					       Topic           topic);
+
+PupilDecoder *
+pupil_decoder_new (void)
+{
+	PupilDecoder *decoder;
+
+	decoder = g_new0 (PupilDecoder, 1);
+	msgpack_unpacked_init (&decoder->unpacked);
+	decoder->max_warnings = PUPIL_DECODER_DEFAULT_MAX_WARNINGS;
+
+	return decoder;
+}
+
+void
+pupil_decoder_free (PupilDecoder *decoder)
+{
+	if (decoder != NULL)
+	{
+		msgpack_unpacked_destroy (&decoder->unpacked);
+		g_free (decoder);
+	}
+}
+
+/* If @debug is TRUE, the msgpack objects are printed on stdout. */
+void
+pupil_decoder_set_debug (PupilDecoder *decoder,
+			 gboolean      debug)
+{
+	decoder->debug = debug != FALSE;
+}
+
+/* Sets the number of warnings that are logged, 0 to only count them. */
+void
+pupil_decoder_set_max_warnings (PupilDecoder *decoder,
+				guint         max_warnings)
+{
+	decoder->max_warnings = max_warnings;
+}
+
+/* Returns: the number of warnings since the creation of @decoder, including
+ * those that have not been logged.
+ */
+guint64
+pupil_decoder_get_n_warnings (PupilDecoder *decoder)
+{
+	return decoder->n_warnings;
+}
+
+Topic
+pupil_decoder_determine_topic (const char *topic_str)
+{
+	if (topic_str == NULL)
+	{
+		return TOPIC_OTHER;
+	}
+
+	if (g_str_has_prefix (topic_str, "gaze"))
+	{
+		return TOPIC_GAZE;
+	}
+
+	if (g_str_has_prefix (topic_str, "pupil"))
+	{
+		return TOPIC_PUPIL;
+	}
+
+	return TOPIC_OTHER;
+}
+
+static void decoder_warning (PupilDecoder *decoder,
+			     const char   *format,
+			     ...) G_GNUC_PRINTF (2, 3);
+
+static void
+decoder_warning (PupilDecoder *decoder,
+		 const char   *format,
+		 ...)
+{
+	va_list args;
+
+	decoder->n_warnings++;
+
+	if (decoder->n_warnings > decoder->max_warnings)
+	{
+		return;
+	}
+
+	va_start (args, format);
+	g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, format, args);
+	va_end (args);
+
+	if (decoder->n_warnings == decoder->max_warnings)
+	{
+		g_warning ("msgpack: too many warnings, the next ones will not be shown.");
+	}
+}
+
+/* Exact comparison: a key that is only a prefix of @name (or the empty key)
+ * must not match.
+ */
+static gboolean
+key_equals (const msgpack_object_str *key_str,
+	    const char               *name)
+{
+	return (key_str->size == strlen (name) &&
+		memcmp (key_str->ptr, name, key_str->size) == 0);
+}
+
+/* Returns whether something has been extracted. */
+static gboolean
+extract_info_from_msgpack_key_value (PupilDecoder      *decoder,
+				     Data              *data,
+				     msgpack_object_kv *key_value,
+				     Topic              topic)
+{
+	msgpack_object *key;
+	msgpack_object *value;
+	msgpack_object_str *key_str;
+
+	key = &key_value->key;
+	value = &key_value->val;
+
+	if (key->type != MSGPACK_OBJECT_STR)
+	{
+		decoder_warning (decoder,
+				 "msgpack: expected a string for the key in a key_value pair, "
+				 "got type=%d instead.",
+				 key->type);
+		return FALSE;
+	}
+
+	key_str = &key->via.str;
+	if (key_str->ptr == NULL)
+	{
+		return FALSE;
+	}
+
+	if (key_equals (key_str, "topic"))
+	{
+		msgpack_object_str *str;
+		char *topic_str;
+
+		if (value->type != MSGPACK_OBJECT_STR)
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected a string for the topic value, "
+					 "got type=%d instead.",
+					 value->type);
+			return FALSE;
+		}
+
+		str = &value->via.str;
+		/* The pointer can be NULL for an empty string. */
+		topic_str = str->ptr != NULL ? g_strndup (str->ptr, str->size) : g_strdup ("");
+
+		/* Sanity checking */
+		if (topic == TOPIC_GAZE &&
+		    !g_str_has_prefix (topic_str, "gaze"))
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected gaze topic, "
+					 "got '%s' instead.",
+					 topic_str);
+		}
+		else if (topic == TOPIC_PUPIL &&
+			 !g_str_has_prefix (topic_str, "pupil"))
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected pupil topic, "
+					 "got '%s' instead.",
+					 topic_str);
+		}
+
+		g_free (topic_str);
+
+		/* Nothing was extracted into the @data struct. */
+		return FALSE;
+	}
+
+	if (topic == TOPIC_GAZE &&
+	    key_equals (key_str, "base_data"))
+	{
+		msgpack_object_array *array;
+		msgpack_object *element;
+
+		if (value->type != MSGPACK_OBJECT_ARRAY)
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected an array for the base_data value, "
+					 "got type=%d instead.",
+					 value->type);
+			return FALSE;
+		}
+
+		array = &value->via.array;
+
+		if (array->size == 0)
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected 1 element in the base_data array, "
+					 "got 0 elements instead.");
+			return FALSE;
+		}
+
+		if (array->size > 1)
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected 1 element in the base_data array, "
+					 "got %d elements instead. Only the first element "
+					 "will be taken into account.",
+					 array->size);
+		}
+
+		element = &array->ptr[0];
+		return extract_info_from_msgpack_map (decoder, data, element, TOPIC_PUPIL);
+	}
+
+	if (topic == TOPIC_PUPIL &&
+	    key_equals (key_str, "timestamp"))
+	{
+		if (!get_number (value, &data->timestamp))
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected a number for the timestamp value, "
+					 "got type=%d instead.",
+					 value->type);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	if (topic == TOPIC_PUPIL &&
+	    key_equals (key_str, "diameter"))
+	{
+		if (!get_number (value, &data->pupil_diameter))
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected a number for the diameter value, "
+					 "got type=%d instead.",
+					 value->type);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	if (key_equals (key_str, "confidence"))
+	{
+		double confidence;
+
+		if (!get_number (value, &confidence))
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected a number for the confidence value, "
+					 "got type=%d instead.",
+					 value->type);
+			return FALSE;
+		}
+
+		switch (topic)
+		{
+			case TOPIC_PUPIL:
+				data->pupil_confidence = confidence;
+				return TRUE;
+
+			case TOPIC_GAZE:
+				data->gaze_confidence = confidence;
+				return TRUE;
+
+			case TOPIC_OTHER:
+			default:
+				g_warn_if_reached ();
+				break;
+		}
+
+		return FALSE;
+	}
+
+	if (key_equals (key_str, "norm_pos"))
+	{
+		msgpack_object_array *array;
+		msgpack_object *first_element;
+		msgpack_object *second_element;
+		double x;
+		double y;
+
+		if (value->type != MSGPACK_OBJECT_ARRAY)
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected an array for the norm_pos value, "
+					 "got type=%d instead.",
+					 value->type);
+			return FALSE;
+		}
+
+		array = &value->via.array;
+
+		if (array->size != 2)
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected 2 elements in the norm_pos array, "
+					 "got %d elements instead.",
+					 array->size);
+			return FALSE;
+		}
+
+		first_element = &array->ptr[0];
+		second_element = &array->ptr[1];
+
+		if (!get_number (first_element, &x) ||
+		    !get_number (second_element, &y))
+		{
+			decoder_warning (decoder,
+					 "msgpack: expected number elements in the norm_pos array, "
+					 "got types %d and %d instead.",
+					 first_element->type,
+					 second_element->type);
+			return FALSE;
+		}
+
+		switch (topic)
+		{
+			case TOPIC_PUPIL:
+				data->pupil_norm_pos_x = x;
+				data->pupil_norm_pos_y = y;
+				return TRUE;
+
+			case TOPIC_GAZE:
+				data->gaze_norm_pos_x = x;
+				data->gaze_norm_pos_y = y;
+				return TRUE;
+
+			case TOPIC_OTHER:
+			default:
+				g_warn_if_reached ();
+				break;
+		}
+
+		return FALSE;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+extract_info_from_msgpack_map (PupilDecoder   *decoder,
+			       Data           *data,
+			       msgpack_object *obj,
+			       Topic           topic)
+{
+	msgpack_object_map *map;
+	uint32_t kv_num;
+	gboolean something_extracted = FALSE;
+
+	if (obj->type != MSGPACK_OBJECT_MAP)
+	{
+		decoder_warning (decoder,
+				 "msgpack: expected a map, got type=%d instead.",
+				 obj->type);
+		return FALSE;
+	}
+
+	map = &obj->via.map;
+
+	for (kv_num = 0; kv_num < map->size; kv_num++)
+	{
+		msgpack_object_kv *key_value;
+
+		key_value = &map->ptr[kv_num];
+
+		if (extract_info_from_msgpack_key_value (decoder, data, key_value, topic))
+		{
+			something_extracted = TRUE;
+		}
+	}
+
+	return something_extracted;
+}
+
+/* Decodes the msgpack data of a gaze message. @data is initialized with
+ * data_init() first, so the fields that are not present in the message are
+ * set to -1.
+ */
+PupilDecoderResult
+pupil_decoder_decode_gaze (PupilDecoder *decoder,
+			   const void   *buffer,
+			   gsize         size,
+			   Data         *data)
+{
+	msgpack_unpack_return unpack_ret;
+	msgpack_object *obj;
+	size_t offset = 0;
+
+	data_init (data);
+
+	unpack_ret = msgpack_unpack_next (&decoder->unpacked, buffer, size, &offset);
+	if (unpack_ret != MSGPACK_UNPACK_SUCCESS)
+	{
+		decoder_warning (decoder,
+				 "msgpack: unpacking failed. The Pupil message "
+				 "received was apparently not packed with msgpack.");
+		return PUPIL_DECODER_RESULT_INVALID;
+	}
+
+	obj = &decoder->unpacked.data;
+
+	if (decoder->debug)
+	{
+		g_print ("msgpack data: ");
+		msgpack_object_print (stdout, *obj);
+		g_print ("\n");
+	}
+
+	if (extract_info_from_msgpack_map (decoder, data, obj, TOPIC_GAZE))
+	{
+		return PUPIL_DECODER_RESULT_EXTRACTED;
+	}
+
+	return PUPIL_DECODER_RESULT_NOTHING;
+}
+
+/* Timestamp peeking.
+ *
+ * Reading only the timestamp of a message is much cheaper than unpacking it:
+ * the msgpack bytes are walked in place, without building the objects and
+ * without allocating memory, and the values before the timestamp are skipped
+ * over. This is used for the frames that are not decoded.
+ */
+
+typedef struct _Reader Reader;
+struct _Reader
+{
+	const guint8 *pos;
+	const guint8 *end;
+};
+
+static gboolean
+read_uint (Reader  *reader,
+	   guint    n_bytes,
+	   guint64 *value)
+{
+	guint byte_num;
+
+	if ((gsize) (reader->end - reader->pos) < n_bytes)
+	{
+		return FALSE;
+	}
+
+	*value = 0;
+	for (byte_num = 0; byte_num < n_bytes; byte_num++)
+	{
+		*value = (*value << 8) | reader->pos[byte_num];
+	}
+
+	reader->pos += n_bytes;
+	return TRUE;
+}
+
+static gboolean
+skip_bytes (Reader  *reader,
+	    guint64  n_bytes)
+{
+	if ((guint64) (reader->end - reader->pos) < n_bytes)
+	{
+		return FALSE;
+	}
+
+	reader->pos += n_bytes;
+	return TRUE;
+}
+
+/* Skips one object, containers included. It is iterative, with a count of the
+ * objects left to skip, so a deep nesting can't overflow the stack.
+ */
+static gboolean
+skip_object (Reader *reader)
+{
+	guint64 n_objects = 1;
+
+	while (n_objects > 0)
+	{
+		guint8 type;
+		guint64 length;
+
+		/* Each object takes at least one byte. */
+		if ((guint64) (reader->end - reader->pos) < n_objects)
+		{
+			return FALSE;
+		}
+
+		type = *reader->pos++;
+		n_objects--;
+
+		if (type <= 0x7f || type >= 0xe0 || type == 0xc0 || type == 0xc2 || type == 0xc3)
+		{
+			/* fixint, nil, bool */
+			continue;
+		}
+
+		if (type <= 0x8f)
+		{
+			n_objects += 2 * (type & 0x0f);
+			continue;
+		}
+
+		if (type <= 0x9f)
+		{
+			n_objects += type & 0x0f;
+			continue;
+		}
+
+		if (type <= 0xbf)
+		{
+			if (!skip_bytes (reader, type & 0x1f))
+			{
+				return FALSE;
+			}
+			continue;
+		}
+
+		switch (type)
+		{
+			/* bin 8/16/32 */
+			case 0xc4:
+			case 0xc5:
+			case 0xc6:
+				if (!read_uint (reader, 1 << (type - 0xc4), &length) ||
+				    !skip_bytes (reader, length))
+				{
+					return FALSE;
+				}
+				break;
+
+			/* str 8/16/32 */
+			case 0xd9:
+			case 0xda:
+			case 0xdb:
+				if (!read_uint (reader, 1 << (type - 0xd9), &length) ||
+				    !skip_bytes (reader, length))
+				{
+					return FALSE;
+				}
+				break;
+
+			/* ext 8/16/32: length, type, data */
+			case 0xc7:
+			case 0xc8:
+			case 0xc9:
+				if (!read_uint (reader, 1 << (type - 0xc7), &length) ||
+				    !skip_bytes (reader, length + 1))
+				{
+					return FALSE;
+				}
+				break;
+
+			/* float 32/64 */
+			case 0xca:
+				if (!skip_bytes (reader, 4))
+				{
+					return FALSE;
+				}
+				break;
+
+			case 0xcb:
+				if (!skip_bytes (reader, 8))
+				{
+					return FALSE;
+				}
+				break;
+
+			/* uint 8/16/32/64 */
+			case 0xcc:
+			case 0xcd:
+			case 0xce:
+			case 0xcf:
+				if (!skip_bytes (reader, 1 << (type - 0xcc)))
+				{
+					return FALSE;
+				}
+				break;
+
+			/* int 8/16/32/64 */
+			case 0xd0:
+			case 0xd1:
+			case 0xd2:
+			case 0xd3:
+				if (!skip_bytes (reader, 1 << (type - 0xd0)))
+				{
+					return FALSE;
+				}
+				break;
+
+			/* fixext 1/2/4/8/16: type, data */
+			case 0xd4:
+			case 0xd5:
+			case 0xd6:
+			case 0xd7:
+			case 0xd8:
+				if (!skip_bytes (reader, 1 + (1 << (type - 0xd4))))
+				{
+					return FALSE;
+				}
+				break;
+
+			/* array 16/32 */
+			case 0xdc:
+			case 0xdd:
+				if (!read_uint (reader, type == 0xdc ? 2 : 4, &length))
+				{
+					return FALSE;
+				}
+				n_objects += length;
+				break;
+
+			/* map 16/32 */
+			case 0xde:
+			case 0xdf:
+				if (!read_uint (reader, type == 0xde ? 2 : 4, &length))
+				{
+					return FALSE;
+				}
+				n_objects += 2 * length;
+				break;
+
+			/* 0xc1 is never used. */
+			default:
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Reads the header of a map (@map is %TRUE) or of an array. */
+static gboolean
+read_container (Reader   *reader,
+		gboolean  map,
+		guint64  *length)
+{
+	guint8 fix_type = map ? 0x80 : 0x90;
+	guint8 type_16 = map ? 0xde : 0xdc;
+	guint8 type;
+
+	if (reader->pos == reader->end)
+	{
+		return FALSE;
+	}
+
+	type = *reader->pos++;
+
+	if ((type & 0xf0) == fix_type)
+	{
+		*length = type & 0x0f;
+		return TRUE;
+	}
+
+	if (type == type_16)
+	{
+		return read_uint (reader, 2, length);
+	}
+
+	if (type == type_16 + 1)
+	{
+		return read_uint (reader, 4, length);
+	}
+
+	return FALSE;
+}
+
+/* Reads a map key. If it is a string, *@equals is whether it is @name,
+ * another type is skipped.
+ */
+static gboolean
+read_key (Reader     *reader,
+	  const char *name,
+	  gboolean   *equals)
+{
+	guint8 type;
+	guint64 length;
+
+	*equals = FALSE;
+
+	if (reader->pos == reader->end)
+	{
+		return FALSE;
+	}
+
+	type = *reader->pos;
+
+	if ((type & 0xe0) == 0xa0)
+	{
+		reader->pos++;
+		length = type & 0x1f;
+	}
+	else if (type >= 0xd9 && type <= 0xdb)
+	{
+		reader->pos++;
+		if (!read_uint (reader, 1 << (type - 0xd9), &length))
+		{
+			return FALSE;
+		}
+	}
+	else
+	{
+		return skip_object (reader);
+	}
+
+	if ((guint64) (reader->end - reader->pos) < length)
+	{
+		return FALSE;
+	}
+
+	*equals = (length == strlen (name) &&
+		   memcmp (reader->pos, name, length) == 0);
+	reader->pos += length;
+	return TRUE;
+}
+
+/* Like get_number(). */
+static gboolean
+read_number (Reader *reader,
+	     double *number)
+{
+	guint8 type;
+	guint64 bits;
+
+	if (reader->pos == reader->end)
+	{
+		return FALSE;
+	}
+
+	type = *reader->pos++;
+
+	if (type <= 0x7f)
+	{
+		*number = type;
+		return TRUE;
+	}
+
+	if (type >= 0xe0)
+	{
+		*number = (gint8) type;
+		return TRUE;
+	}
+
+	switch (type)
+	{
+		case 0xca:
+		{
+			guint32 bits_32;
+			float value;
+
+			if (!read_uint (reader, 4, &bits))
+			{
+				return FALSE;
+			}
+
+			bits_32 = bits;
+			memcpy (&value, &bits_32, sizeof (float));
+			*number = value;
+			return TRUE;
+		}
+
+		case 0xcb:
+			if (!read_uint (reader, 8, &bits))
+			{
+				return FALSE;
+			}
+
+			memcpy (number, &bits, sizeof (double));
+			return TRUE;
+
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			if (!read_uint (reader, 1 << (type - 0xcc), &bits))
+			{
+				return FALSE;
+			}
+
+			*number = bits;
+			return TRUE;
+
+		case 0xd0:
+		case 0xd1:
+		case 0xd2:
+		case 0xd3:
+		{
+			guint n_bytes = 1 << (type - 0xd0);
+			guint shift = 64 - 8 * n_bytes;
+
+			if (!read_uint (reader, n_bytes, &bits))
+			{
+				return FALSE;
+			}
+
+			/* Sign extension. */
+			*number = (gint64) (bits << shift) >> shift;
+			return TRUE;
+		}
+
+		default:
+			break;
+	}
+
+	return FALSE;
+}
+
+/* Reads the timestamp of the first element of the base_data array of a gaze
+ * message, which is the timestamp that pupil_decoder_decode_gaze() extracts,
+ * without decoding the message. If a key is duplicated, the first one is
+ * used. It doesn't warn.
+ * Returns: whether the timestamp has been found.
+ */
+gboolean
+pupil_decoder_peek_timestamp (const void *buffer,
+			      gsize       size,
+			      double     *timestamp)
+{
+	Reader reader;
+	guint64 n_pairs;
+	guint64 pair_num;
+	guint64 n_pupil_pairs;
+	guint64 pupil_pair_num;
+
+	reader.pos = buffer;
+	reader.end = reader.pos + size;
+
+	if (!read_container (&reader, TRUE, &n_pairs))
+	{
+		return FALSE;
+	}
+
+	for (pair_num = 0; pair_num < n_pairs; pair_num++)
+	{
+		gboolean is_base_data;
+		guint64 n_elements;
+
+		if (!read_key (&reader, "base_data", &is_base_data))
+		{
+			return FALSE;
+		}
+
+		if (!is_base_data)
+		{
+			if (!skip_object (&reader))
+			{
+				return FALSE;
+			}
+			continue;
+		}
+
+		if (!read_container (&reader, FALSE, &n_elements) ||
+		    n_elements == 0 ||
+		    !read_container (&reader, TRUE, &n_pupil_pairs))
+		{
+			return FALSE;
+		}
+
+		for (pupil_pair_num = 0; pupil_pair_num < n_pupil_pairs; pupil_pair_num++)
+		{
+			gboolean is_timestamp;
+
+			if (!read_key (&reader, "timestamp", &is_timestamp))
+			{
+				return FALSE;
+			}
+
+			if (is_timestamp)
+			{
+				return read_number (&reader, timestamp);
+			}
+
+			if (!skip_object (&reader))
+			{
+				return FALSE;
+			}
+		}
+
+		return FALSE;
+	}
+
+	return FALSE;
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_PUPIL_DECODER_H
+#define COSY_PUPIL_DECODER_H
+
+#include <glib.h>
+#include "data.h"
+
+/* Number of warnings logged by default, the next ones are only counted. */
+#define PUPIL_DECODER_DEFAULT_MAX_WARNINGS 20
+
+typedef enum
+{
+	/* The message is not valid msgpack data. */
+	PUPIL_DECODER_RESULT_INVALID,
+
+	/* Valid msgpack data, but nothing has been extracted. */
+	PUPIL_DECODER_RESULT_NOTHING,
+
+	PUPIL_DECODER_RESULT_EXTRACTED
+} PupilDecoderResult;
+
+/* Determined from the prefix of the topic of a Pupil message. */
+typedef enum
+{
+	TOPIC_PUPIL,
+	TOPIC_GAZE,
+	TOPIC_OTHER
+} Topic;
+
+typedef struct _PupilDecoder PupilDecoder;
+
+PupilDecoder *		pupil_decoder_new		(void);
+
+void			pupil_decoder_free		(PupilDecoder *decoder);
+
+void			pupil_decoder_set_debug		(PupilDecoder *decoder,
+							 gboolean      debug);
+
+void			pupil_decoder_set_max_warnings	(PupilDecoder *decoder,
+							 guint         max_warnings);
+
+guint64			pupil_decoder_get_n_warnings	(PupilDecoder *decoder);
+
+Topic			pupil_decoder_determine_topic	(const char   *topic_str);
+
+PupilDecoderResult	pupil_decoder_decode_gaze	(PupilDecoder *decoder,
+							 const void   *buffer,
+							 gsize         size,
+							 Data         *data);
+
+gboolean		pupil_decoder_peek_timestamp	(const void   *buffer,
+							 gsize         size,
+							 double       *timestamp);
+
+#endif /* COSY_PUPIL_DECODER_H */
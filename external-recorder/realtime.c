@@ -0,0 +1,249 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "realtime.h"
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+/* Opt-in real-time tuning of the process, for a workstation shared with Pupil
+ * Capture, which saturates the cores with its detection pipeline.
+ *
+ * The functions must be called before creating the ZeroMQ context: the
+ * ZeroMQ I/O thread inherits the CPU affinity and the scheduling policy of
+ * the thread that creates it, and it is part of the ingest path. The other
+ * threads, like the export, would compete with the main loop on its CPUs and
+ * at its priority, so they call realtime_reset_thread() first.
+ */
+
+/* The stack size prefaulted by realtime_prefault_stack(). */
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+G_DEFINE_QUARK (realtime-error-quark, realtime_error)
+
+/* The state before the tuning, for realtime_reset_thread(). Written before
+ * the other threads are created, read-only afterwards.
+ */
+static gboolean original_affinity_saved = FALSE;
+static cpu_set_t original_affinity;
+static gboolean fifo_priority_set = FALSE;
+
+/* Parses a list of CPUs like "2,3" or "0-1,4".
+ * @cpus: (out): a new GArray of ints.
+ */
+gboolean
+realtime_parse_cpu_list (const char  *cpu_list,
+			 GArray     **cpus,
+			 GError     **error)
+{
+	char **ranges;
+	guint i;
+
+	*cpus = g_array_new (FALSE, FALSE, sizeof (int));
+	ranges = g_strsplit (cpu_list, ",", -1);
+
+	for (i = 0; ranges[i] != NULL; i++)
+	{
+		char *range = g_strstrip (ranges[i]);
+		char *end = NULL;
+		gint64 first;
+		gint64 last;
+		int cpu;
+
+		first = g_ascii_strtoll (range, &end, 10);
+		last = first;
+
+		if (end != range && *end == '-')
+		{
+			char *start = end + 1;
+
+			last = g_ascii_strtoll (start, &end, 10);
+			if (end == start)
+			{
+				end = range;
+			}
+		}
+
+		if (end == range || *end != '\0' ||
+		    first < 0 || last < first || last >= CPU_SETSIZE)
+		{
+			g_set_error (error,
+				     REALTIME_ERROR,
+				     REALTIME_ERROR_INVALID_CPU_LIST,
+				     "Invalid CPU list \"%s\": expected CPU numbers "
+				     "or ranges separated by commas, like \"2,3\" or \"0-1\".",
+				     cpu_list);
+
+			g_strfreev (ranges);
+			g_array_free (*cpus, TRUE);
+			*cpus = NULL;
+			return FALSE;
+		}
+
+		for (cpu = first; cpu <= last; cpu++)
+		{
+			g_array_append_val (*cpus, cpu);
+		}
+	}
+
+	g_strfreev (ranges);
+	return TRUE;
+}
+
+/* Pins the calling thread to the CPUs of @cpu_list. */
+gboolean
+realtime_set_cpu_affinity (const char  *cpu_list,
+			   GError     **error)
+{
+	GArray *cpus;
+	cpu_set_t cpu_set;
+	guint i;
+
+	if (!realtime_parse_cpu_list (cpu_list, &cpus, error))
+	{
+		return FALSE;
+	}
+
+	CPU_ZERO (&cpu_set);
+
+	for (i = 0; i < cpus->len; i++)
+	{
+		CPU_SET (g_array_index (cpus, int, i), &cpu_set);
+	}
+
+	g_array_free (cpus, TRUE);
+
+	if (!original_affinity_saved &&
+	    sched_getaffinity (0, sizeof (original_affinity), &original_affinity) == 0)
+	{
+		original_affinity_saved = TRUE;
+	}
+
+	if (sched_setaffinity (0, sizeof (cpu_set), &cpu_set) != 0)
+	{
+		int saved_errno = errno;
+
+		g_set_error (error,
+			     REALTIME_ERROR,
+			     REALTIME_ERROR_FAILED,
+			     "Failed to set the CPU affinity to \"%s\": %s",
+			     cpu_list,
+			     g_strerror (saved_errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Sets the SCHED_FIFO scheduling policy for the calling thread. It needs the
+ * CAP_SYS_NICE capability (or root, or a sufficient RLIMIT_RTPRIO).
+ */
+gboolean
+realtime_set_fifo_priority (int      priority,
+			    GError **error)
+{
+	struct sched_param param;
+
+	memset (&param, 0, sizeof (param));
+	param.sched_priority = priority;
+
+	if (sched_setscheduler (0, SCHED_FIFO, &param) != 0)
+	{
+		int saved_errno = errno;
+
+		g_set_error (error,
+			     REALTIME_ERROR,
+			     REALTIME_ERROR_FAILED,
+			     "Failed to set the SCHED_FIFO priority %d: %s",
+			     priority,
+			     g_strerror (saved_errno));
+		return FALSE;
+	}
+
+	fifo_priority_set = TRUE;
+	return TRUE;
+}
+
+/* Gives back to the calling thread the CPU affinity and the default
+ * scheduling policy that the process had before the tuning. For the threads
+ * that are not on the ingest path. Failures are only logged: the thread still
+ * works, with the tuning of the main loop.
+ */
+void
+realtime_reset_thread (void)
+{
+	struct sched_param param;
+
+	if (fifo_priority_set)
+	{
+		memset (&param, 0, sizeof (param));
+
+		if (sched_setscheduler (0, SCHED_OTHER, &param) != 0)
+		{
+			g_warning ("Failed to reset the scheduling policy of a thread: %s",
+				   g_strerror (errno));
+		}
+	}
+
+	if (original_affinity_saved &&
+	    sched_setaffinity (0, sizeof (original_affinity), &original_affinity) != 0)
+	{
+		g_warning ("Failed to reset the CPU affinity of a thread: %s",
+			   g_strerror (errno));
+	}
+}
+
+/* Locks the current and future memory of the process in RAM, so that the
+ * ingest path never waits for a page fault. Needs CAP_IPC_LOCK or a sufficient
+ * RLIMIT_MEMLOCK.
+ */
+gboolean
+realtime_lock_memory (GError **error)
+{
+	if (mlockall (MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		int saved_errno = errno;
+
+		g_set_error (error,
+			     REALTIME_ERROR,
+			     REALTIME_ERROR_FAILED,
+			     "Failed to lock the memory: %s",
+			     g_strerror (saved_errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Touches the stack pages that the main loop can use, so that they are
+ * mapped (and locked, with realtime_lock_memory()) before recording.
+ */
+void
+realtime_prefault_stack (void)
+{
+	volatile char stack[PREFAULT_STACK_SIZE];
+	gsize i;
+
+	for (i = 0; i < sizeof (stack); i += 4096)
+	{
+		stack[i] = 0;
+	}
+}
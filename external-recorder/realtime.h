@@ -0,0 +1,51 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_REALTIME_H
+#define COSY_REALTIME_H
+
+#include <glib.h>
+
+#define REALTIME_ERROR (realtime_error_quark ())
+
+typedef enum
+{
+	REALTIME_ERROR_INVALID_CPU_LIST,
+	REALTIME_ERROR_FAILED
+} RealtimeError;
+
+GQuark		realtime_error_quark		(void);
+
+gboolean	realtime_parse_cpu_list		(const char  *cpu_list,
+						 GArray     **cpus,
+						 GError     **error);
+
+gboolean	realtime_set_cpu_affinity	(const char  *cpu_list,
+						 GError     **error);
+
+gboolean	realtime_set_fifo_priority	(int          priority,
+						 GError     **error);
+
+gboolean	realtime_lock_memory		(GError     **error);
+
+void		realtime_reset_thread		(void);
+
+void		realtime_prefault_stack		(void);
+
+#endif /* COSY_REALTIME_H */
@@ -0,0 +1,527 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sample-store.h"
+#include <string.h>
+
+/* The recorded samples.
+ *
+ * The samples are stored by value in fixed-size chunks, so that appending a
+ * sample doesn't allocate memory (except when a new chunk is needed) and
+ * never moves the samples already stored. The chunks for @capacity samples
+ * are allocated when the store is created, and they are kept when the store
+ * is cleared, so that no allocation happens while recording, as long as the
+ * capacity is not exceeded. If it is exceeded, the store grows by one chunk at
+ * a time, no samples are lost.
+ *
+ * The samples are kept until the store is cleared, or until the chunks of
+ * the oldest ones are discarded with sample_store_discard_before(), so
+ * several readers can read them: receive_data, time-range and trial queries,
+ * etc. The indexes are absolute: they don't change when the oldest samples
+ * are discarded, the first index is then no longer 0. The discarded chunks
+ * are reused at the end of the store, so the memory stays bounded by the
+ * samples kept.
+ *
+ * Indexes:
+ * - The samples arrive in the order of their Pupil timestamps, so the store
+ *   itself is a sorted timestamp index, and a time range is found with a
+ *   binary search. If a sample arrives out of order (it should not happen),
+ *   the store is marked as unsorted and the lookups fall back to linear
+ *   scans. The range they return then contains all the samples of the time
+ *   range, but also others, so the readers must check the timestamps.
+ * - The trials (start/stop pairs) are kept in an array, with their range of
+ *   sample indexes.
+ *
+ * Threads: the store is modified only by the main thread, which can read it
+ * without locking. Other threads (e.g. the export) read it with
+ * sample_store_copy(), for a range of samples that the main thread doesn't
+ * modify anymore (the main thread must not clear the store in the meantime).
+ * The only shared mutable state is then the array of chunks, which is
+ * reallocated when a chunk is added, so it is protected by @lock. The
+ * exception is sample_store_update(), which also writes under @lock, so that
+ * a copy sees each sample either entirely before or entirely after the
+ * update.
+ */
+
+struct _SampleStore
+{
+	/* Data[SAMPLE_STORE_CHUNK_SIZE] elements. The first one contains the
+	 * samples from the index @first_chunk * SAMPLE_STORE_CHUNK_SIZE.
+	 */
+	GPtrArray *chunks;
+	guint first_chunk;
+
+	/* The number of chunks allocated when the store is created. */
+	guint n_initial_chunks;
+
+	/* The index after the last sample. */
+	guint n_samples;
+
+	GMutex lock;
+
+	/* SampleStoreTrial elements, in chronological order. */
+	GArray *trials;
+
+	double last_timestamp;
+	guint sorted : 1;
+};
+
+SampleStore *
+sample_store_new (guint capacity)
+{
+	SampleStore *store;
+	guint n_chunks;
+	guint chunk_num;
+
+	n_chunks = (capacity + SAMPLE_STORE_CHUNK_SIZE - 1) / SAMPLE_STORE_CHUNK_SIZE;
+
+	store = g_new0 (SampleStore, 1);
+	store->chunks = g_ptr_array_new_with_free_func (g_free);
+	g_mutex_init (&store->lock);
+	store->trials = g_array_new (FALSE, FALSE, sizeof (SampleStoreTrial));
+	store->sorted = TRUE;
+	store->n_initial_chunks = n_chunks;
+
+	for (chunk_num = 0; chunk_num < n_chunks; chunk_num++)
+	{
+		g_ptr_array_add (store->chunks, g_new (Data, SAMPLE_STORE_CHUNK_SIZE));
+	}
+
+	return store;
+}
+
+void
+sample_store_free (SampleStore *store)
+{
+	if (store == NULL)
+	{
+		return;
+	}
+
+	g_ptr_array_free (store->chunks, TRUE);
+	g_mutex_clear (&store->lock);
+	g_array_free (store->trials, TRUE);
+	g_free (store);
+}
+
+void
+sample_store_append (SampleStore *store,
+		     const Data  *data)
+{
+	guint chunk_num;
+	Data *chunk;
+
+	chunk_num = store->n_samples / SAMPLE_STORE_CHUNK_SIZE - store->first_chunk;
+
+	if (chunk_num == store->chunks->len)
+	{
+		Data *new_chunk = g_new (Data, SAMPLE_STORE_CHUNK_SIZE);
+
+		g_mutex_lock (&store->lock);
+		g_ptr_array_add (store->chunks, new_chunk);
+		g_mutex_unlock (&store->lock);
+	}
+
+	chunk = g_ptr_array_index (store->chunks, chunk_num);
+	chunk[store->n_samples % SAMPLE_STORE_CHUNK_SIZE] = *data;
+
+	if (store->n_samples > 0 &&
+	    data->timestamp < store->last_timestamp &&
+	    store->sorted)
+	{
+		g_warning ("Sample received out of order (timestamp %lf after %lf). "
+			   "Time-range queries will be slower.",
+			   data->timestamp,
+			   store->last_timestamp);
+		store->sorted = FALSE;
+	}
+
+	store->last_timestamp = MAX (store->last_timestamp, data->timestamp);
+	store->n_samples++;
+}
+
+/* Returns: the index after the last sample. */
+guint
+sample_store_get_length (SampleStore *store)
+{
+	return store->n_samples;
+}
+
+/* Returns: the index of the oldest sample still in the store. */
+guint
+sample_store_get_first (SampleStore *store)
+{
+	return store->first_chunk * SAMPLE_STORE_CHUNK_SIZE;
+}
+
+const Data *
+sample_store_get (SampleStore *store,
+		  guint        index)
+{
+	Data *chunk;
+
+	g_return_val_if_fail (index >= sample_store_get_first (store), NULL);
+	g_return_val_if_fail (index < store->n_samples, NULL);
+
+	chunk = g_ptr_array_index (store->chunks, index / SAMPLE_STORE_CHUNK_SIZE - store->first_chunk);
+	return &chunk[index % SAMPLE_STORE_CHUNK_SIZE];
+}
+
+/* Copies @n_samples samples from @begin to @dest. Can be called from another
+ * thread than the main thread, see the threads note above.
+ * Returns: the number of samples copied.
+ */
+guint
+sample_store_copy (SampleStore *store,
+		   guint        begin,
+		   guint        n_samples,
+		   Data        *dest)
+{
+	guint n_copied = 0;
+
+	g_mutex_lock (&store->lock);
+
+	while (n_copied < n_samples)
+	{
+		guint index = begin + n_copied;
+		guint chunk_num = index / SAMPLE_STORE_CHUNK_SIZE;
+		guint offset = index % SAMPLE_STORE_CHUNK_SIZE;
+		guint n;
+		Data *chunk;
+
+		if (chunk_num < store->first_chunk ||
+		    chunk_num - store->first_chunk >= store->chunks->len)
+		{
+			break;
+		}
+
+		chunk_num -= store->first_chunk;
+
+		n = MIN (n_samples - n_copied, SAMPLE_STORE_CHUNK_SIZE - offset);
+		chunk = g_ptr_array_index (store->chunks, chunk_num);
+		memcpy (dest + n_copied, chunk + offset, n * sizeof (Data));
+		n_copied += n;
+	}
+
+	g_mutex_unlock (&store->lock);
+
+	return n_copied;
+}
+
+/* Overwrites @n_samples samples from @begin with @src, for example to add
+ * values computed later. The samples must already be in the store.
+ */
+void
+sample_store_update (SampleStore *store,
+		     guint        begin,
+		     guint        n_samples,
+		     const Data  *src)
+{
+	guint n_updated = 0;
+
+	g_return_if_fail (begin >= sample_store_get_first (store));
+	g_return_if_fail (begin + n_samples <= store->n_samples);
+
+	g_mutex_lock (&store->lock);
+
+	while (n_updated < n_samples)
+	{
+		guint index = begin + n_updated;
+		guint offset = index % SAMPLE_STORE_CHUNK_SIZE;
+		guint n;
+		Data *chunk;
+
+		n = MIN (n_samples - n_updated, SAMPLE_STORE_CHUNK_SIZE - offset);
+		chunk = g_ptr_array_index (store->chunks, index / SAMPLE_STORE_CHUNK_SIZE - store->first_chunk);
+		memcpy (chunk + offset, src + n_updated, n * sizeof (Data));
+		n_updated += n;
+	}
+
+	g_mutex_unlock (&store->lock);
+}
+
+/* Writes to all the allocated chunks, so that their pages are mapped before
+ * recording, instead of page-faulting in the ingest path.
+ */
+void
+sample_store_prefault (SampleStore *store)
+{
+	guint chunk_num;
+
+	for (chunk_num = 0; chunk_num < store->chunks->len; chunk_num++)
+	{
+		memset (g_ptr_array_index (store->chunks, chunk_num),
+			0,
+			SAMPLE_STORE_CHUNK_SIZE * sizeof (Data));
+	}
+}
+
+/* Removes all the samples and the trials, but keeps the memory. If a trial is
+ * not ended, it is kept and restarts at the beginning of the store.
+ */
+void
+sample_store_clear (SampleStore *store)
+{
+	SampleStoreTrial *last_trial = NULL;
+
+	if (store->trials->len > 0)
+	{
+		last_trial = &g_array_index (store->trials, SampleStoreTrial, store->trials->len - 1);
+	}
+
+	if (last_trial != NULL && last_trial->end == G_MAXUINT)
+	{
+		SampleStoreTrial open_trial = *last_trial;
+
+		open_trial.begin = 0;
+		g_array_set_size (store->trials, 0);
+		g_array_append_val (store->trials, open_trial);
+	}
+	else
+	{
+		g_array_set_size (store->trials, 0);
+	}
+
+	store->n_samples = 0;
+	store->first_chunk = 0;
+	store->last_timestamp = 0.0;
+	store->sorted = TRUE;
+}
+
+/* Discards the chunks containing only samples before @index, e.g. the
+ * samples already returned by receive_data. The samples of the chunk
+ * containing @index are kept. No other thread must read the discarded
+ * samples. The chunks are reused for the next samples, or freed if the store
+ * has grown beyond its initial capacity. The trials ended before the first
+ * sample kept are discarded too, so that they don't pile up.
+ */
+void
+sample_store_discard_before (SampleStore *store,
+			     guint        index)
+{
+	guint n_chunks;
+	guint chunk_num;
+	guint n_trials;
+
+	index = MIN (index, store->n_samples);
+
+	if (index / SAMPLE_STORE_CHUNK_SIZE <= store->first_chunk)
+	{
+		return;
+	}
+
+	n_chunks = index / SAMPLE_STORE_CHUNK_SIZE - store->first_chunk;
+
+	g_mutex_lock (&store->lock);
+
+	for (chunk_num = 0; chunk_num < n_chunks; chunk_num++)
+	{
+		gpointer *chunks = store->chunks->pdata;
+		guint last = store->chunks->len - 1;
+		gpointer chunk = chunks[0];
+
+		/* Moves the chunk to the end. */
+		memmove (chunks, chunks + 1, last * sizeof (gpointer));
+		chunks[last] = chunk;
+
+		if (store->chunks->len > store->n_initial_chunks)
+		{
+			/* Frees it. */
+			g_ptr_array_remove_index (store->chunks, last);
+		}
+	}
+
+	store->first_chunk += n_chunks;
+
+	g_mutex_unlock (&store->lock);
+
+	/* The trials are in chronological order. */
+	n_trials = 0;
+	while (n_trials < store->trials->len &&
+	       g_array_index (store->trials, SampleStoreTrial, n_trials).end <=
+	       store->first_chunk * SAMPLE_STORE_CHUNK_SIZE)
+	{
+		n_trials++;
+	}
+
+	if (n_trials > 0)
+	{
+		g_array_remove_range (store->trials, 0, n_trials);
+	}
+}
+
+static double
+get_timestamp (SampleStore *store,
+	       guint        index)
+{
+	return sample_store_get (store, index)->timestamp;
+}
+
+/* Returns: the index of the first sample with a timestamp greater than or
+ * equal to @timestamp, or the length of the store if there is none. With
+ * sample_store_upper_bound(), it gives the range of the samples of a time
+ * range. If the store is unsorted, the range can also contain samples outside
+ * of the time range, see sample_store_in_time_range().
+ */
+guint
+sample_store_lower_bound (SampleStore *store,
+			  double       timestamp)
+{
+	guint low = sample_store_get_first (store);
+	guint high = store->n_samples;
+
+	if (!store->sorted)
+	{
+		for (; low < store->n_samples; low++)
+		{
+			if (get_timestamp (store, low) >= timestamp)
+			{
+				break;
+			}
+		}
+
+		return low;
+	}
+
+	while (low < high)
+	{
+		guint middle = low + (high - low) / 2;
+
+		if (get_timestamp (store, middle) < timestamp)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/* Returns: the index after the last sample with a timestamp lower than or
+ * equal to @timestamp, or the first index if there is none.
+ */
+guint
+sample_store_upper_bound (SampleStore *store,
+			  double       timestamp)
+{
+	guint first = sample_store_get_first (store);
+	guint low = first;
+	guint high = store->n_samples;
+
+	if (!store->sorted)
+	{
+		for (high = store->n_samples; high > first; high--)
+		{
+			if (get_timestamp (store, high - 1) <= timestamp)
+			{
+				break;
+			}
+		}
+
+		return high;
+	}
+
+	while (low < high)
+	{
+		guint middle = low + (high - low) / 2;
+
+		if (get_timestamp (store, middle) <= timestamp)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/* Returns: whether @data is in the time range [@t0, @t1]. Needed for the
+ * samples between sample_store_lower_bound() and sample_store_upper_bound()
+ * only if the store is unsorted, but it is cheap.
+ */
+gboolean
+sample_store_in_time_range (const Data *data,
+			    double      t0,
+			    double      t1)
+{
+	return data->timestamp >= t0 && data->timestamp <= t1;
+}
+
+/* Begins a trial at the current end of the store. */
+void
+sample_store_begin_trial (SampleStore *store,
+			  gint64       id)
+{
+	SampleStoreTrial trial;
+
+	sample_store_end_trial (store);
+
+	trial.id = id;
+	trial.begin = store->n_samples;
+	trial.end = G_MAXUINT;
+
+	g_array_append_val (store->trials, trial);
+}
+
+/* Ends the current trial, if any, at the current end of the store. */
+void
+sample_store_end_trial (SampleStore *store)
+{
+	SampleStoreTrial *trial;
+
+	if (store->trials->len == 0)
+	{
+		return;
+	}
+
+	trial = &g_array_index (store->trials, SampleStoreTrial, store->trials->len - 1);
+	if (trial->end == G_MAXUINT)
+	{
+		trial->end = store->n_samples;
+	}
+}
+
+/* Returns: the latest trial with @id, or %NULL. If the trial is not ended,
+ * its @end is G_MAXUINT.
+ */
+const SampleStoreTrial *
+sample_store_find_trial (SampleStore *store,
+			 gint64       id)
+{
+	guint i;
+
+	for (i = store->trials->len; i > 0; i--)
+	{
+		const SampleStoreTrial *trial;
+
+		trial = &g_array_index (store->trials, SampleStoreTrial, i - 1);
+		if (trial->id == id)
+		{
+			return trial;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_SAMPLE_STORE_H
+#define COSY_SAMPLE_STORE_H
+
+#include <glib.h>
+#include "data.h"
+
+/* Number of samples per chunk: 256 KiB. */
+#define SAMPLE_STORE_CHUNK_SIZE 4096
+
+typedef struct _SampleStore SampleStore;
+
+/* A trial is the range [begin, end) of sample indexes recorded between a
+ * start and a stop. @end is G_MAXUINT while the trial is not ended.
+ */
+typedef struct _SampleStoreTrial SampleStoreTrial;
+struct _SampleStoreTrial
+{
+	gint64 id;
+	guint begin;
+	guint end;
+};
+
+SampleStore *	sample_store_new		(guint        capacity);
+
+void		sample_store_free		(SampleStore *store);
+
+void		sample_store_append		(SampleStore *store,
+						 const Data  *data);
+
+guint		sample_store_get_length		(SampleStore *store);
+
+guint		sample_store_get_first		(SampleStore *store);
+
+const Data *	sample_store_get		(SampleStore *store,
+						 guint        index);
+
+guint		sample_store_copy		(SampleStore *store,
+						 guint        begin,
+						 guint        n_samples,
+						 Data        *dest);
+
+void		sample_store_update		(SampleStore *store,
+						 guint        begin,
+						 guint        n_samples,
+						 const Data  *src);
+
+void		sample_store_clear		(SampleStore *store);
+
+void		sample_store_discard_before	(SampleStore *store,
+						 guint        index);
+
+void		sample_store_prefault		(SampleStore *store);
+
+guint		sample_store_lower_bound	(SampleStore *store,
+						 double       timestamp);
+
+guint		sample_store_upper_bound	(SampleStore *store,
+						 double       timestamp);
+
+gboolean	sample_store_in_time_range	(const Data  *data,
+						 double       t0,
+						 double       t1);
+
+void		sample_store_begin_trial	(SampleStore *store,
+						 gint64       id);
+
+void		sample_store_end_trial		(SampleStore *store);
+
+const SampleStoreTrial *
+		sample_store_find_trial		(SampleStore *store,
+						 gint64       id);
+
+#endif /* COSY_SAMPLE_STORE_H */
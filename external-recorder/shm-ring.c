@@ -0,0 +1,404 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shm-ring.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+/* A ring buffer of samples in POSIX shared memory, for the consumers running
+ * on the same computer as external-recorder (a live plot, a logger...),
+ * without the ZeroMQ and serialization costs.
+ *
+ * The memory contains a ShmRingHeader of 128 bytes, followed by n_slots
+ * ShmRingSlot of 128 bytes (two cache lines). external-recorder is the only
+ * writer, and writes each decoded sample in the next slot, overwriting the
+ * oldest one. Each slot is protected by a sequence lock, so that the readers
+ * never block the writer:
+ *
+ * Writer, for the sample number i:
+ * 1. slot->sequence = 2 * i + 1 (odd: being written);
+ * 2. write slot->flags and slot->values;
+ * 3. slot->sequence = 2 * i + 2 (release);
+ * 4. header->write_index = i + 1 (release).
+ *
+ * Reader, for the sample number i (with i < write_index):
+ * 1. s1 = slot->sequence (acquire);
+ * 2. if s1 != 2 * i + 2, the sample is being written or has been
+ *    overwritten (the reader is more than n_slots samples late);
+ * 3. copy slot->flags and slot->values;
+ * 4. s2 = slot->sequence (after an acquire fence);
+ * 5. if s1 != s2, the copy is torn, the sample has been overwritten.
+ *
+ * The shared memory is removed when external-recorder quits. While it runs,
+ * external-recorder holds an flock() on the memory, which the kernel releases
+ * if it crashes: a memory without lock is stale.
+ */
+
+#define HEADER_SIZE (sizeof (ShmRingHeader))
+
+G_STATIC_ASSERT (sizeof (ShmRingHeader) == 128);
+G_STATIC_ASSERT (sizeof (ShmRingSlot) == 128);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (ShmRingHeader, write_index) == 64);
+
+struct _ShmRing
+{
+	char *name;
+
+	ShmRingHeader *header;
+	ShmRingSlot *slots;
+	gsize size;
+	guint64 mask;
+
+	/* Only for the writer. @fd is kept open for the lock. */
+	guint64 next_index;
+	int fd;
+
+	guint owner : 1;
+};
+
+G_DEFINE_QUARK (shm-ring-error-quark, shm_ring_error)
+
+static void
+set_error_from_errno (GError     **error,
+		      const char  *action,
+		      const char  *name)
+{
+	int saved_errno = errno;
+
+	g_set_error (error,
+		     SHM_RING_ERROR,
+		     0,
+		     "Error when %s the shared memory %s: %s",
+		     action,
+		     name,
+		     g_strerror (saved_errno));
+}
+
+/* Removes the shared memory @name if it is a ring left by a crashed
+ * external-recorder. A ring still locked can have readers mapped to it, and a
+ * memory with another format may belong to another program, so they are kept.
+ * Returns: whether @name has been removed.
+ */
+static gboolean
+remove_if_stale (const char *name)
+{
+	ShmRingHeader header;
+	gboolean removed = FALSE;
+	int fd;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd == -1)
+	{
+		return FALSE;
+	}
+
+	/* Removed with the lock held, so that another external-recorder
+	 * starting at the same time doesn't see it as stale too.
+	 */
+	if (flock (fd, LOCK_EX | LOCK_NB) == 0 &&
+	    read (fd, &header, sizeof (header)) == sizeof (header) &&
+	    header.magic == SHM_RING_MAGIC)
+	{
+		removed = shm_unlink (name) == 0;
+	}
+
+	close (fd);
+	return removed;
+}
+
+/* Creates the shared memory @name (like "/cosy-pupil"). If it already exists,
+ * it is replaced only if it is stale.
+ */
+ShmRing *
+shm_ring_new (const char  *name,
+	      guint        n_slots,
+	      GError     **error)
+{
+	ShmRing *ring;
+	gsize size;
+	void *memory;
+	int fd;
+
+	if (n_slots == 0 || (n_slots & (n_slots - 1)) != 0)
+	{
+		g_set_error (error,
+			     SHM_RING_ERROR,
+			     0,
+			     "The number of slots of the shared memory must be a power of two, "
+			     "not %u.",
+			     n_slots);
+		return NULL;
+	}
+
+	size = HEADER_SIZE + (gsize) n_slots * sizeof (ShmRingSlot);
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd == -1 && errno == EEXIST)
+	{
+		if (!remove_if_stale (name))
+		{
+			g_set_error (error,
+				     SHM_RING_ERROR,
+				     0,
+				     "The shared memory %s is already used by another "
+				     "external-recorder or program, choose another shm.name.",
+				     name);
+			return NULL;
+		}
+
+		g_warning ("Removed the shared memory %s left by a crashed external-recorder.",
+			   name);
+		fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+
+	if (fd == -1)
+	{
+		set_error_from_errno (error, "creating", name);
+		return NULL;
+	}
+
+	/* Nobody else has the memory yet, it can't fail. */
+	flock (fd, LOCK_EX | LOCK_NB);
+
+	if (ftruncate (fd, size) != 0)
+	{
+		set_error_from_errno (error, "resizing", name);
+		close (fd);
+		shm_unlink (name);
+		return NULL;
+	}
+
+	memory = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (memory == MAP_FAILED)
+	{
+		set_error_from_errno (error, "mapping", name);
+		close (fd);
+		shm_unlink (name);
+		return NULL;
+	}
+
+	ring = g_new0 (ShmRing, 1);
+	ring->name = g_strdup (name);
+	ring->header = memory;
+	ring->slots = (ShmRingSlot *) ((guint8 *) memory + HEADER_SIZE);
+	ring->size = size;
+	ring->mask = n_slots - 1;
+	ring->fd = fd;
+	ring->owner = TRUE;
+
+	/* The memory is zero-filled by ftruncate(), and touching it now avoids
+	 * the page faults when writing the samples.
+	 */
+	memset (memory, 0, size);
+
+	ring->header->header_size = HEADER_SIZE;
+	ring->header->slot_size = sizeof (ShmRingSlot);
+	ring->header->n_slots = n_slots;
+	ring->header->n_columns = DATA_N_FIELDS;
+	ring->header->version = SHM_RING_VERSION;
+
+	/* Last, so that a reader sees a complete header. */
+	__atomic_store_n (&ring->header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+	return ring;
+}
+
+/* Opens an existing shared memory read-only, for a reader. */
+ShmRing *
+shm_ring_open (const char  *name,
+	       GError     **error)
+{
+	ShmRing *ring;
+	ShmRingHeader *header;
+	struct stat st;
+	void *memory;
+	int fd;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd == -1)
+	{
+		set_error_from_errno (error, "opening", name);
+		return NULL;
+	}
+
+	if (fstat (fd, &st) != 0)
+	{
+		set_error_from_errno (error, "opening", name);
+		close (fd);
+		return NULL;
+	}
+
+	if ((gsize) st.st_size < HEADER_SIZE)
+	{
+		g_set_error (error,
+			     SHM_RING_ERROR,
+			     0,
+			     "The shared memory %s is too small.",
+			     name);
+		close (fd);
+		return NULL;
+	}
+
+	memory = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (memory == MAP_FAILED)
+	{
+		set_error_from_errno (error, "mapping", name);
+		return NULL;
+	}
+
+	header = memory;
+
+	if (__atomic_load_n (&header->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+	    header->version != SHM_RING_VERSION ||
+	    header->header_size != HEADER_SIZE ||
+	    header->slot_size != sizeof (ShmRingSlot) ||
+	    header->n_columns != DATA_N_FIELDS ||
+	    HEADER_SIZE + (gsize) header->n_slots * sizeof (ShmRingSlot) > (gsize) st.st_size)
+	{
+		g_set_error (error,
+			     SHM_RING_ERROR,
+			     0,
+			     "The shared memory %s has an unknown format.",
+			     name);
+		munmap (memory, st.st_size);
+		return NULL;
+	}
+
+	ring = g_new0 (ShmRing, 1);
+	ring->name = g_strdup (name);
+	ring->header = header;
+	ring->slots = (ShmRingSlot *) ((guint8 *) memory + HEADER_SIZE);
+	ring->size = st.st_size;
+	ring->mask = header->n_slots - 1;
+	ring->fd = -1;
+	ring->owner = FALSE;
+
+	return ring;
+}
+
+/* Unmaps the shared memory, and removes it if @ring has been created with
+ * shm_ring_new().
+ */
+void
+shm_ring_free (ShmRing *ring)
+{
+	if (ring == NULL)
+	{
+		return;
+	}
+
+	munmap (ring->header, ring->size);
+
+	if (ring->owner)
+	{
+		shm_unlink (ring->name);
+		close (ring->fd);
+	}
+
+	g_free (ring->name);
+	g_free (ring);
+}
+
+void
+shm_ring_write (ShmRing    *ring,
+		const Data *data,
+		gboolean    recording)
+{
+	guint64 index = ring->next_index++;
+	ShmRingSlot *slot = &ring->slots[index & ring->mask];
+	guint field_num;
+
+	g_assert (ring->owner);
+
+	__atomic_store_n (&slot->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	slot->flags = recording ? SHM_RING_FLAG_RECORDING : 0;
+
+	for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+	{
+		slot->values[field_num] = DATA_FIELD_VALUE (data, field_num);
+	}
+
+	__atomic_store_n (&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+	__atomic_store_n (&ring->header->write_index, index + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns: the number of samples written since the creation. The last one is
+ * the number write_index - 1.
+ */
+guint64
+shm_ring_get_write_index (ShmRing *ring)
+{
+	return __atomic_load_n (&ring->header->write_index, __ATOMIC_ACQUIRE);
+}
+
+/* Reads the sample number @index.
+ * Returns: %FALSE if the sample is not written yet, or has been overwritten
+ * (the reader is too late).
+ */
+gboolean
+shm_ring_read (ShmRing *ring,
+	       guint64  index,
+	       Data    *data,
+	       guint64 *flags)
+{
+	const ShmRingSlot *slot = &ring->slots[index & ring->mask];
+	guint64 expected_sequence = 2 * index + 2;
+	guint64 sequence;
+	guint64 slot_flags;
+	double values[DATA_N_FIELDS];
+	guint field_num;
+
+	sequence = __atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE);
+	if (sequence != expected_sequence)
+	{
+		return FALSE;
+	}
+
+	slot_flags = slot->flags;
+	memcpy (values, slot->values, sizeof (values));
+
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	if (__atomic_load_n (&slot->sequence, __ATOMIC_RELAXED) != expected_sequence)
+	{
+		return FALSE;
+	}
+
+	for (field_num = 0; field_num < DATA_N_FIELDS; field_num++)
+	{
+		DATA_FIELD_VALUE (data, field_num) = values[field_num];
+	}
+
+	if (flags != NULL)
+	{
+		*flags = slot_flags;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,104 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_SHM_RING_H
+#define COSY_SHM_RING_H
+
+#include <glib.h>
+#include "data.h"
+
+/* Layout of the shared memory, see shm-ring.c. All the integers and doubles
+ * are in the native byte order (little-endian on x86).
+ */
+
+#define SHM_RING_MAGIC 0x4d485343 /* "CSHM" */
+#define SHM_RING_VERSION 1
+
+#define SHM_RING_FLAG_RECORDING (1 << 0)
+
+typedef struct _ShmRingHeader ShmRingHeader;
+struct _ShmRingHeader
+{
+	guint32 magic;
+	guint32 version;
+
+	/* Offset of the first slot, from the beginning of the memory. */
+	guint32 header_size;
+
+	guint32 slot_size;
+
+	/* A power of two. */
+	guint32 n_slots;
+
+	/* Number of values in a slot, in the order of data_fields. */
+	guint32 n_columns;
+
+	guint8 padding1[40];
+
+	/* Number of samples written since the creation, on its own cache
+	 * line. The sample number i is in the slot i % n_slots.
+	 */
+	guint64 write_index;
+
+	guint8 padding2[56];
+};
+
+typedef struct _ShmRingSlot ShmRingSlot;
+struct _ShmRingSlot
+{
+	/* 2 * (i + 1) once the sample number i is written, odd while it is
+	 * being written.
+	 */
+	guint64 sequence;
+
+	/* SHM_RING_FLAG_* */
+	guint64 flags;
+
+	double values[DATA_N_FIELDS];
+
+	guint8 padding[128 - 16 - DATA_N_FIELDS * sizeof (double)];
+};
+
+#define SHM_RING_ERROR (shm_ring_error_quark ())
+
+typedef struct _ShmRing ShmRing;
+
+GQuark		shm_ring_error_quark		(void);
+
+ShmRing *	shm_ring_new			(const char  *name,
+						 guint        n_slots,
+						 GError     **error);
+
+ShmRing *	shm_ring_open			(const char  *name,
+						 GError     **error);
+
+void		shm_ring_free			(ShmRing     *ring);
+
+void		shm_ring_write			(ShmRing     *ring,
+						 const Data  *data,
+						 gboolean     recording);
+
+guint64		shm_ring_get_write_index	(ShmRing     *ring);
+
+gboolean	shm_ring_read			(ShmRing     *ring,
+						 guint64      index,
+						 Data        *data,
+						 guint64     *flags);
+
+#endif /* COSY_SHM_RING_H */
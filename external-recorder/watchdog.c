@@ -0,0 +1,107 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "watchdog.h"
+#include <string.h>
+
+/* The watchdog of external-recorder compares a few quantities to their
+ * latency budget, so that the experiment scripts can know that the data are
+ * degraded before collecting them, instead of finding missing samples
+ * afterwards.
+ *
+ * The alarm of a check is raised as soon as a value exceeds the budget, and
+ * cleared at the end of the first window (between two heartbeats) without
+ * any value over the budget. So a jitter alarm stays visible during at least
+ * one heartbeat, and a budget exceeded regularly doesn't toggle the alarm at
+ * each value.
+ */
+
+void
+watchdog_check_init (WatchdogCheck *check,
+		     gint64         budget_us)
+{
+	memset (check, 0, sizeof (WatchdogCheck));
+	check->budget_us = budget_us;
+}
+
+/* Returns: %TRUE if the alarm has just been raised. */
+gboolean
+watchdog_check_add (WatchdogCheck *check,
+		    gint64         value_us)
+{
+	check->last_us = value_us;
+	check->window_max_us = MAX (check->window_max_us, value_us);
+
+	if (check->budget_us == 0 ||
+	    value_us <= check->budget_us)
+	{
+		return FALSE;
+	}
+
+	check->n_over_budget++;
+	check->window_over_budget = TRUE;
+
+	if (check->alarm)
+	{
+		return FALSE;
+	}
+
+	check->alarm = TRUE;
+	check->n_alarms++;
+	return TRUE;
+}
+
+/* Returns: %TRUE if the alarm has just been cleared. */
+gboolean
+watchdog_check_end_window (WatchdogCheck *check)
+{
+	gboolean cleared;
+
+	cleared = check->alarm && !check->window_over_budget;
+	if (cleared)
+	{
+		check->alarm = FALSE;
+	}
+
+	check->window_max_us = 0;
+	check->window_over_budget = FALSE;
+
+	return cleared;
+}
+
+/* Appends "<name>_<field>=<value>" lines to @str. */
+void
+watchdog_check_append_to_string (WatchdogCheck *check,
+				 const char    *name,
+				 GString       *str)
+{
+	g_string_append_printf (str,
+				"%s_us=%" G_GINT64_FORMAT "\n"
+				"%s_window_max_us=%" G_GINT64_FORMAT "\n"
+				"%s_budget_us=%" G_GINT64_FORMAT "\n"
+				"%s_over_budget=%" G_GUINT64_FORMAT "\n"
+				"%s_alarms=%" G_GUINT64_FORMAT "\n"
+				"%s_alarm=%s\n",
+				name, check->last_us,
+				name, check->window_max_us,
+				name, check->budget_us,
+				name, check->n_over_budget,
+				name, check->n_alarms,
+				name, check->alarm ? "true" : "false");
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COSY_WATCHDOG_H
+#define COSY_WATCHDOG_H
+
+#include <glib.h>
+
+/* A quantity compared to a latency budget, e.g. the time since the last
+ * Pupil frame. The values are in microseconds.
+ */
+typedef struct _WatchdogCheck WatchdogCheck;
+struct _WatchdogCheck
+{
+	/* 0 if the check is disabled: the values are still recorded, but
+	 * the alarm is never raised.
+	 */
+	gint64 budget_us;
+
+	gint64 last_us;
+
+	/* Max since the end of the last window (the last heartbeat). */
+	gint64 window_max_us;
+	gboolean window_over_budget;
+
+	guint64 n_over_budget;
+	guint64 n_alarms;
+	gboolean alarm;
+};
+
+void		watchdog_check_init		(WatchdogCheck *check,
+						 gint64         budget_us);
+
+gboolean	watchdog_check_add		(WatchdogCheck *check,
+						 gint64         value_us);
+
+gboolean	watchdog_check_end_window	(WatchdogCheck *check);
+
+void		watchdog_check_append_to_string	(WatchdogCheck *check,
+						 const char    *name,
+						 GString       *str);
+
+#endif /* COSY_WATCHDOG_H */
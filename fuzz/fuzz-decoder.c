@@ -0,0 +1,117 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fuzz target for the decoder of the Pupil messages, see the README.
+ *
+ * It can be built with libFuzzer (clang -fsanitize=fuzzer), or as a normal
+ * program that decodes the files given as arguments, or stdin, which is what
+ * AFL runs.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "pupil-decoder.h"
+
+int LLVMFuzzerTestOneInput (const uint8_t *buffer,
+			    size_t         size);
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *buffer,
+			size_t         size)
+{
+	static PupilDecoder *decoder = NULL;
+	Data data;
+	double timestamp;
+
+	if (decoder == NULL)
+	{
+		decoder = pupil_decoder_new ();
+		pupil_decoder_set_max_warnings (decoder, 0);
+	}
+
+	pupil_decoder_decode_gaze (decoder, buffer, size, &data);
+	pupil_decoder_peek_timestamp (buffer, size, &timestamp);
+	return 0;
+}
+
+#ifndef FUZZ_WITH_LIBFUZZER
+
+static gboolean
+decode_stream (FILE *stream)
+{
+	GByteArray *content;
+	guint8 chunk[4096];
+	size_t n_bytes;
+	gboolean ok;
+
+	content = g_byte_array_new ();
+
+	while ((n_bytes = fread (chunk, 1, sizeof (chunk), stream)) > 0)
+	{
+		g_byte_array_append (content, chunk, n_bytes);
+	}
+
+	ok = !ferror (stream);
+	if (ok)
+	{
+		LLVMFuzzerTestOneInput (content->data, content->len);
+	}
+
+	g_byte_array_free (content, TRUE);
+	return ok;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+	int arg_num;
+
+	if (argc < 2)
+	{
+		return decode_stream (stdin) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	for (arg_num = 1; arg_num < argc; arg_num++)
+	{
+		FILE *file;
+
+		file = fopen (argv[arg_num], "rb");
+		if (file == NULL)
+		{
+			g_printerr ("Failed to open %s.\n", argv[arg_num]);
+			return EXIT_FAILURE;
+		}
+
+		if (!decode_stream (file))
+		{
+			g_printerr ("Failed to read %s.\n", argv[arg_num]);
+			fclose (file);
+			return EXIT_FAILURE;
+		}
+
+		fclose (file);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif /* FUZZ_WITH_LIBFUZZER */
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+#
+# Generates the seed corpus of the decoder fuzzer, from the messages in
+# external-recorder/sample-pupil-msgpack-data (printed by
+# msgpack_object_print()) and from variants of them.
+#
+# Usage: ./make-corpus.py [output-dir]
+#
+# Only the Python standard library is needed, the msgpack encoding is done
+# here. Python ints are packed as msgpack integers and Python floats as
+# float64, like Pupil Capture does.
+
+import ast
+import copy
+import os
+import re
+import struct
+import sys
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+SAMPLE_FILE = os.path.join(SCRIPT_DIR, '..', 'external-recorder',
+                           'sample-pupil-msgpack-data')
+
+
+def pack(obj, float32=False):
+    if obj is None:
+        return b'\xc0'
+    if obj is True:
+        return b'\xc3'
+    if obj is False:
+        return b'\xc2'
+    if isinstance(obj, int):
+        if 0 <= obj < 0x80:
+            return struct.pack('B', obj)
+        if -32 <= obj < 0:
+            return struct.pack('b', obj)
+        if obj >= 0:
+            return b'\xcf' + struct.pack('>Q', obj)
+        return b'\xd3' + struct.pack('>q', obj)
+    if isinstance(obj, float):
+        if float32:
+            return b'\xca' + struct.pack('>f', obj)
+        return b'\xcb' + struct.pack('>d', obj)
+    if isinstance(obj, str):
+        data = obj.encode('utf-8')
+        if len(data) < 32:
+            return struct.pack('B', 0xa0 | len(data)) + data
+        return b'\xd9' + struct.pack('B', len(data)) + data
+    if isinstance(obj, list):
+        if len(obj) < 16:
+            header = struct.pack('B', 0x90 | len(obj))
+        else:
+            header = b'\xdc' + struct.pack('>H', len(obj))
+        return header + b''.join(pack(item, float32) for item in obj)
+    if isinstance(obj, dict):
+        if len(obj) < 16:
+            header = struct.pack('B', 0x80 | len(obj))
+        else:
+            header = b'\xde' + struct.pack('>H', len(obj))
+        return header + b''.join(pack(key, float32) + pack(value, float32)
+                                 for key, value in obj.items())
+    raise TypeError('Unsupported type: %r' % type(obj))
+
+
+def read_sample_messages():
+    """Returns a list of (topic, message) pairs."""
+    with open(SAMPLE_FILE) as f:
+        content = f.read()
+
+    messages = []
+    for block in re.split(r'\n\s*\n', content.strip()):
+        topic, _, text = block.partition('\n')
+        text = text.replace('=>', ':')
+        messages.append((topic.strip(), ast.literal_eval(text)))
+    return messages
+
+
+def to_int(obj):
+    """Replaces the floats that are integral by ints."""
+    if isinstance(obj, float) and obj.is_integer():
+        return int(obj)
+    if isinstance(obj, list):
+        return [to_int(item) for item in obj]
+    if isinstance(obj, dict):
+        return {key: to_int(value) for key, value in obj.items()}
+    return obj
+
+
+def variants(gaze):
+    yield 'gaze-float32', gaze, True
+
+    yield 'gaze-int-fields', to_int(gaze), False
+
+    message = copy.deepcopy(gaze)
+    for key in ('timestamp', 'diameter'):
+        del message['base_data'][0][key]
+    del message['confidence']
+    yield 'gaze-missing-keys', message, False
+
+    message = copy.deepcopy(gaze)
+    del message['base_data']
+    yield 'gaze-no-base-data', message, False
+
+    message = copy.deepcopy(gaze)
+    second_eye = copy.deepcopy(message['base_data'][0])
+    second_eye['id'] = 1
+    second_eye['timestamp'] += 0.001
+    message['base_data'].append(second_eye)
+    yield 'gaze-binocular', message, False
+
+    message = copy.deepcopy(gaze)
+    message['topic'] = 'gaze.3d.01.'
+    message['base_data'][0]['topic'] = 'pupil.0'
+    yield 'gaze-newer-topics', message, False
+
+    message = copy.deepcopy(gaze)
+    message['norm_pos'] = [0.5, 0.5, 0.5]
+    message['confidence'] = 'high'
+    message['base_data'][0]['timestamp'] = None
+    yield 'gaze-wrong-types', message, False
+
+
+def main():
+    output_dir = sys.argv[1] if len(sys.argv) > 1 else \
+        os.path.join(SCRIPT_DIR, 'corpus')
+    os.makedirs(output_dir, exist_ok=True)
+
+    seeds = []
+    gaze = None
+    for topic, message in read_sample_messages():
+        name = topic.replace('.', '-')
+        seeds.append((name, pack(message)))
+        if topic == 'gaze':
+            gaze = message
+            gaze_data = pack(message)
+
+    for name, message, float32 in variants(gaze):
+        seeds.append((name, pack(message, float32)))
+
+    seeds.append(('gaze-truncated', gaze_data[:len(gaze_data) // 2]))
+
+    for name, data in seeds:
+        with open(os.path.join(output_dir, name + '.msgpack'), 'wb') as f:
+            f.write(data)
+        print('%s: %d bytes' % (name, len(data)))
+
+
+if __name__ == '__main__':
+    main()
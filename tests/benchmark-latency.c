@@ -0,0 +1,748 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* End-to-end latency benchmark for external-recorder.
+ *
+ * The benchmark plays two roles:
+ * - A simulated Pupil Capture (optional, enabled by default): a Pupil Remote
+ *   replier on PUPIL_REMOTE_ENDPOINT and a publisher sending gaze messages at
+ *   a configurable rate, in a separate thread. The gaze messages have the same
+ *   msgpack layout as the ones sent by Pupil Capture 0.9.3 (see
+ *   external-recorder/sample-pupil-msgpack-data).
+ * - A cosy-pupil-client: it sends thousands of requests to external-recorder
+ *   and measures the round-trip time of each request type.
+ *
+ * When the simulated Pupil Capture is used, the timestamp of each gaze message
+ * is the monotonic clock of this computer, so it's also possible to measure the
+ * sample-arrival-to-availability latency: the time between the moment a sample
+ * is published and the moment it is readable by the client with the
+ * receive_data request.
+ *
+ * external-recorder must be started after the benchmark when the simulated
+ * Pupil Capture is used, since it asks the SUB_PORT at startup.
+ *
+ * With --curve-server-key and --curve-client-key, the requests are encrypted
+ * with CURVE, to compare the latencies with and without it on the same
+ * computers.
+ */
+
+#include <glib.h>
+#include <zmq.h>
+#include <msgpack.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "curve.h"
+
+#define PUPIL_REMOTE_ENDPOINT "tcp://*:50020"
+
+typedef struct _Samples Samples;
+struct _Samples
+{
+	const char *name;
+
+	/* Latencies in microseconds. */
+	GArray *values;
+};
+
+typedef struct _Simulator Simulator;
+struct _Simulator
+{
+	void *context;
+	GThread *thread;
+	int pub_port;
+	double rate_hz;
+	volatile gint quit;
+	guint64 n_published;
+};
+
+static char *endpoint = "tcp://localhost:6000";
+static int n_iterations = 2000;
+static double gaze_rate_hz = 200.0;
+static int pub_port = 50021;
+static double availability_duration_s = 10.0;
+static gboolean no_simulator = FALSE;
+static gboolean block = FALSE;
+static char *curve_server_key_file = NULL;
+static char *curve_client_key_file = NULL;
+
+static GOptionEntry entries[] =
+{
+	{ "endpoint", 'e', 0, G_OPTION_ARG_STRING, &endpoint,
+	  "external-recorder endpoint (default: tcp://localhost:6000)", "ENDPOINT" },
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &n_iterations,
+	  "Number of start/stop/receive_data/status cycles (default: 2000)", "N" },
+	{ "gaze-rate", 'r', 0, G_OPTION_ARG_DOUBLE, &gaze_rate_hz,
+	  "Rate of the simulated gaze messages, in Hz (default: 200)", "HZ" },
+	{ "pub-port", 'p', 0, G_OPTION_ARG_INT, &pub_port,
+	  "Port of the simulated Pupil publisher (default: 50021)", "PORT" },
+	{ "availability-duration", 'd', 0, G_OPTION_ARG_DOUBLE, &availability_duration_s,
+	  "Duration of the sample availability measurement, in seconds (default: 10)", "SECONDS" },
+	{ "no-simulator", 0, 0, G_OPTION_ARG_NONE, &no_simulator,
+	  "Don't simulate Pupil Capture, use the real one", NULL },
+	{ "block", 0, 0, G_OPTION_ARG_NONE, &block,
+	  "Run the trials in a block (start_block/stop_block), so that Pupil Capture "
+	  "is not restarted for each trial", NULL },
+	{ "curve-server-key", 0, 0, G_OPTION_ARG_FILENAME, &curve_server_key_file,
+	  "Encrypt the requests with CURVE, FILE is the public key of external-recorder", "FILE" },
+	{ "curve-client-key", 0, 0, G_OPTION_ARG_FILENAME, &curve_client_key_file,
+	  "The CURVE secret key of the benchmark, with --curve-server-key", "FILE" },
+	{ NULL }
+};
+
+/* Receives the next zmq message part as a string.
+ * Free the return value with g_free() when no longer needed.
+ */
+static char *
+receive_next_message (void *socket)
+{
+	zmq_msg_t msg;
+	int n_bytes;
+	char *str = NULL;
+	int ok;
+
+	ok = zmq_msg_init (&msg);
+	g_return_val_if_fail (ok == 0, NULL);
+
+	n_bytes = zmq_msg_recv (&msg, socket, 0);
+	if (n_bytes > 0)
+	{
+		void *raw_data;
+
+		raw_data = zmq_msg_data (&msg);
+		str = g_strndup (raw_data, n_bytes);
+	}
+
+	ok = zmq_msg_close (&msg);
+	if (ok != 0)
+	{
+		g_free (str);
+		g_return_val_if_reached (NULL);
+	}
+
+	return str;
+}
+
+static double
+get_monotonic_time_s (void)
+{
+	return g_get_monotonic_time () / (double) G_USEC_PER_SEC;
+}
+
+static void
+pack_string (msgpack_packer *packer,
+	     const char     *str)
+{
+	size_t len = strlen (str);
+
+	msgpack_pack_str (packer, len);
+	msgpack_pack_str_body (packer, str, len);
+}
+
+static void
+pack_norm_pos (msgpack_packer *packer,
+	       double          x,
+	       double          y)
+{
+	pack_string (packer, "norm_pos");
+	msgpack_pack_array (packer, 2);
+	msgpack_pack_double (packer, x);
+	msgpack_pack_double (packer, y);
+}
+
+/* Packs a gaze message with the same fields as Pupil Capture 0.9.3, only the
+ * ones that external-recorder extracts.
+ */
+static void
+pack_gaze_message (msgpack_sbuffer *buffer,
+		   double           timestamp)
+{
+	msgpack_packer packer;
+	double x;
+	double y;
+
+	x = 0.5 + 0.25 * sin (timestamp);
+	y = 0.5 + 0.25 * cos (timestamp);
+
+	msgpack_sbuffer_clear (buffer);
+	msgpack_packer_init (&packer, buffer, msgpack_sbuffer_write);
+
+	msgpack_pack_map (&packer, 5);
+
+	pack_string (&packer, "base_data");
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_map (&packer, 5);
+	pack_string (&packer, "topic");
+	pack_string (&packer, "pupil");
+	pack_string (&packer, "timestamp");
+	msgpack_pack_double (&packer, timestamp);
+	pack_string (&packer, "diameter");
+	msgpack_pack_double (&packer, 42.0);
+	pack_string (&packer, "confidence");
+	msgpack_pack_double (&packer, 0.99);
+	pack_norm_pos (&packer, x, y);
+
+	pack_string (&packer, "topic");
+	pack_string (&packer, "gaze");
+	pack_string (&packer, "confidence");
+	msgpack_pack_double (&packer, 0.98);
+	pack_norm_pos (&packer, x, y);
+	pack_string (&packer, "timestamp");
+	msgpack_pack_double (&packer, timestamp);
+}
+
+static void
+simulator_reply_to_pupil_remote (Simulator *simulator,
+				 void      *pupil_remote)
+{
+	char *request;
+	char *reply;
+
+	request = receive_next_message (pupil_remote);
+
+	if (g_strcmp0 (request, "SUB_PORT") == 0)
+	{
+		reply = g_strdup_printf ("%d", simulator->pub_port);
+	}
+	else if (g_strcmp0 (request, "R") == 0 ||
+		 g_strcmp0 (request, "r") == 0)
+	{
+		reply = g_strdup ("OK");
+	}
+	else
+	{
+		reply = g_strdup ("Unknown command.");
+	}
+
+	zmq_send (pupil_remote, reply, strlen (reply), 0);
+
+	g_free (request);
+	g_free (reply);
+}
+
+static gpointer
+simulator_thread (gpointer user_data)
+{
+	Simulator *simulator = user_data;
+	void *pupil_remote;
+	void *publisher;
+	char *pub_endpoint;
+	msgpack_sbuffer buffer;
+	gint64 period_us;
+	gint64 next_publish_us;
+
+	pupil_remote = zmq_socket (simulator->context, ZMQ_REP);
+	if (zmq_bind (pupil_remote, PUPIL_REMOTE_ENDPOINT) != 0)
+	{
+		g_error ("Simulator: error when binding \"" PUPIL_REMOTE_ENDPOINT "\": %s",
+			 g_strerror (errno));
+	}
+
+	pub_endpoint = g_strdup_printf ("tcp://*:%d", simulator->pub_port);
+	publisher = zmq_socket (simulator->context, ZMQ_PUB);
+	if (zmq_bind (publisher, pub_endpoint) != 0)
+	{
+		g_error ("Simulator: error when binding \"%s\": %s",
+			 pub_endpoint,
+			 g_strerror (errno));
+	}
+
+	msgpack_sbuffer_init (&buffer);
+
+	period_us = simulator->rate_hz > 0.0 ? G_USEC_PER_SEC / simulator->rate_hz : -1;
+	next_publish_us = g_get_monotonic_time ();
+
+	while (!g_atomic_int_get (&simulator->quit))
+	{
+		zmq_pollitem_t item = { pupil_remote, 0, ZMQ_POLLIN, 0 };
+		gint64 now_us;
+		long timeout_ms;
+
+		now_us = g_get_monotonic_time ();
+
+		if (period_us > 0 && now_us >= next_publish_us)
+		{
+			const char *topic = "gaze";
+
+			pack_gaze_message (&buffer, now_us / (double) G_USEC_PER_SEC);
+			zmq_send (publisher, topic, strlen (topic), ZMQ_SNDMORE);
+			zmq_send (publisher, buffer.data, buffer.size, 0);
+			simulator->n_published++;
+
+			next_publish_us += period_us;
+			if (next_publish_us < now_us)
+			{
+				/* We are late, don't try to catch up with a burst. */
+				next_publish_us = now_us + period_us;
+			}
+		}
+
+		if (period_us > 0)
+		{
+			timeout_ms = (next_publish_us - now_us) / 1000;
+			timeout_ms = MAX (timeout_ms, 0);
+		}
+		else
+		{
+			timeout_ms = 100;
+		}
+
+		if (zmq_poll (&item, 1, timeout_ms) > 0 &&
+		    (item.revents & ZMQ_POLLIN))
+		{
+			simulator_reply_to_pupil_remote (simulator, pupil_remote);
+		}
+	}
+
+	msgpack_sbuffer_destroy (&buffer);
+	g_free (pub_endpoint);
+	zmq_close (publisher);
+	zmq_close (pupil_remote);
+
+	return NULL;
+}
+
+static void
+samples_init (Samples    *samples,
+	      const char *name)
+{
+	samples->name = name;
+	samples->values = g_array_new (FALSE, FALSE, sizeof (double));
+}
+
+static void
+samples_clear (Samples *samples)
+{
+	g_array_free (samples->values, TRUE);
+	samples->values = NULL;
+}
+
+static void
+samples_add (Samples *samples,
+	     double   value_us)
+{
+	g_array_append_val (samples->values, value_us);
+}
+
+static int
+compare_doubles (gconstpointer a,
+		 gconstpointer b)
+{
+	double da = *(const double *) a;
+	double db = *(const double *) b;
+
+	return (da > db) - (da < db);
+}
+
+/* Nearest-rank percentile, @samples->values must be sorted. */
+static double
+samples_get_percentile (Samples *samples,
+			double   percentile)
+{
+	guint n = samples->values->len;
+	guint rank;
+
+	rank = (guint) ceil (percentile / 100.0 * n);
+	rank = CLAMP (rank, 1, n);
+
+	return g_array_index (samples->values, double, rank - 1);
+}
+
+static void
+samples_print (Samples *samples)
+{
+	if (samples->values->len == 0)
+	{
+		g_print ("%-24s %8s\n", samples->name, "no data");
+		return;
+	}
+
+	g_array_sort (samples->values, compare_doubles);
+
+	g_print ("%-24s %8u %10.1f %10.1f %10.1f %10.1f\n",
+		 samples->name,
+		 samples->values->len,
+		 samples_get_percentile (samples, 50.0),
+		 samples_get_percentile (samples, 99.0),
+		 samples_get_percentile (samples, 99.9),
+		 g_array_index (samples->values, double, samples->values->len - 1));
+}
+
+/* Sends @request and waits for the reply. The round-trip time is added to
+ * @samples. Free the return value with g_free() when no longer needed.
+ */
+static char *
+timed_request (void       *requester,
+	       const char *request,
+	       Samples    *samples)
+{
+	gint64 begin_us;
+	char *reply;
+
+	begin_us = g_get_monotonic_time ();
+	zmq_send (requester, request, strlen (request), 0);
+	reply = receive_next_message (requester);
+	samples_add (samples, g_get_monotonic_time () - begin_us);
+
+	if (reply == NULL)
+	{
+		g_error ("No reply received for the request '%s'.", request);
+	}
+
+	return reply;
+}
+
+/* Parses the timestamps in a receive_data reply and adds to @samples the time
+ * elapsed since the sample was published.
+ * Returns the number of samples in @reply.
+ */
+static guint
+add_availability_latencies (const char *reply,
+			    double      reply_time_s,
+			    Samples    *samples)
+{
+	const char *prefix = "timestamp:";
+	const char *pos = reply;
+	guint n_samples = 0;
+
+	while ((pos = strstr (pos, prefix)) != NULL)
+	{
+		double timestamp;
+
+		pos += strlen (prefix);
+		timestamp = g_ascii_strtod (pos, NULL);
+		samples_add (samples, (reply_time_s - timestamp) * G_USEC_PER_SEC);
+		n_samples++;
+	}
+
+	return n_samples;
+}
+
+/* Polls the status until external-recorder receives the Pupil messages, and
+ * prints how long it took.
+ */
+static void
+wait_until_ready (void *requester)
+{
+	gint64 begin_us;
+	char *reply;
+
+	begin_us = g_get_monotonic_time ();
+
+	while (TRUE)
+	{
+		zmq_send (requester, "status", strlen ("status"), 0);
+		reply = receive_next_message (requester);
+		if (reply == NULL)
+		{
+			g_error ("No reply received for the request 'status'.");
+		}
+
+		if (!g_str_equal (reply, "waiting_for_pupil"))
+		{
+			break;
+		}
+
+		g_free (reply);
+		g_usleep (10 * 1000);
+	}
+
+	g_printerr ("external-recorder ready after %.1lf ms (status: %s).\n",
+		    (g_get_monotonic_time () - begin_us) / 1000.0,
+		    reply);
+	g_free (reply);
+}
+
+static void
+run_control_benchmark (void    *requester,
+		       Samples *status_samples,
+		       Samples *start_samples,
+		       Samples *stop_samples,
+		       Samples *receive_data_samples)
+{
+	int i;
+
+	for (i = 0; i < n_iterations; i++)
+	{
+		g_free (timed_request (requester, "status", status_samples));
+		g_free (timed_request (requester, "start", start_samples));
+		g_free (timed_request (requester, "status", status_samples));
+		g_free (timed_request (requester, "stop", stop_samples));
+		g_free (timed_request (requester, "receive_data", receive_data_samples));
+
+		if ((i + 1) % 100 == 0)
+		{
+			g_printerr ("\r%d/%d iterations", i + 1, n_iterations);
+		}
+	}
+
+	g_printerr ("\n");
+}
+
+/* Measures a trial boundary (stop, receive_data, start), with one round-trip
+ * per request and with a single batch request.
+ */
+static void
+run_trial_boundary_benchmark (void    *requester,
+			      Samples *sequential_samples,
+			      Samples *batch_samples)
+{
+	static const char *requests[] = { "stop", "receive_data", "start" };
+	Samples unused;
+	int i;
+
+	samples_init (&unused, "unused");
+
+	g_free (timed_request (requester, "start", &unused));
+
+	for (i = 0; i < n_iterations; i++)
+	{
+		gint64 begin_us;
+		guint request_num;
+
+		begin_us = g_get_monotonic_time ();
+		for (request_num = 0; request_num < G_N_ELEMENTS (requests); request_num++)
+		{
+			g_free (timed_request (requester, requests[request_num], &unused));
+		}
+		samples_add (sequential_samples, g_get_monotonic_time () - begin_us);
+
+		begin_us = g_get_monotonic_time ();
+		for (request_num = 0; request_num < G_N_ELEMENTS (requests); request_num++)
+		{
+			const char *request = requests[request_num];
+			gboolean last = request_num + 1 == G_N_ELEMENTS (requests);
+
+			zmq_send (requester, request, strlen (request), last ? 0 : ZMQ_SNDMORE);
+		}
+		for (request_num = 0; request_num < G_N_ELEMENTS (requests); request_num++)
+		{
+			char *reply;
+
+			/* An empty receive_data reply is received as NULL. */
+			reply = receive_next_message (requester);
+			g_free (reply);
+		}
+		samples_add (batch_samples, g_get_monotonic_time () - begin_us);
+	}
+
+	g_free (timed_request (requester, "stop", &unused));
+	g_free (timed_request (requester, "receive_data", &unused));
+	samples_clear (&unused);
+}
+
+/* Polls receive_data back-to-back while recording, so the polling granularity
+ * is one round-trip.
+ */
+static void
+run_availability_benchmark (void    *requester,
+			    Samples *receive_data_samples,
+			    Samples *availability_samples)
+{
+	Samples unused;
+	double end_time_s;
+	guint n_samples = 0;
+
+	samples_init (&unused, "unused");
+
+	g_free (timed_request (requester, "start", &unused));
+
+	/* Flush the data recorded before the start. */
+	g_free (timed_request (requester, "receive_data", &unused));
+
+	end_time_s = get_monotonic_time_s () + availability_duration_s;
+
+	while (get_monotonic_time_s () < end_time_s)
+	{
+		char *reply;
+
+		reply = timed_request (requester, "receive_data", receive_data_samples);
+		n_samples += add_availability_latencies (reply,
+							 get_monotonic_time_s (),
+							 availability_samples);
+		g_free (reply);
+	}
+
+	g_free (timed_request (requester, "stop", &unused));
+	g_free (timed_request (requester, "receive_data", &unused));
+
+	g_printerr ("%u samples received during %.1lf seconds.\n",
+		    n_samples,
+		    availability_duration_s);
+
+	samples_clear (&unused);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+	GOptionContext *option_context;
+	GError *error = NULL;
+	void *context;
+	void *requester;
+	Simulator simulator = { 0 };
+	Samples status_samples;
+	Samples start_samples;
+	Samples stop_samples;
+	Samples receive_data_samples;
+	Samples sequential_boundary_samples;
+	Samples batch_boundary_samples;
+	Samples receive_data_recording_samples;
+	Samples availability_samples;
+
+	option_context = g_option_context_new (NULL);
+	g_option_context_set_summary (option_context,
+				      "End-to-end latency benchmark for external-recorder.");
+	g_option_context_add_main_entries (option_context, entries, NULL);
+	if (!g_option_context_parse (option_context, &argc, &argv, &error))
+	{
+		g_printerr ("%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (option_context);
+
+	if ((curve_server_key_file == NULL) != (curve_client_key_file == NULL))
+	{
+		g_printerr ("--curve-server-key and --curve-client-key must be used together.\n");
+		return EXIT_FAILURE;
+	}
+
+	context = zmq_ctx_new ();
+
+	if (!no_simulator)
+	{
+		simulator.context = context;
+		simulator.pub_port = pub_port;
+		simulator.rate_hz = gaze_rate_hz;
+		simulator.thread = g_thread_new ("pupil-simulator", simulator_thread, &simulator);
+
+		g_printerr ("Simulated Pupil Capture publishing gaze at %.1lf Hz.\n"
+			    "Start external-recorder now, then press Enter.\n",
+			    gaze_rate_hz);
+		getchar ();
+	}
+
+	requester = zmq_socket (context, ZMQ_REQ);
+
+	if (curve_server_key_file != NULL)
+	{
+		if (!curve_setup_client (requester,
+					 curve_server_key_file,
+					 curve_client_key_file,
+					 &error))
+		{
+			g_printerr ("%s\n", error->message);
+			return EXIT_FAILURE;
+		}
+
+		g_printerr ("Requests encrypted with CURVE.\n");
+	}
+
+	zmq_connect (requester, endpoint);
+
+	if (!no_simulator)
+	{
+		wait_until_ready (requester);
+	}
+
+	samples_init (&status_samples, "status");
+	samples_init (&start_samples, "start");
+	samples_init (&stop_samples, "stop");
+	samples_init (&receive_data_samples, "receive_data");
+	samples_init (&sequential_boundary_samples, "stop+receive_data+start");
+	samples_init (&batch_boundary_samples, "same, as a batch");
+	samples_init (&receive_data_recording_samples, "receive_data (polling)");
+	samples_init (&availability_samples, "sample availability");
+
+	if (block)
+	{
+		Samples unused;
+
+		samples_init (&unused, "unused");
+		g_free (timed_request (requester, "start_block", &unused));
+		samples_clear (&unused);
+	}
+
+	run_control_benchmark (requester,
+			       &status_samples,
+			       &start_samples,
+			       &stop_samples,
+			       &receive_data_samples);
+
+	run_trial_boundary_benchmark (requester,
+				      &sequential_boundary_samples,
+				      &batch_boundary_samples);
+
+	if (!no_simulator)
+	{
+		run_availability_benchmark (requester,
+					    &receive_data_recording_samples,
+					    &availability_samples);
+	}
+
+	if (block)
+	{
+		Samples unused;
+
+		samples_init (&unused, "unused");
+		g_free (timed_request (requester, "stop_block", &unused));
+		samples_clear (&unused);
+	}
+
+	zmq_close (requester);
+
+	if (simulator.thread != NULL)
+	{
+		g_atomic_int_set (&simulator.quit, TRUE);
+		g_thread_join (simulator.thread);
+	}
+
+	g_print ("\nLatencies in microseconds:\n");
+	g_print ("%-24s %8s %10s %10s %10s %10s\n",
+		 "request", "count", "p50", "p99", "p99.9", "max");
+	samples_print (&status_samples);
+	samples_print (&start_samples);
+	samples_print (&stop_samples);
+	samples_print (&receive_data_samples);
+	samples_print (&sequential_boundary_samples);
+	samples_print (&batch_boundary_samples);
+
+	if (!no_simulator)
+	{
+		samples_print (&receive_data_recording_samples);
+		samples_print (&availability_samples);
+
+		g_print ("\n%" G_GUINT64_FORMAT " gaze messages published.\n",
+			 simulator.n_published);
+	}
+
+	samples_clear (&status_samples);
+	samples_clear (&start_samples);
+	samples_clear (&stop_samples);
+	samples_clear (&receive_data_samples);
+	samples_clear (&sequential_boundary_samples);
+	samples_clear (&batch_boundary_samples);
+	samples_clear (&receive_data_recording_samples);
+	samples_clear (&availability_samples);
+
+	zmq_ctx_destroy (context);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Shared-memory reader example: follows the ring of samples exported by
+ * external-recorder (see shm.name in the configuration) and prints them.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "shm-ring.h"
+
+static char *name = "/cosy-pupil";
+
+static GOptionEntry entries[] =
+{
+	{ "name", 'n', 0, G_OPTION_ARG_STRING, &name,
+	  "Name of the shared memory (default: /cosy-pupil)", "NAME" },
+	{ NULL }
+};
+
+int
+main (int    argc,
+      char **argv)
+{
+	GOptionContext *option_context;
+	GError *error = NULL;
+	ShmRing *ring;
+	guint64 next_index;
+	guint64 n_lost = 0;
+
+	option_context = g_option_context_new (NULL);
+	g_option_context_add_main_entries (option_context, entries, NULL);
+	if (!g_option_context_parse (option_context, &argc, &argv, &error))
+	{
+		g_printerr ("%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (option_context);
+
+	ring = shm_ring_open (name, &error);
+	if (ring == NULL)
+	{
+		g_printerr ("%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	/* Start with the next sample. */
+	next_index = shm_ring_get_write_index (ring);
+
+	while (TRUE)
+	{
+		guint64 write_index;
+
+		write_index = shm_ring_get_write_index (ring);
+
+		for (; next_index < write_index; next_index++)
+		{
+			Data data;
+			guint64 flags;
+
+			if (!shm_ring_read (ring, next_index, &data, &flags))
+			{
+				n_lost++;
+				g_printerr ("Sample %" G_GUINT64_FORMAT " overwritten "
+					    "(%" G_GUINT64_FORMAT " lost).\n",
+					    next_index,
+					    n_lost);
+				continue;
+			}
+
+			printf ("%" G_GUINT64_FORMAT " timestamp=%lf gaze_x=%lf gaze_y=%lf "
+				"gaze_confidence=%lf%s\n",
+				next_index,
+				data.timestamp,
+				data.gaze_norm_pos_x,
+				data.gaze_norm_pos_y,
+				data.gaze_confidence,
+				(flags & SHM_RING_FLAG_RECORDING) ? " [Recording]" : "");
+		}
+
+		fflush (stdout);
+
+		/* A real-time consumer would spin instead. */
+		g_usleep (1000);
+	}
+
+	shm_ring_free (ring);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,250 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Tests of the CURVE authentication: a round trip through a CURVE server
+ * with the ZAP handler, from an authorized client and from an unknown one.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <zmq.h>
+#include "curve.h"
+
+/* Long enough for the handshake on a loaded machine. */
+#define TIMEOUT_MS 2000
+
+typedef struct _Fixture Fixture;
+struct _Fixture
+{
+	char *dir;
+	char *server_prefix;
+	char *client_prefix;
+	char *unknown_prefix;
+	char *authorized_keys_file;
+
+	void *context;
+	CurveAuthenticator *authenticator;
+	void *server;
+	char endpoint[256];
+};
+
+static char *
+write_keypair (const char *dir,
+	       const char *name)
+{
+	char *prefix;
+	GError *error = NULL;
+
+	prefix = g_build_filename (dir, name, NULL);
+	curve_write_keypair (prefix, &error);
+	g_assert_no_error (error);
+
+	return prefix;
+}
+
+static void
+fixture_set_up (Fixture       *fixture,
+		gconstpointer  user_data)
+{
+	char public_key[CURVE_KEY_SIZE];
+	char *client_public_key_file;
+	char *server_secret_key_file;
+	char *contents;
+	size_t endpoint_size;
+	int timeout_ms = TIMEOUT_MS;
+	int linger_ms = 0;
+	GError *error = NULL;
+
+	fixture->dir = g_dir_make_tmp ("test-curve-XXXXXX", &error);
+	g_assert_no_error (error);
+
+	fixture->server_prefix = write_keypair (fixture->dir, "server");
+	fixture->client_prefix = write_keypair (fixture->dir, "client");
+	fixture->unknown_prefix = write_keypair (fixture->dir, "unknown");
+
+	/* Only the client is authorized. */
+	client_public_key_file = g_strconcat (fixture->client_prefix, ".pub", NULL);
+	g_file_get_contents (client_public_key_file, &contents, NULL, &error);
+	g_assert_no_error (error);
+
+	fixture->authorized_keys_file = g_build_filename (fixture->dir, "authorized-keys", NULL);
+	g_file_set_contents (fixture->authorized_keys_file, contents, -1, &error);
+	g_assert_no_error (error);
+
+	g_free (contents);
+	g_free (client_public_key_file);
+
+	fixture->context = zmq_ctx_new ();
+	fixture->authenticator = curve_authenticator_new (fixture->context,
+							  fixture->authorized_keys_file,
+							  &error);
+	g_assert_no_error (error);
+
+	/* CURVE is not used on inproc://, hence TCP on a random port. */
+	fixture->server = zmq_socket (fixture->context, ZMQ_REP);
+	zmq_setsockopt (fixture->server, ZMQ_RCVTIMEO, &timeout_ms, sizeof (int));
+	zmq_setsockopt (fixture->server, ZMQ_LINGER, &linger_ms, sizeof (int));
+
+	server_secret_key_file = g_strconcat (fixture->server_prefix, ".key", NULL);
+	curve_setup_server (fixture->server, server_secret_key_file, public_key, &error);
+	g_assert_no_error (error);
+	g_free (server_secret_key_file);
+
+	g_assert_cmpint (zmq_bind (fixture->server, "tcp://127.0.0.1:*"), ==, 0);
+
+	endpoint_size = sizeof (fixture->endpoint);
+	g_assert_cmpint (zmq_getsockopt (fixture->server,
+					 ZMQ_LAST_ENDPOINT,
+					 fixture->endpoint,
+					 &endpoint_size), ==, 0);
+}
+
+static void
+fixture_tear_down (Fixture       *fixture,
+		   gconstpointer  user_data)
+{
+	const char *suffixes[] = { ".key", ".pub" };
+	const char *prefixes[] =
+	{
+		fixture->server_prefix,
+		fixture->client_prefix,
+		fixture->unknown_prefix
+	};
+	guint i;
+	guint j;
+
+	zmq_close (fixture->server);
+
+	/* Also stops the ZAP handler. */
+	zmq_ctx_destroy (fixture->context);
+	curve_authenticator_free (fixture->authenticator);
+
+	for (i = 0; i < G_N_ELEMENTS (prefixes); i++)
+	{
+		for (j = 0; j < G_N_ELEMENTS (suffixes); j++)
+		{
+			char *filename = g_strconcat (prefixes[i], suffixes[j], NULL);
+
+			g_remove (filename);
+			g_free (filename);
+		}
+
+		g_free ((char *) prefixes[i]);
+	}
+
+	g_remove (fixture->authorized_keys_file);
+	g_free (fixture->authorized_keys_file);
+
+	g_rmdir (fixture->dir);
+	g_free (fixture->dir);
+}
+
+/* Returns: a REQ socket connected to the server with the keypair of
+ * @prefix.
+ */
+static void *
+connect_client (Fixture    *fixture,
+		const char *prefix)
+{
+	char *server_key_file;
+	char *secret_key_file;
+	void *client;
+	int timeout_ms = TIMEOUT_MS;
+	int linger_ms = 0;
+	GError *error = NULL;
+
+	client = zmq_socket (fixture->context, ZMQ_REQ);
+	zmq_setsockopt (client, ZMQ_RCVTIMEO, &timeout_ms, sizeof (int));
+	zmq_setsockopt (client, ZMQ_SNDTIMEO, &timeout_ms, sizeof (int));
+	zmq_setsockopt (client, ZMQ_LINGER, &linger_ms, sizeof (int));
+
+	server_key_file = g_strconcat (fixture->server_prefix, ".pub", NULL);
+	secret_key_file = g_strconcat (prefix, ".key", NULL);
+
+	curve_setup_client (client, server_key_file, secret_key_file, &error);
+	g_assert_no_error (error);
+
+	g_free (server_key_file);
+	g_free (secret_key_file);
+
+	g_assert_cmpint (zmq_connect (client, fixture->endpoint), ==, 0);
+
+	return client;
+}
+
+static void
+test_authorized_key (Fixture       *fixture,
+		     gconstpointer  user_data)
+{
+	void *client;
+	char buf[16];
+
+	client = connect_client (fixture, fixture->client_prefix);
+
+	g_assert_cmpint (zmq_send (client, "ping", 4, 0), ==, 4);
+	g_assert_cmpint (zmq_recv (fixture->server, buf, sizeof (buf), 0), ==, 4);
+	g_assert_cmpmem (buf, 4, "ping", 4);
+
+	g_assert_cmpint (zmq_send (fixture->server, "pong", 4, 0), ==, 4);
+	g_assert_cmpint (zmq_recv (client, buf, sizeof (buf), 0), ==, 4);
+	g_assert_cmpmem (buf, 4, "pong", 4);
+
+	zmq_close (client);
+}
+
+static void
+test_unknown_key (Fixture       *fixture,
+		  gconstpointer  user_data)
+{
+	void *client;
+	char buf[16];
+
+	client = connect_client (fixture, fixture->unknown_prefix);
+
+	/* The request is queued, but never delivered: the handshake fails. */
+	g_assert_cmpint (zmq_send (client, "ping", 4, 0), ==, 4);
+	g_assert_cmpint (zmq_recv (fixture->server, buf, sizeof (buf), 0), ==, -1);
+	g_assert_cmpint (zmq_errno (), ==, EAGAIN);
+
+	zmq_close (client);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	/* The ZAP handler warns about the refused client. */
+	g_log_set_always_fatal (G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_ERROR);
+
+	if (!zmq_has ("curve"))
+	{
+		g_printerr ("libzmq built without CURVE support, skipping the tests.\n");
+		return 0;
+	}
+
+	g_test_add ("/curve/authorized-key", Fixture, NULL,
+		    fixture_set_up, test_authorized_key, fixture_tear_down);
+	g_test_add ("/curve/unknown-key", Fixture, NULL,
+		    fixture_set_up, test_unknown_key, fixture_tear_down);
+
+	return g_test_run ();
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Tests of the text format of receive_data: the doubles formatted by
+ * data_format_double() must be the same bytes as with "%lf", which is the
+ * historical format parsed by cosy-pupil-client.
+ */
+
+#include <glib.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include "data-format.h"
+
+static void
+check_double (double value)
+{
+	char buf[DATA_FORMAT_DOUBLE_BUF_SIZE];
+	char expected[DATA_FORMAT_DOUBLE_BUF_SIZE];
+	gsize len;
+
+	len = data_format_double (buf, value);
+	g_snprintf (expected, sizeof (expected), "%lf", value);
+
+	if (len != strlen (expected) ||
+	    memcmp (buf, expected, len) != 0)
+	{
+		g_error ("%.17g formatted as \"%.*s\", expected \"%s\".",
+			 value, (int) len, buf, expected);
+	}
+}
+
+static void
+test_edge_values (void)
+{
+	const double values[] =
+	{
+		0.0, -0.0, 1.0, -1.0, 0.5, -0.5,
+
+		/* Rounded to zero, printed with a sign if negative. */
+		1e-7, -1e-7, 4.9999999e-7, -4.9999999e-7,
+
+		/* Rounding ties in decimal, not exactly representable. */
+		0.0000005, -0.0000005, 0.1234565, -0.1234565, 1.0000005,
+		2.5e-6, 0.9999995, 123.4567895,
+
+		/* Carries into the integer part. */
+		0.9999996, -0.9999996, 9.9999999, 999999.9999999,
+
+		/* Exactly representable ties. */
+		0.5 / 1048576.0, 1.0 + 1.0 / 1024.0, -3.0 / 8.0,
+
+		/* Large magnitudes, around the limit of the fast path. */
+		123456789.123456, -987654321.654321, 1e14 + 0.5,
+		999999999999999.0, 999999999999999.9, 1e15, -1e15, 1e15 + 1.0,
+		1e300, -1e300, DBL_MAX, -DBL_MAX,
+
+		/* Tiny magnitudes. */
+		DBL_MIN, -DBL_MIN, DBL_EPSILON, 5e-324,
+
+		/* Typical Pupil values: timestamps, diameters, positions. */
+		1234.567891, 86400.000001, 45.123456789, 0.987654321,
+
+		INFINITY, -INFINITY, NAN
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (values); i++)
+	{
+		check_double (values[i]);
+	}
+}
+
+/* Values with 7 decimals and with an exact tie on the 7th one, in all
+ * ranges of magnitude.
+ */
+static void
+test_decimal_values (void)
+{
+	GRand *rand;
+	guint i;
+
+	rand = g_rand_new_with_seed (42);
+
+	for (i = 0; i < 200000; i++)
+	{
+		double magnitude = pow (10.0, g_rand_int_range (rand, -7, 15));
+		double value;
+
+		value = g_rand_double_range (rand, -1.0, 1.0) * magnitude;
+		check_double (value);
+
+		value = floor (value * 1e7) / 1e7;
+		check_double (value);
+
+		value = (floor (value * 1e6) + 0.5) / 1e6;
+		check_double (value);
+	}
+
+	g_rand_free (rand);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/data-format/edge-values", test_edge_values);
+	g_test_add_func ("/data-format/decimal-values", test_decimal_values);
+
+	return g_test_run ();
+}
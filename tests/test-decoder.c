@@ -0,0 +1,534 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Conformance tests of the decoder of the Pupil messages. They describe how
+ * the msgpack data sent by Pupil Capture is extracted, so that a new
+ * implementation of the decoder can be checked against them.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <msgpack.h>
+#include "pupil-decoder.h"
+
+static msgpack_sbuffer buffer;
+static msgpack_packer packer;
+
+static void
+pack_string (const char *str)
+{
+	msgpack_pack_str (&packer, strlen (str));
+	msgpack_pack_str_body (&packer, str, strlen (str));
+}
+
+static void
+pack_norm_pos (double x,
+	       double y)
+{
+	msgpack_pack_array (&packer, 2);
+	msgpack_pack_double (&packer, x);
+	msgpack_pack_double (&packer, y);
+}
+
+/* A pupil datum as in sample-pupil-msgpack-data, with a few of the keys that
+ * must be ignored.
+ */
+static void
+pack_pupil_datum (double timestamp,
+		  double diameter,
+		  double confidence,
+		  double x,
+		  double y)
+{
+	msgpack_pack_map (&packer, 8);
+
+	pack_string ("topic");
+	pack_string ("pupil");
+
+	pack_string ("timestamp");
+	msgpack_pack_double (&packer, timestamp);
+
+	pack_string ("diameter");
+	msgpack_pack_double (&packer, diameter);
+
+	pack_string ("diameter_3d");
+	msgpack_pack_double (&packer, 12.5);
+
+	pack_string ("confidence");
+	msgpack_pack_double (&packer, confidence);
+
+	pack_string ("model_confidence");
+	msgpack_pack_double (&packer, 0.25);
+
+	pack_string ("norm_pos");
+	pack_norm_pos (x, y);
+
+	pack_string ("theta");
+	msgpack_pack_int (&packer, 0);
+}
+
+/* The beginning of a gaze datum, the caller packs the base_data value and
+ * @n_other_keys other key-value pairs.
+ */
+static void
+pack_gaze_begin (guint n_other_keys)
+{
+	msgpack_pack_map (&packer, 4 + n_other_keys);
+
+	pack_string ("topic");
+	pack_string ("gaze");
+
+	pack_string ("confidence");
+	msgpack_pack_double (&packer, 0.75);
+
+	pack_string ("norm_pos");
+	pack_norm_pos (0.25, 0.5);
+
+	pack_string ("base_data");
+}
+
+static PupilDecoderResult
+decode (PupilDecoder *decoder,
+	Data         *data)
+{
+	PupilDecoderResult result;
+
+	result = pupil_decoder_decode_gaze (decoder, buffer.data, buffer.size, data);
+	msgpack_sbuffer_clear (&buffer);
+
+	return result;
+}
+
+static PupilDecoder *
+create_decoder (void)
+{
+	PupilDecoder *decoder;
+
+	decoder = pupil_decoder_new ();
+	pupil_decoder_set_max_warnings (decoder, 0);
+
+	return decoder;
+}
+
+static void
+test_monocular (void)
+{
+	PupilDecoder *decoder;
+	Data data;
+
+	decoder = create_decoder ();
+
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 1);
+	pack_pupil_datum (4135.300038, 31.5, 0.875, 0.125, 0.625);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, 4135.300038);
+	g_assert_cmpfloat (data.pupil_diameter, ==, 31.5);
+	g_assert_cmpfloat (data.pupil_confidence, ==, 0.875);
+	g_assert_cmpfloat (data.pupil_norm_pos_x, ==, 0.125);
+	g_assert_cmpfloat (data.pupil_norm_pos_y, ==, 0.625);
+	g_assert_cmpfloat (data.gaze_confidence, ==, 0.75);
+	g_assert_cmpfloat (data.gaze_norm_pos_x, ==, 0.25);
+	g_assert_cmpfloat (data.gaze_norm_pos_y, ==, 0.5);
+	g_assert_cmpfloat (data.gaze_filtered_x, ==, -1.0);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 0);
+
+	pupil_decoder_free (decoder);
+}
+
+/* Only the first pupil datum is taken into account, with a warning. */
+static void
+test_binocular (void)
+{
+	PupilDecoder *decoder;
+	Data data;
+
+	decoder = create_decoder ();
+
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 2);
+	pack_pupil_datum (10.0, 30.0, 0.5, 0.125, 0.25);
+	pack_pupil_datum (10.5, 40.0, 0.75, 0.375, 0.5);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, 10.0);
+	g_assert_cmpfloat (data.pupil_diameter, ==, 30.0);
+	g_assert_cmpfloat (data.pupil_norm_pos_x, ==, 0.125);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 1);
+
+	/* Empty base_data: the gaze values are still extracted. */
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 0);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, -1.0);
+	g_assert_cmpfloat (data.gaze_norm_pos_x, ==, 0.25);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 2);
+
+	pupil_decoder_free (decoder);
+}
+
+/* Integers and single-precision floats are accepted for the float values. */
+static void
+test_number_types (void)
+{
+	PupilDecoder *decoder;
+	Data data;
+
+	decoder = create_decoder ();
+
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_map (&packer, 4);
+	pack_string ("timestamp");
+	msgpack_pack_int64 (&packer, 16648);
+	pack_string ("diameter");
+	msgpack_pack_int (&packer, -1);
+	pack_string ("confidence");
+	msgpack_pack_float (&packer, 0.5f);
+	pack_string ("norm_pos");
+	msgpack_pack_array (&packer, 2);
+	msgpack_pack_int (&packer, 0);
+	msgpack_pack_uint64 (&packer, 1);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, 16648.0);
+	g_assert_cmpfloat (data.pupil_diameter, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_confidence, ==, 0.5);
+	g_assert_cmpfloat (data.pupil_norm_pos_x, ==, 0.0);
+	g_assert_cmpfloat (data.pupil_norm_pos_y, ==, 1.0);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 0);
+
+	pupil_decoder_free (decoder);
+}
+
+/* A known key with a wrong type is skipped with a warning, the other keys are
+ * still extracted.
+ */
+static void
+test_wrong_types (void)
+{
+	PupilDecoder *decoder;
+	Data data;
+
+	decoder = create_decoder ();
+
+	pack_gaze_begin (3);
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_map (&packer, 2);
+	pack_string ("timestamp");
+	pack_string ("16648.3");
+	pack_string ("diameter");
+	msgpack_pack_double (&packer, 20.0);
+
+	/* Duplicated keys: the last valid value wins. */
+	pack_string ("confidence");
+	msgpack_pack_nil (&packer);
+	pack_string ("norm_pos");
+	msgpack_pack_array (&packer, 3);
+	msgpack_pack_double (&packer, 0.0);
+	msgpack_pack_double (&packer, 0.0);
+	msgpack_pack_double (&packer, 0.0);
+	pack_string ("topic");
+	msgpack_pack_true (&packer);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_diameter, ==, 20.0);
+	g_assert_cmpfloat (data.gaze_confidence, ==, 0.75);
+	g_assert_cmpfloat (data.gaze_norm_pos_x, ==, 0.25);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 4);
+
+	pupil_decoder_free (decoder);
+}
+
+static void
+test_missing_keys (void)
+{
+	PupilDecoder *decoder;
+	Data data;
+
+	decoder = create_decoder ();
+
+	/* No base_data. */
+	msgpack_pack_map (&packer, 2);
+	pack_string ("topic");
+	pack_string ("gaze");
+	pack_string ("norm_pos");
+	pack_norm_pos (0.25, 0.75);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_diameter, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_confidence, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_norm_pos_x, ==, -1.0);
+	g_assert_cmpfloat (data.gaze_confidence, ==, -1.0);
+	g_assert_cmpfloat (data.gaze_norm_pos_x, ==, 0.25);
+	g_assert_cmpfloat (data.gaze_norm_pos_y, ==, 0.75);
+
+	/* The pupil values are only read in base_data. */
+	msgpack_pack_map (&packer, 2);
+	pack_string ("timestamp");
+	msgpack_pack_double (&packer, 1.0);
+	pack_string ("diameter");
+	msgpack_pack_double (&packer, 1.0);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_NOTHING);
+	g_assert_cmpfloat (data.timestamp, ==, -1.0);
+
+	msgpack_pack_map (&packer, 0);
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_NOTHING);
+
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 0);
+
+	pupil_decoder_free (decoder);
+}
+
+/* The keys are compared entirely, not only their prefix. */
+static void
+test_similar_keys (void)
+{
+	const char *keys[] = { "", "t", "time", "timestamps", "diameter_3d",
+			       "confidence_", "model_confidence", "norm" };
+	PupilDecoder *decoder;
+	Data data;
+	guint i;
+
+	decoder = create_decoder ();
+
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_map (&packer, G_N_ELEMENTS (keys));
+	for (i = 0; i < G_N_ELEMENTS (keys); i++)
+	{
+		pack_string (keys[i]);
+		msgpack_pack_double (&packer, 42.0);
+	}
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_diameter, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_confidence, ==, -1.0);
+	g_assert_cmpfloat (data.pupil_norm_pos_x, ==, -1.0);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 0);
+
+	pupil_decoder_free (decoder);
+}
+
+/* The topics of the newer versions of Pupil Capture have a suffix. */
+static void
+test_topics (void)
+{
+	PupilDecoder *decoder;
+	Data data;
+
+	decoder = create_decoder ();
+
+	msgpack_pack_map (&packer, 2);
+	pack_string ("topic");
+	pack_string ("gaze.3d.01.");
+	pack_string ("base_data");
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_map (&packer, 2);
+	pack_string ("topic");
+	pack_string ("pupil.0");
+	pack_string ("timestamp");
+	msgpack_pack_double (&packer, 3.0);
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_EXTRACTED);
+	g_assert_cmpfloat (data.timestamp, ==, 3.0);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 0);
+
+	msgpack_pack_map (&packer, 1);
+	pack_string ("topic");
+	pack_string ("notify");
+
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_NOTHING);
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 1);
+
+	g_assert_cmpint (pupil_decoder_determine_topic ("gaze.2d.0."), ==, TOPIC_GAZE);
+	g_assert_cmpint (pupil_decoder_determine_topic ("pupil.1"), ==, TOPIC_PUPIL);
+	g_assert_cmpint (pupil_decoder_determine_topic ("notify.recording"), ==, TOPIC_OTHER);
+	g_assert_cmpint (pupil_decoder_determine_topic (NULL), ==, TOPIC_OTHER);
+
+	pupil_decoder_free (decoder);
+}
+
+static void
+test_invalid_data (void)
+{
+	PupilDecoder *decoder;
+	Data data;
+	gsize full_size;
+
+	decoder = create_decoder ();
+
+	/* Empty message. */
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_INVALID);
+
+	/* Truncated message. */
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 1);
+	pack_pupil_datum (1.0, 2.0, 0.5, 0.5, 0.5);
+	full_size = buffer.size;
+	buffer.size = full_size / 2;
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_INVALID);
+
+	/* Not a map. */
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_double (&packer, 1.0);
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_NOTHING);
+
+	/* Keys that are not strings. */
+	msgpack_pack_map (&packer, 1);
+	msgpack_pack_int (&packer, 1);
+	msgpack_pack_double (&packer, 1.0);
+	g_assert_cmpint (decode (decoder, &data), ==, PUPIL_DECODER_RESULT_NOTHING);
+
+	g_assert_cmpuint (pupil_decoder_get_n_warnings (decoder), ==, 4);
+
+	pupil_decoder_free (decoder);
+}
+
+/* Checks that pupil_decoder_peek_timestamp() finds the same timestamp as the
+ * full decoding.
+ */
+static void
+check_peek (PupilDecoder *decoder,
+	    double        expected_timestamp)
+{
+	Data data;
+	double timestamp = -1.0;
+	gboolean found;
+
+	found = pupil_decoder_peek_timestamp (buffer.data, buffer.size, &timestamp);
+	g_assert_cmpint (found, ==, expected_timestamp != -1.0);
+	if (found)
+	{
+		g_assert_cmpfloat (timestamp, ==, expected_timestamp);
+	}
+
+	decode (decoder, &data);
+	g_assert_cmpfloat (data.timestamp, ==, expected_timestamp);
+}
+
+static void
+test_peek_timestamp (void)
+{
+	PupilDecoder *decoder;
+	const char bytes[300] = { 0 };
+	gsize timestamp_end;
+	double timestamp;
+	guint i;
+
+	decoder = create_decoder ();
+
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 2);
+	pack_pupil_datum (4135.300038, 31.5, 0.875, 0.125, 0.625);
+	pack_pupil_datum (4136.0, 31.5, 0.875, 0.125, 0.625);
+	check_peek (decoder, 4135.300038);
+
+	/* All the kinds of values to skip, before and in base_data. */
+	msgpack_pack_map (&packer, 6);
+	pack_string ("a long key, longer than 31 bytes, in a str 8");
+	msgpack_pack_bin (&packer, sizeof (bytes));
+	msgpack_pack_bin_body (&packer, bytes, sizeof (bytes));
+	msgpack_pack_int (&packer, -100000);
+	msgpack_pack_array (&packer, 20);
+	for (i = 0; i < 20; i++)
+	{
+		msgpack_pack_map (&packer, 1);
+		msgpack_pack_nil (&packer);
+		msgpack_pack_false (&packer);
+	}
+	pack_string ("sphere");
+	msgpack_pack_map (&packer, 2);
+	pack_string ("center");
+	pack_norm_pos (1.0, -2.0);
+	pack_string ("radius");
+	msgpack_pack_float (&packer, 12.0f);
+	pack_string ("id");
+	msgpack_pack_uint64 (&packer, G_MAXUINT64);
+	pack_string ("timestamp");
+	msgpack_pack_double (&packer, 1.0);
+	pack_string ("base_data");
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_map (&packer, 3);
+	pack_string ("id");
+	msgpack_pack_int64 (&packer, G_MININT64);
+	pack_string ("method");
+	pack_string ("3d c++");
+	pack_string ("timestamp");
+	msgpack_pack_int (&packer, -3);
+	check_peek (decoder, -3.0);
+
+	/* No timestamp in base_data. */
+	msgpack_pack_map (&packer, 2);
+	pack_string ("timestamp");
+	msgpack_pack_double (&packer, 1.0);
+	pack_string ("base_data");
+	msgpack_pack_array (&packer, 1);
+	msgpack_pack_map (&packer, 0);
+	check_peek (decoder, -1.0);
+
+	/* Truncated: the end of the message is not checked by the peek. */
+	pack_gaze_begin (0);
+	msgpack_pack_array (&packer, 1);
+	timestamp_end = buffer.size + strlen ("\x88\xa5topic\xa5pupil\xa9timestamp") + 9;
+	pack_pupil_datum (1.0, 2.0, 0.5, 0.5, 0.5);
+	buffer.size = timestamp_end;
+	g_assert_true (pupil_decoder_peek_timestamp (buffer.data, buffer.size, &timestamp));
+	g_assert_cmpfloat (timestamp, ==, 1.0);
+
+	/* In the timestamp. */
+	buffer.size = timestamp_end - 1;
+	g_assert_false (pupil_decoder_peek_timestamp (buffer.data, buffer.size, &timestamp));
+	msgpack_sbuffer_clear (&buffer);
+
+	pupil_decoder_free (decoder);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+	int ret;
+
+	g_test_init (&argc, &argv, NULL);
+
+	msgpack_sbuffer_init (&buffer);
+	msgpack_packer_init (&packer, &buffer, msgpack_sbuffer_write);
+
+	g_test_add_func ("/decoder/monocular", test_monocular);
+	g_test_add_func ("/decoder/binocular", test_binocular);
+	g_test_add_func ("/decoder/number-types", test_number_types);
+	g_test_add_func ("/decoder/wrong-types", test_wrong_types);
+	g_test_add_func ("/decoder/missing-keys", test_missing_keys);
+	g_test_add_func ("/decoder/similar-keys", test_similar_keys);
+	g_test_add_func ("/decoder/topics", test_topics);
+	g_test_add_func ("/decoder/invalid-data", test_invalid_data);
+	g_test_add_func ("/decoder/peek-timestamp", test_peek_timestamp);
+
+	ret = g_test_run ();
+
+	msgpack_sbuffer_destroy (&buffer);
+	return ret;
+}
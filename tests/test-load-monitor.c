@@ -0,0 +1,133 @@
+/*
+ * This file is part of cosy-pupil-server.
+ *
+ * Copyright (C) 2017 - Université Catholique de Louvain
+ *
+ * cosy-pupil-server is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * cosy-pupil-server is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * cosy-pupil-server.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Tests of the load modes with the default configuration: the cheaper modes
+ * must actually be entered, and the decimate mode must decode fewer frames
+ * than the normal mode, with and without the shared memory.
+ */
+
+#include <glib.h>
+#include "config.h"
+#include "load-monitor.h"
+
+/* The Pupil timestamps of the frames, 200 Hz. */
+#define FRAME_INTERVAL 0.005
+
+static void
+init_monitor (LoadMonitor  *monitor,
+	      const Config *config)
+{
+	load_monitor_init (monitor,
+			   config->load_adaptive,
+			   config->load_quiet_lag_ms / 1000.0,
+			   config->load_defer_lag_ms / 1000.0,
+			   config->load_decimate_lag_ms / 1000.0);
+}
+
+/* Adds @n_frames frames, each one received @lag seconds later than the
+ * first frame.
+ */
+static void
+add_frames (LoadMonitor *monitor,
+	    guint        n_frames,
+	    double       lag)
+{
+	static double pupil_timestamp = 1000.0;
+	guint i;
+
+	for (i = 0; i < n_frames; i++)
+	{
+		load_monitor_add_sample (monitor, pupil_timestamp, pupil_timestamp + lag);
+		pupil_timestamp += FRAME_INTERVAL;
+	}
+}
+
+static void
+test_modes (void)
+{
+	Config *config;
+	LoadMonitor monitor;
+
+	config = config_new ();
+	init_monitor (&monitor, config);
+
+	add_frames (&monitor, 10, 0.0);
+	g_assert_cmpint (monitor.mode, ==, LOAD_MODE_NORMAL);
+
+	add_frames (&monitor, 10, (config->load_quiet_lag_ms + 1) / 1000.0);
+	g_assert_cmpint (monitor.mode, ==, LOAD_MODE_QUIET);
+
+	add_frames (&monitor, 10, (config->load_decimate_lag_ms + 1) / 1000.0);
+	g_assert_cmpint (monitor.mode, ==, LOAD_MODE_DECIMATE);
+
+	/* Left below half of the threshold. */
+	add_frames (&monitor, 10, 0.0);
+	g_assert_cmpint (monitor.mode, ==, LOAD_MODE_NORMAL);
+
+	config_free (config);
+}
+
+static void
+test_decimate_decodes_less (void)
+{
+	Config *config;
+	LoadMonitor monitor;
+	const int intervals[] = { 0, 1 };
+	guint i;
+
+	config = config_new ();
+	init_monitor (&monitor, config);
+
+	/* The default idle.decode-interval, and 1 with the shared memory. */
+	for (i = 0; i < G_N_ELEMENTS (intervals); i++)
+	{
+		int interval = intervals[i] != 0 ? intervals[i] : config->idle_decode_interval;
+		int normal_interval;
+		int decimate_interval;
+
+		add_frames (&monitor, 10, 0.0);
+		g_assert_cmpint (monitor.mode, ==, LOAD_MODE_NORMAL);
+		normal_interval = load_monitor_get_decode_interval (&monitor,
+								    interval,
+								    config->load_decimation);
+
+		add_frames (&monitor, 10, (config->load_decimate_lag_ms + 1) / 1000.0);
+		g_assert_cmpint (monitor.mode, ==, LOAD_MODE_DECIMATE);
+		decimate_interval = load_monitor_get_decode_interval (&monitor,
+								      interval,
+								      config->load_decimation);
+
+		g_assert_cmpint (normal_interval, ==, interval);
+		g_assert_cmpint (decimate_interval, >, normal_interval);
+	}
+
+	config_free (config);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/load-monitor/modes", test_modes);
+	g_test_add_func ("/load-monitor/decimate-decodes-less", test_decimate_decodes_less);
+
+	return g_test_run ();
+}